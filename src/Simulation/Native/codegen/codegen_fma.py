@@ -108,7 +108,7 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
               add.append("store(")
             for i in range(avx_len):
               if avx_len > 1:
-                add.append("(double*)&")
+                add.append("&")
               add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
             if avx_len == 1:
               add[-1] = add[-1][:-2] + " = "
@@ -131,7 +131,7 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
             add.append("store(")
           for i in range(avx_len):
             if avx_len > 1:
-              add.append("(double*)&")
+              add.append("&")
             add.append("psi[" + indices[avx_len*r+avx_len-i-1] + "], ")
           if avx_len == 1:
             add[-1] = add[-1][:-2] + " = "
@@ -145,6 +145,51 @@ def generate_kernel_core(N, n, kernelarray, blocks, only_one_matrix, unroll_loop
   kernelarray.append("".join(add))
   kernelarray.append("\n}\n\n")
 
+# Kernels called from inside a parallel region, e.g. per tile by Fused::flush_tiled, run in the calling thread instead
+# of opening a nested region.
+serial_if_nested = " if(!omp_in_parallel())"
+
+def generate_controlled_loop(n, only_one_matrix, tab, bind):
+  # Loop over the indices whose control bits are all set, for ctrlmask != 0: l counts the free bits of the index,
+  # which are spread around the fixed target and control bits. Each thread spreads the first l of its range and then
+  # steps over the fixed bits, so there is no test per index and no iteration is wasted on a control bit that is 0.
+  core = "kernel_core(psi, i | ctrlmask"
+  for i in range(n):
+    core += ", dsorted[" + str(n-1-i) + "]"
+  core += ", mm);\n" if only_one_matrix else ", mm, mmt);\n"
+
+  fixed = "ctrlmask"
+  for i in range(n):
+    fixed += " | dsorted[" + str(i) + "]"
+
+  lines = [
+    (1, "else{"),
+    (2, "const std::size_t fixed = " + fixed + ";"),
+    (2, "std::size_t count = n;"),
+    (2, "for (std::size_t f = fixed; f != 0; f &= f - 1)"),
+    (3, "count >>= 1;"),
+    (2, "#pragma omp parallel" + bind + serial_if_nested),
+    (2, "{"),
+    (3, "std::size_t i = 0;"),
+    (3, "std::intptr_t next = -1;"),
+    (3, "#pragma omp for schedule(static)"),
+    (3, "for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(count); ++l){"),
+    (4, "if (l != next){"),
+    (5, "i = static_cast<std::size_t>(l);"),
+    (5, "for (std::size_t f = fixed; f != 0; f &= f - 1){"),
+    (6, "const std::size_t below = (f & (0 - f)) - 1;"),
+    (6, "i = ((i & ~below) << 1) | (i & below);"),
+    (5, "}"),
+    (4, "}"),
+    (4, core.rstrip("\n")),
+    (4, "i = ((i | fixed) + 1) & ~fixed;"),
+    (4, "next = l + 1;"),
+    (3, "}"),
+    (2, "}"),
+    (1, "}"),
+  ]
+  return "".join(tab*indent + line + "\n" for indent, line in lines)
+
 def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernel = ""
   
@@ -243,7 +288,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernelarray.append("#ifndef _MSC_VER\n")
   kernelarray.append("\t"*indent + "if (ctrlmask == 0){\n")
   indent += 1
-  kernelarray.append("\t"*indent + "#pragma omp parallel for collapse(LOOP_COLLAPSE"+str(n)+") schedule(static) proc_bind(spread)\n" + "\t"*indent + "for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){\n")
+  kernelarray.append("\t"*indent + "#pragma omp parallel for collapse(LOOP_COLLAPSE"+str(n)+") schedule(static) proc_bind(spread)" + serial_if_nested + "\n" + "\t"*indent + "for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){\n")
   indent = indent + 1
   for i in range(1,nc+1):
     kernelarray.append("\t"*indent + "for (std::size_t i"+str(i)+" = 0; i"+str(i)+" < dsorted["+str(i-1) + "]; i"+str(i)+" += 2 * dsorted["+str(i)+"]){\n")
@@ -275,45 +320,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernelarray.append("".join(add))
 
   # if controlmask != 0
-  indent = 1
-  kernelarray.append("\t"*indent + "else{\n")
-  indent += 1
-  kernelarray.append("\t"*indent + "#pragma omp parallel for collapse(LOOP_COLLAPSE"+str(n)+") schedule(static)\n" + "\t"*indent + "for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){\n")
-  indent = indent + 1
-  for i in range(1,nc+1):
-    kernelarray.append("\t"*indent + "for (std::size_t i"+str(i)+" = 0; i"+str(i)+" < dsorted["+str(i-1) + "]; i"+str(i)+" += 2 * dsorted["+str(i)+"]){\n")
-    indent = indent + 1
-
-  kernelarray.append("\t"*indent + "for (std::size_t i"+str(nc+1)+" = 0; i"+str(nc+1)+" < dsorted["+str(nc)+"]; ++i"+str(nc+1)+"){\n")
-  indent = indent + 1
-
-  # inner-most loop: call kernel core
-
-  kernelarray.append("\t"*indent + "if (((i0")
-  add = []
-  for i in range(n):
-    add.append(" + i"+str(i+1))
-  kernelarray.append("".join(add))
-  kernelarray.append(")&ctrlmask) == ctrlmask)\n")
-  kernelarray.append("\t"*(indent+1) + "kernel_core(psi, i0")
-  add = []
-  for i in range(n):
-    add.append(" + i"+str(i+1))
-  kernelarray.append("".join(add))
-  for i in range(n):
-    kernelarray.append(", dsorted[" + str(n-1-i) + "]")
-
-  if only_one_matrix:
-    kernelarray.append(", mm);\n")
-  else:
-    kernelarray.append(", mm, mmt);\n")
-
-  #end for(s) and if
-  add = [""]*indent
-  for i in range(indent-1,0,-1):
-    add[indent-1-i] = "\t"*i+"}\n"
-  kernelarray.append("".join(add))
-
+  kernelarray.append(generate_controlled_loop(n, only_one_matrix, "\t", " proc_bind(spread)"))
 
 ################ Start of _MSC_VER code block ##################
   kernelarray.append("#else\n")
@@ -323,7 +330,7 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   kernelarray.append(         ";\n")
   kernelarray.append("\n");
   kernelarray.append("    if (ctrlmask == 0){\n")
-  kernelarray.append("        #pragma omp parallel for schedule(static)\n")
+  kernelarray.append("        #pragma omp parallel for schedule(static)" + serial_if_nested + "\n")
   kernelarray.append("        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)\n")
   kernelarray.append("            if ((i & dmask) == zero)\n")
   kernelarray.append("                kernel_core(psi, i")
@@ -331,15 +338,8 @@ def generate_kernel(n, blocks, only_one_matrix, unroll_loops, avx_len):
   if only_one_matrix:                   kernelarray.append(", mm);\n")
   else:                                 kernelarray.append(", mm, mmt);\n")
   # if controlmask != 0
-  kernelarray.append("     } else {\n")
-  kernelarray.append("        #pragma omp parallel for schedule(static)\n")
-  kernelarray.append("        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)\n")
-  kernelarray.append("            if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)\n")
-  kernelarray.append("                kernel_core(psi, i")
-  for i in range(n):                    kernelarray.append(", dsorted[" + str(n-1-i) + "]")
-  if only_one_matrix:                   kernelarray.append(", mm);\n")
-  else:                                 kernelarray.append(", mm, mmt);\n")
-  kernelarray.append("     }\n")
+  kernelarray.append("    }\n")
+  kernelarray.append(generate_controlled_loop(n, only_one_matrix, "    ", ""))
   kernelarray.append("#endif\n")
 
   kernelarray.append("}\n")
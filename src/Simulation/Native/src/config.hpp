@@ -5,8 +5,8 @@
 
 #include <complex>
 
-// check if we want to force single precision
-/* #undef USE_SINGLE_PRECISION */
+// check if simulators should use single precision unless the caller asks for a precision
+/* #undef DEFAULT_SINGLE_PRECISION */
 
 // check if we have AVX intrinsics
 /* #undef HAVE_INTRINSICS */
@@ -32,6 +32,23 @@
 #define MICROSOFT_QUANTUM_DECL_IMPORT
 #endif
 
+// translation units that define USE_SINGLE_PRECISION build the single precision simulators, which live in their own
+// namespaces next to the double precision ones
+#ifdef USE_SINGLE_PRECISION
+#ifdef HAVE_INTRINSICS
+#ifdef HAVE_AVX512
+#define SIMULATOR SimulatorAVX512Single
+#else
+#ifdef HAVE_FMA
+#define SIMULATOR SimulatorAVX2Single
+#else
+#define SIMULATOR SimulatorAVXSingle
+#endif
+#endif
+#else
+#define SIMULATOR SimulatorGenericSingle
+#endif
+#else
 #ifdef HAVE_INTRINSICS
 #ifdef HAVE_AVX512
 #define SIMULATOR SimulatorAVX512
@@ -45,3 +62,4 @@
 #else
 #define SIMULATOR SimulatorGeneric
 #endif
+#endif
@@ -14,7 +14,7 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, M const& m, M con
 	v[0] = load1(&psi[I + d0]);
 
 	tmp[0] = fma(v[0], m[1], mt[1], tmp[0]);
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
 
 }
 
@@ -22,7 +22,7 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, M const& m, M con
 template <class V, class M>
 void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
 {
-    std::size_t n = psi.size();
+     std::size_t n = psi.size();
 	std::size_t d0 = 1ULL << id0;
 	auto m = matrix;
 	std::size_t dsorted[] = {d0};
@@ -49,7 +49,7 @@ void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
 
 #ifndef _MSC_VER
 	if (ctrlmask == 0){
-		#pragma omp parallel for collapse(LOOP_COLLAPSE1) schedule(static) proc_bind(spread)
+		#pragma omp parallel for collapse(LOOP_COLLAPSE1) schedule(static) proc_bind(spread) if(!omp_in_parallel())
 		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
 			for (std::size_t i1 = 0; i1 < dsorted[0]; ++i1){
 				kernel_core(psi, i0 + i1, dsorted[0], mm, mmt);
@@ -57,29 +57,63 @@ void kernel(V& psi, unsigned id0, M const& matrix, std::size_t ctrlmask)
 		}
 	}
 	else{
-		#pragma omp parallel for collapse(LOOP_COLLAPSE1) schedule(static)
-		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
-			for (std::size_t i1 = 0; i1 < dsorted[0]; ++i1){
-				if (((i0 + i1)&ctrlmask) == ctrlmask)
-					kernel_core(psi, i0 + i1, dsorted[0], mm, mmt);
+		const std::size_t fixed = ctrlmask | dsorted[0];
+		std::size_t count = n;
+		for (std::size_t f = fixed; f != 0; f &= f - 1)
+			count >>= 1;
+		#pragma omp parallel proc_bind(spread) if(!omp_in_parallel())
+		{
+			std::size_t i = 0;
+			std::intptr_t next = -1;
+			#pragma omp for schedule(static)
+			for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(count); ++l){
+				if (l != next){
+					i = static_cast<std::size_t>(l);
+					for (std::size_t f = fixed; f != 0; f &= f - 1){
+						const std::size_t below = (f & (0 - f)) - 1;
+						i = ((i & ~below) << 1) | (i & below);
+					}
+				}
+				kernel_core(psi, i | ctrlmask, dsorted[0], mm, mmt);
+				i = ((i | fixed) + 1) & ~fixed;
+				next = l + 1;
 			}
 		}
 	}
 #else
-	std::intptr_t zero = 0;
-	std::intptr_t dmask = dsorted[0];
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0];
 
-	if (ctrlmask == 0){
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & dmask) == zero)
-				kernel_core(psi, i, dsorted[0], mm, mmt);
-	} else {
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)
-				kernel_core(psi, i, dsorted[0], mm, mmt);
-	}
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static) if(!omp_in_parallel())
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[0], mm, mmt);
+    }
+    else{
+        const std::size_t fixed = ctrlmask | dsorted[0];
+        std::size_t count = n;
+        for (std::size_t f = fixed; f != 0; f &= f - 1)
+            count >>= 1;
+        #pragma omp parallel if(!omp_in_parallel())
+        {
+            std::size_t i = 0;
+            std::intptr_t next = -1;
+            #pragma omp for schedule(static)
+            for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(count); ++l){
+                if (l != next){
+                    i = static_cast<std::size_t>(l);
+                    for (std::size_t f = fixed; f != 0; f &= f - 1){
+                        const std::size_t below = (f & (0 - f)) - 1;
+                        i = ((i & ~below) << 1) | (i & below);
+                    }
+                }
+                kernel_core(psi, i | ctrlmask, dsorted[0], mm, mmt);
+                i = ((i | fixed) + 1) & ~fixed;
+                next = l + 1;
+            }
+        }
+    }
 #endif
 }
 
@@ -150,38 +150,38 @@ inline void kernel_core(V& psi, std::size_t I, std::size_t d0, std::size_t d1, s
 		tmp[i] = fma(v[0], m[1920 + i * 4 + 0], fma(v[1], m[1920 + i * 4 + 1], fma(v[2], m[1920 + i * 4 + 2], fma(v[3], m[1920 + i * 4 + 3], tmp[i]))));
 	}
 
-	store((double*)&psi[I + d0], (double*)&psi[I], tmp[0]);
-	store((double*)&psi[I + d0 + d1], (double*)&psi[I + d1], tmp[1]);
-	store((double*)&psi[I + d0 + d2], (double*)&psi[I + d2], tmp[2]);
-	store((double*)&psi[I + d0 + d1 + d2], (double*)&psi[I + d1 + d2], tmp[3]);
-	store((double*)&psi[I + d0 + d3], (double*)&psi[I + d3], tmp[4]);
-	store((double*)&psi[I + d0 + d1 + d3], (double*)&psi[I + d1 + d3], tmp[5]);
-	store((double*)&psi[I + d0 + d2 + d3], (double*)&psi[I + d2 + d3], tmp[6]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3], (double*)&psi[I + d1 + d2 + d3], tmp[7]);
-	store((double*)&psi[I + d0 + d4], (double*)&psi[I + d4], tmp[8]);
-	store((double*)&psi[I + d0 + d1 + d4], (double*)&psi[I + d1 + d4], tmp[9]);
-	store((double*)&psi[I + d0 + d2 + d4], (double*)&psi[I + d2 + d4], tmp[10]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4], (double*)&psi[I + d1 + d2 + d4], tmp[11]);
-	store((double*)&psi[I + d0 + d3 + d4], (double*)&psi[I + d3 + d4], tmp[12]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4], (double*)&psi[I + d1 + d3 + d4], tmp[13]);
-	store((double*)&psi[I + d0 + d2 + d3 + d4], (double*)&psi[I + d2 + d3 + d4], tmp[14]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4], (double*)&psi[I + d1 + d2 + d3 + d4], tmp[15]);
-	store((double*)&psi[I + d0 + d5], (double*)&psi[I + d5], tmp[16]);
-	store((double*)&psi[I + d0 + d1 + d5], (double*)&psi[I + d1 + d5], tmp[17]);
-	store((double*)&psi[I + d0 + d2 + d5], (double*)&psi[I + d2 + d5], tmp[18]);
-	store((double*)&psi[I + d0 + d1 + d2 + d5], (double*)&psi[I + d1 + d2 + d5], tmp[19]);
-	store((double*)&psi[I + d0 + d3 + d5], (double*)&psi[I + d3 + d5], tmp[20]);
-	store((double*)&psi[I + d0 + d1 + d3 + d5], (double*)&psi[I + d1 + d3 + d5], tmp[21]);
-	store((double*)&psi[I + d0 + d2 + d3 + d5], (double*)&psi[I + d2 + d3 + d5], tmp[22]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d5], (double*)&psi[I + d1 + d2 + d3 + d5], tmp[23]);
-	store((double*)&psi[I + d0 + d4 + d5], (double*)&psi[I + d4 + d5], tmp[24]);
-	store((double*)&psi[I + d0 + d1 + d4 + d5], (double*)&psi[I + d1 + d4 + d5], tmp[25]);
-	store((double*)&psi[I + d0 + d2 + d4 + d5], (double*)&psi[I + d2 + d4 + d5], tmp[26]);
-	store((double*)&psi[I + d0 + d1 + d2 + d4 + d5], (double*)&psi[I + d1 + d2 + d4 + d5], tmp[27]);
-	store((double*)&psi[I + d0 + d3 + d4 + d5], (double*)&psi[I + d3 + d4 + d5], tmp[28]);
-	store((double*)&psi[I + d0 + d1 + d3 + d4 + d5], (double*)&psi[I + d1 + d3 + d4 + d5], tmp[29]);
-	store((double*)&psi[I + d0 + d2 + d3 + d4 + d5], (double*)&psi[I + d2 + d3 + d4 + d5], tmp[30]);
-	store((double*)&psi[I + d0 + d1 + d2 + d3 + d4 + d5], (double*)&psi[I + d1 + d2 + d3 + d4 + d5], tmp[31]);
+	store(&psi[I + d0], &psi[I], tmp[0]);
+	store(&psi[I + d0 + d1], &psi[I + d1], tmp[1]);
+	store(&psi[I + d0 + d2], &psi[I + d2], tmp[2]);
+	store(&psi[I + d0 + d1 + d2], &psi[I + d1 + d2], tmp[3]);
+	store(&psi[I + d0 + d3], &psi[I + d3], tmp[4]);
+	store(&psi[I + d0 + d1 + d3], &psi[I + d1 + d3], tmp[5]);
+	store(&psi[I + d0 + d2 + d3], &psi[I + d2 + d3], tmp[6]);
+	store(&psi[I + d0 + d1 + d2 + d3], &psi[I + d1 + d2 + d3], tmp[7]);
+	store(&psi[I + d0 + d4], &psi[I + d4], tmp[8]);
+	store(&psi[I + d0 + d1 + d4], &psi[I + d1 + d4], tmp[9]);
+	store(&psi[I + d0 + d2 + d4], &psi[I + d2 + d4], tmp[10]);
+	store(&psi[I + d0 + d1 + d2 + d4], &psi[I + d1 + d2 + d4], tmp[11]);
+	store(&psi[I + d0 + d3 + d4], &psi[I + d3 + d4], tmp[12]);
+	store(&psi[I + d0 + d1 + d3 + d4], &psi[I + d1 + d3 + d4], tmp[13]);
+	store(&psi[I + d0 + d2 + d3 + d4], &psi[I + d2 + d3 + d4], tmp[14]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4], &psi[I + d1 + d2 + d3 + d4], tmp[15]);
+	store(&psi[I + d0 + d5], &psi[I + d5], tmp[16]);
+	store(&psi[I + d0 + d1 + d5], &psi[I + d1 + d5], tmp[17]);
+	store(&psi[I + d0 + d2 + d5], &psi[I + d2 + d5], tmp[18]);
+	store(&psi[I + d0 + d1 + d2 + d5], &psi[I + d1 + d2 + d5], tmp[19]);
+	store(&psi[I + d0 + d3 + d5], &psi[I + d3 + d5], tmp[20]);
+	store(&psi[I + d0 + d1 + d3 + d5], &psi[I + d1 + d3 + d5], tmp[21]);
+	store(&psi[I + d0 + d2 + d3 + d5], &psi[I + d2 + d3 + d5], tmp[22]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d5], &psi[I + d1 + d2 + d3 + d5], tmp[23]);
+	store(&psi[I + d0 + d4 + d5], &psi[I + d4 + d5], tmp[24]);
+	store(&psi[I + d0 + d1 + d4 + d5], &psi[I + d1 + d4 + d5], tmp[25]);
+	store(&psi[I + d0 + d2 + d4 + d5], &psi[I + d2 + d4 + d5], tmp[26]);
+	store(&psi[I + d0 + d1 + d2 + d4 + d5], &psi[I + d1 + d2 + d4 + d5], tmp[27]);
+	store(&psi[I + d0 + d3 + d4 + d5], &psi[I + d3 + d4 + d5], tmp[28]);
+	store(&psi[I + d0 + d1 + d3 + d4 + d5], &psi[I + d1 + d3 + d4 + d5], tmp[29]);
+	store(&psi[I + d0 + d2 + d3 + d4 + d5], &psi[I + d2 + d3 + d4 + d5], tmp[30]);
+	store(&psi[I + d0 + d1 + d2 + d3 + d4 + d5], &psi[I + d1 + d2 + d3 + d4 + d5], tmp[31]);
 
 }
 
@@ -212,7 +212,7 @@ void kernel(V& psi, unsigned id5, unsigned id4, unsigned id3, unsigned id2, unsi
 
 #ifndef _MSC_VER
 	if (ctrlmask == 0){
-		#pragma omp parallel for collapse(LOOP_COLLAPSE6) schedule(static) proc_bind(spread)
+		#pragma omp parallel for collapse(LOOP_COLLAPSE6) schedule(static) proc_bind(spread) if(!omp_in_parallel())
 		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
 			for (std::size_t i1 = 0; i1 < dsorted[0]; i1 += 2 * dsorted[1]){
 				for (std::size_t i2 = 0; i2 < dsorted[1]; i2 += 2 * dsorted[2]){
@@ -230,39 +230,63 @@ void kernel(V& psi, unsigned id5, unsigned id4, unsigned id3, unsigned id2, unsi
 		}
 	}
 	else{
-		#pragma omp parallel for collapse(LOOP_COLLAPSE6) schedule(static)
-		for (std::size_t i0 = 0; i0 < n; i0 += 2 * dsorted[0]){
-			for (std::size_t i1 = 0; i1 < dsorted[0]; i1 += 2 * dsorted[1]){
-				for (std::size_t i2 = 0; i2 < dsorted[1]; i2 += 2 * dsorted[2]){
-					for (std::size_t i3 = 0; i3 < dsorted[2]; i3 += 2 * dsorted[3]){
-						for (std::size_t i4 = 0; i4 < dsorted[3]; i4 += 2 * dsorted[4]){
-							for (std::size_t i5 = 0; i5 < dsorted[4]; i5 += 2 * dsorted[5]){
-								for (std::size_t i6 = 0; i6 < dsorted[5]; ++i6){
-									if (((i0 + i1 + i2 + i3 + i4 + i5 + i6)&ctrlmask) == ctrlmask)
-										kernel_core(psi, i0 + i1 + i2 + i3 + i4 + i5 + i6, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-								}
-							}
-						}
+		const std::size_t fixed = ctrlmask | dsorted[0] | dsorted[1] | dsorted[2] | dsorted[3] | dsorted[4] | dsorted[5];
+		std::size_t count = n;
+		for (std::size_t f = fixed; f != 0; f &= f - 1)
+			count >>= 1;
+		#pragma omp parallel proc_bind(spread) if(!omp_in_parallel())
+		{
+			std::size_t i = 0;
+			std::intptr_t next = -1;
+			#pragma omp for schedule(static)
+			for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(count); ++l){
+				if (l != next){
+					i = static_cast<std::size_t>(l);
+					for (std::size_t f = fixed; f != 0; f &= f - 1){
+						const std::size_t below = (f & (0 - f)) - 1;
+						i = ((i & ~below) << 1) | (i & below);
 					}
 				}
+				kernel_core(psi, i | ctrlmask, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
+				i = ((i | fixed) + 1) & ~fixed;
+				next = l + 1;
 			}
 		}
 	}
 #else
-	std::intptr_t zero = 0;
-	std::intptr_t dmask = dsorted[0] + dsorted[1] + dsorted[2] + dsorted[3] + dsorted[4] + dsorted[5];
-
-	if (ctrlmask == 0){
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & dmask) == zero)
-				kernel_core(psi, i, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-	} else {
-		#pragma omp parallel for schedule(static)
-		for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
-			if ((i & ctrlmask) == ctrlmask && (i & dmask) == zero)
-				kernel_core(psi, i, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
-	}
+    std::intptr_t zero = 0;
+    std::intptr_t dmask = dsorted[0] + dsorted[1] + dsorted[2] + dsorted[3] + dsorted[4] + dsorted[5];
+
+    if (ctrlmask == 0){
+        #pragma omp parallel for schedule(static) if(!omp_in_parallel())
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(n); ++i)
+            if ((i & dmask) == zero)
+                kernel_core(psi, i, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
+    }
+    else{
+        const std::size_t fixed = ctrlmask | dsorted[0] | dsorted[1] | dsorted[2] | dsorted[3] | dsorted[4] | dsorted[5];
+        std::size_t count = n;
+        for (std::size_t f = fixed; f != 0; f &= f - 1)
+            count >>= 1;
+        #pragma omp parallel if(!omp_in_parallel())
+        {
+            std::size_t i = 0;
+            std::intptr_t next = -1;
+            #pragma omp for schedule(static)
+            for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(count); ++l){
+                if (l != next){
+                    i = static_cast<std::size_t>(l);
+                    for (std::size_t f = fixed; f != 0; f &= f - 1){
+                        const std::size_t below = (f & (0 - f)) - 1;
+                        i = ((i & ~below) << 1) | (i & below);
+                    }
+                }
+                kernel_core(psi, i | ctrlmask, dsorted[5], dsorted[4], dsorted[3], dsorted[2], dsorted[1], dsorted[0], mm);
+                i = ((i | fixed) + 1) & ~fixed;
+                next = l + 1;
+            }
+        }
+    }
 #endif
 }
 
@@ -12,19 +12,19 @@
 template <class M, class I>
 inline void permute_qubits_and_matrix(I *delta_list, unsigned n, M & matrix){
 	using Pair = std::pair<std::size_t, std::size_t>;
-	std::vector<Pair> qubits(n);
-	for (std::size_t i = 0; i < qubits.size(); ++i){
+	Pair qubits[7];
+	for (std::size_t i = 0; i < n; ++i){
 		qubits[i].first = i;
 		qubits[i].second = delta_list[i];
 	}
-	std::sort(qubits.begin(), qubits.end(), [](Pair const& p1, Pair const& p2){ return p1.second < p2.second; });
+	std::sort(qubits, qubits + n, [](Pair const& p1, Pair const& p2){ return p1.second < p2.second; });
 	
 	M old = matrix;
 	
-	for (std::size_t i = 0; i < (1ULL << qubits.size()); ++i){
-		for (std::size_t j = 0; j < (1ULL << qubits.size()); ++j){
+	for (std::size_t i = 0; i < (1ULL << n); ++i){
+		for (std::size_t j = 0; j < (1ULL << n); ++j){
 			std::size_t old_i=0, old_j=0;
-			for (std::size_t k = 0; k < qubits.size(); ++k){
+			for (std::size_t k = 0; k < n; ++k){
 				old_i |= ((i >> k)&1ULL) << qubits[k].first;
 				old_j |= ((j >> k)&1ULL) << qubits[k].first;
 			}
@@ -103,8 +103,20 @@ inline __m256d loadb(U *p1, U *p2){
 }
 template <class U>
 inline void store(U* high, U* low, __m256d const& a){
-	_mm_store_pd(low, _mm256_castpd256_pd128(a));
-	_mm_store_pd(high, _mm256_extractf128_pd(a, 0x1));
+	_mm_store_pd((double*)low, _mm256_castpd256_pd128(a));
+	_mm_store_pd((double*)high, _mm256_extractf128_pd(a, 0x1));
+}
+
+// Single precision amplitudes are widened to double precision on load and narrowed again on store, so the kernels
+// compute in double precision but only move half the bytes through memory.
+inline __m256d load1(std::complex<float> *p){
+	auto const tmp = _mm_castpd_ps(_mm_load_sd((double const*)p));
+	return _mm256_cvtps_pd(_mm_movelh_ps(tmp, tmp));
+}
+inline void store(std::complex<float>* high, std::complex<float>* low, __m256d const& a){
+	auto const tmp = _mm256_cvtpd_ps(a);
+	_mm_storel_pi((__m64*)low, tmp);
+	_mm_storeh_pi((__m64*)high, tmp);
 }
 
 
@@ -157,11 +169,15 @@ inline __m512d loadbm(U *p1, U *p2, U *p3, U *p4){
 template <class U>
 inline void store(U* hhigh, U* hlow, U* lhigh, U* llow, __m512d const& a){
         auto al = _mm512_castpd512_pd256(a);
-        _mm_storeu_pd(llow, _mm256_castpd256_pd128(al));
-        _mm_storeu_pd(lhigh, _mm256_extractf128_pd(al, 0x1));
+        _mm_storeu_pd((double*)llow, _mm256_castpd256_pd128(al));
+        _mm_storeu_pd((double*)lhigh, _mm256_extractf128_pd(al, 0x1));
         auto ah = _mm512_extractf64x4_pd(a, 0x1);
-        _mm_storeu_pd(hlow, _mm256_castpd256_pd128(ah));
-        _mm_storeu_pd(hhigh, _mm256_extractf128_pd(ah, 0x1));
+        _mm_storeu_pd((double*)hlow, _mm256_castpd256_pd128(ah));
+        _mm_storeu_pd((double*)hhigh, _mm256_extractf128_pd(ah, 0x1));
+}
+inline void store(std::complex<float>* hhigh, std::complex<float>* hlow, std::complex<float>* lhigh, std::complex<float>* llow, __m512d const& a){
+        store(lhigh, llow, _mm512_castpd512_pd256(a));
+        store(hhigh, hlow, _mm512_extractf64x4_pd(a, 0x1));
 }
 template <class U>
 inline __m512d load(U const*p1, U const*p2, U const*p3, U const*p4){
@@ -5,6 +5,9 @@
 #include "config.hpp"
 #include "external/fusion.hpp"
 #include "simulator/kernels.hpp"
+#include "util/openmp.hpp"
+#include "util/tuningprofile.hpp"
+#include <chrono>
 #include <string>
 #include <thread>
 
@@ -21,6 +24,7 @@
 #endif
 #endif
 #endif
+#include "external/structured.hpp"
 
 namespace Microsoft
 {
@@ -34,23 +38,20 @@ class Fused
 
   public:
       Fused() {
-        wfnCapacity     = 0u;   // used to optimize runtime parameters
+        wfnSize     = 0u;   // used to optimize runtime parameters
         maxFusedSpan    = 4;    // determine span to use at runtime
         maxFusedDepth   = 999;  // determine max depth to use at runtime
+        maxTileBits     = 15;   // determine tile size to use at runtime
     }
 
     inline void reset()
     {
-      fusedgates = Fusion();
+      fusedgates.clear();
     }
 
     const Fusion& get_fusedgates() const {
         return fusedgates;
     }
-    
-    void set_fusedgates(Fusion newFusedGates) const {
-        fusedgates = newFusedGates;
-    }
 
     const int maxSpan() const {
         return maxFusedSpan;
@@ -60,37 +61,69 @@ class Fused
         return maxFusedDepth;
     }
 
-    template <class T, class A>
-    void flush(std::vector<T, A>& wfn) const
+    int tileBits() const {
+        return maxTileBits;
+    }
+
+    /// Pauli string of an exponential, one entry per target.
+    using Paulis = Microsoft::Quantum::SmallVector<Gates::Basis, 8>;
+
+    /// Gates of a cluster that have been fused into a single matrix, but not yet applied to the state.
+    struct FusedCluster
     {
-      if (fusedgates.size() == 0)
-        return;
-      
-      Fusion::Matrix m;
-      Fusion::IndexVector qs, cs;
+      Fusion::Matrix mat;
+      Fusion::IndexVector qs;
+      std::size_t cmask;
+      Fusion::MatrixKind kind;
+    };
+
+    /// Contiguous range of the state vector that the fused kernels can operate on in place of the full vector.
+    template <class T>
+    class StateBlock
+    {
+      public:
+        StateBlock(T* data, std::size_t size) : data_(data), size_(size) {}
 
-      fusedgates.perform_fusion(m, qs, cs);
+        std::size_t size() const { return size_; }
+        T& operator[](std::size_t i) const { return data_[i]; }
 
-      std::size_t cmask = 0;
-      for (auto c : cs)
-        cmask |= (1ull << c);
-      
+      private:
+        T* data_;
+        std::size_t size_;
+    };
+
+    /// Diagonal and monomial matrices skip the dense matrix-vector product and go to the structured kernels.
+    template <class V>
+    static void apply_fused(V& wfn, FusedCluster const& fc, std::size_t cmask)
+    {
+      if (fc.kind == Fusion::MatrixKind::Diagonal)
+        ::kernel_diagonal(wfn, fc.qs, fc.mat, cmask);
+      else if (fc.kind == Fusion::MatrixKind::Monomial)
+        ::kernel_monomial(wfn, fc.qs, fc.mat, cmask);
+      else
+        apply_fused(wfn, fc.mat, fc.qs, cmask);
+    }
+
+    /// The dense kernels permute a private copy of the matrix, up to 5 qubits that copy is a fixed-size one on the stack.
+    template <class V>
+    static void apply_fused(V& wfn, Fusion::Matrix const& m, Fusion::IndexVector const& qs, std::size_t cmask)
+    {
       switch (qs.size())
       {
         case 1:
-          ::kernel(wfn, qs[0], m, cmask);
+          ::kernel(wfn, qs[0], Fusion::FixedMatrix<2>(m), cmask);
           break;
         case 2:
-          ::kernel(wfn, qs[1], qs[0], m, cmask);
+          ::kernel(wfn, qs[1], qs[0], Fusion::FixedMatrix<4>(m), cmask);
           break;
         case 3:
-          ::kernel(wfn, qs[2], qs[1], qs[0], m, cmask);
+          ::kernel(wfn, qs[2], qs[1], qs[0], Fusion::FixedMatrix<8>(m), cmask);
           break;
         case 4:
-          ::kernel(wfn, qs[3], qs[2], qs[1], qs[0], m, cmask);
+          ::kernel(wfn, qs[3], qs[2], qs[1], qs[0], Fusion::FixedMatrix<16>(m), cmask);
           break;
         case 5:
-          ::kernel(wfn, qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
+          ::kernel(wfn, qs[4], qs[3], qs[2], qs[1], qs[0], Fusion::FixedMatrix<32>(m), cmask);
           break;
         case 6:
             ::kernel(wfn, qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
@@ -99,42 +132,144 @@ class Fused
             ::kernel(wfn, qs[6], qs[5], qs[4], qs[3], qs[2], qs[1], qs[0], m, cmask);
             break;
       }
+    }
 
-      fusedgates = Fusion();
+    /// Fuses the queued gates into `fc` and resets the queue without touching the state. The storage of `fc` is
+    /// reused, so a cluster that is filled over and over doesn't allocate.
+    void take_fused(FusedCluster& fc) const
+    {
+      Fusion::IndexMask cmask;
+      fc.kind = fusedgates.perform_fusion(fc.mat, fc.qs, cmask);
+      fc.cmask = static_cast<std::size_t>(cmask);
+      fusedgates.clear();
     }
-    
-    template <class M>
-    Fusion::Matrix convertMatrix(M const& m) const
+
+    FusedCluster take_fused() const
+    {
+      FusedCluster fc;
+      take_fused(fc);
+      return fc;
+    }
+
+    template <class T, class A>
+    void flush(std::vector<T, A>& wfn) const
+    {
+      if (fusedgates.size() == 0)
+        return;
+
+      take_fused(flushed);
+      apply_fused(wfn, flushed, flushed.cmask);
+    }
+
+    /// True if the queued gates only target qubits inside a tile of 2^tileBits amplitudes, and the state spans more
+    /// than one tile, so the gates can be applied tile by tile together with other such clusters.
+    template <class T, class A>
+    bool fits_tile(std::vector<T, A> const& wfn, int tileBits) const
+    {
+      if (fusedgates.size() == 0 || (wfn.size() >> tileBits) < 2)
+        return false;
+      return fusedgates.get_target_mask() < (Fusion::IndexMask(1) << tileBits);
+    }
+
+    /// Applies a group of fused clusters to the state one tile of 2^tileBits amplitudes at a time, so that the whole
+    /// group costs a single pass over the state vector instead of one pass per cluster. All target qubits of the
+    /// clusters must be below `tileBits`, controls may be anywhere: the controls above the tile boundary are resolved
+    /// once per tile. The tiles are spread over the threads, and the kernels see that they are called from inside a
+    /// parallel region, so each tile runs in its own thread without nesting another team.
+    template <class T, class A>
+    static void flush_tiled(std::vector<T, A>& wfn, std::vector<FusedCluster> const& group, int tileBits)
     {
-      Fusion::Matrix mat(2, Fusion::Matrix::value_type(2));
-      for (unsigned i = 0; i < 2; ++i)
-        for (unsigned j = 0; j < 2; ++j)
-          mat[i][j] = static_cast<ComplexType>(m(i, j));
-      return mat;
+      flush_tiled(wfn, group.data(), group.size(), tileBits);
+    }
+
+    /// Same for the first `count` clusters of `group`, so that callers can keep a pool of clusters around.
+    template <class T, class A>
+    static void flush_tiled(std::vector<T, A>& wfn, FusedCluster const* group, std::size_t count, int tileBits)
+    {
+      if (count == 1)
+      {
+        apply_fused(wfn, group[0], group[0].cmask);
+        return;
+      }
+
+      const std::size_t tileSize = 1ull << tileBits;
+      const std::intptr_t nTiles = static_cast<std::intptr_t>(wfn.size() >> tileBits);
+      const A alloc = wfn.get_allocator();
+      const bool outOfCore = maps_files(alloc);
+
+      #pragma omp parallel for schedule(static)
+      for (std::intptr_t t = 0; t < nTiles; ++t)
+      {
+        const std::size_t offset = static_cast<std::size_t>(t) << tileBits;
+        // each thread streams through its range of tiles, the next one is read while this one is worked on
+        if (outOfCore && t + 1 < nTiles)
+          prefetch(alloc, &wfn[offset + tileSize], tileSize);
+        StateBlock<T> tile(&wfn[offset], tileSize);
+        for (std::size_t c = 0; c < count; ++c)
+        {
+          FusedCluster const& fc = group[c];
+          const std::size_t cmaskHigh = fc.cmask & ~(tileSize - 1);
+          if ((offset & cmaskHigh) != cmaskHigh)
+            continue;
+          apply_fused(tile, fc, fc.cmask & (tileSize - 1));
+        }
+      }
     }
     
     template <class T, class A, class M>
-    void apply_controlled(std::vector<T, A>& wfn, M const& mat, std::vector<unsigned> const& cs, unsigned q) const
+    void apply_controlled(std::vector<T, A>& wfn, M const& mat, Fusion::IndexVector const& cs, unsigned q) const
+    {
+        const Fusion::Complex m[4] = {
+            static_cast<ComplexType>(mat(0, 0)), static_cast<ComplexType>(mat(0, 1)),
+            static_cast<ComplexType>(mat(1, 0)), static_cast<ComplexType>(mat(1, 1))};
+        fusedgates.insert(m, Fusion::IndexVector{q}, make_mask(cs));
+    }
+
+    /// Queues exp(i*phi*P) for the Pauli string `bs` on the positions `qs`, controlled on `cs`. The matrix is
+    /// cos(phi)*I + i*sin(phi)*P, with P given by `kernels::pauli_bits`.
+    void apply_controlled_exp(
+        Paulis const& bs,
+        double phi,
+        Fusion::IndexVector const& cs,
+        Fusion::IndexVector const& qs) const
     {
-        Fusion::IndexVector qs = std::vector<unsigned>(1, q);
-        fusedgates.insert(convertMatrix(mat), qs, cs);
+      // the matrix acts on its own index space, bit l of a row or column is the qubit qs[l]
+      Fusion::IndexVector local;
+      for (unsigned l = 0; l < qs.size(); ++l)
+        local.push_back(l);
+      std::size_t xy, yz;
+      int ny;
+      kernels::pauli_bits(bs, local, xy, yz, ny);
+
+      static const Fusion::Complex powers_of_i[4] = {{1., 0.}, {0., 1.}, {-1., 0.}, {0., -1.}};
+      const Fusion::Complex isin = Fusion::Complex(0., std::sin(phi)) * powers_of_i[ny & 3];
+
+      const std::size_t dim = 1ull << qs.size();
+      expMatrix.resize(dim);
+      for (std::size_t j = 0; j < dim; ++j)
+      {
+        expMatrix[j][j] += std::cos(phi);
+        expMatrix[j ^ xy][j] += poppar(j & yz) ? -isin : isin;
+      }
+      fusedgates.insert(expMatrix[0], qs, make_mask(cs));
     }
 
     template <class T, class A, class M>
     void apply(std::vector<T, A>& wfn, M const& mat, unsigned q) const
     {
-      std::vector<unsigned> cs;
-      apply_controlled(wfn, mat, cs, q);
+      apply_controlled(wfn, mat, Fusion::IndexVector(), q);
     }
 
     template <class T, class A>
-    bool shouldFlush(std::vector<T, A>& wfn, std::vector<unsigned> const& cs, unsigned q)
+    bool shouldFlush(std::vector<T, A>& wfn, Fusion::IndexVector const& cs, unsigned q)
     {
         // Major runtime logic change here
 
-          // Have to update capacity as the WFN grows
-        if (wfnCapacity != wfn.capacity()) {
-            wfnCapacity = wfn.capacity();
+          // Have to update the settings as the WFN grows or shrinks. They depend on the size of the live state, not
+          // on the capacity, which is the whole reservation of a state that was reserved up front.
+        if (wfnSize != wfn.size()) {
+            wfnSize = wfn.size();
+            const TuningProfile::Entry* tuned = profile().lookup(floor_log2(wfnSize));
             char* envNT = NULL;
             size_t len;
 #ifdef _OPENMP
@@ -146,13 +281,14 @@ class Fused
             if (envNT == NULL) { // If the user didn't force the number of threads, make an intelligent guess
                 int nMaxThrds = std::thread::hardware_concurrency();        // Logical HW threads
                 if (nMaxThrds > 4) nMaxThrds/= 2;                           // Assume we have hyperthreading (no consistent/concise way to do this)
-                if (wfnCapacity < 1ul << 14)      nMaxThrds = 1;
-                else if (wfnCapacity < 1ul << 16) nMaxThrds = 2;
-                else if (wfnCapacity < 1ul << 20)
+                if (wfnSize < 1ul << 14)      nMaxThrds = 1;
+                else if (wfnSize < 1ul << 16) nMaxThrds = 2;
+                else if (wfnSize < 1ul << 20)
                 {
                     if (nMaxThrds > 8) nMaxThrds = 8;                       // Small problem, never use too many
                     else if (nMaxThrds > 3) nMaxThrds = 3;                  // Small problem on a small machine
                 }
+                if (tuned != nullptr && tuned->threads > 0) nMaxThrds = tuned->threads; // Measured on this host
                 omp_set_num_threads(nMaxThrds);
             }
 #endif
@@ -174,7 +310,8 @@ class Fused
             // Set the fused span limit
             char* envFS = NULL;
             maxFusedSpan = 4;                               // General sweet spot
-            if (wfnCapacity < 1u << 20) maxFusedSpan = 2;   // Don't pre-fuse small problems
+            if (wfnSize < 1u << 20) maxFusedSpan = 2;   // Don't pre-fuse small problems
+            if (tuned != nullptr) maxFusedSpan = tuned->span; // Measured on this host
 #ifdef _MSC_VER
             err = _dupenv_s(&envFS, &len, "QDK_SIM_FUSESPAN");
             if (envFS != NULL && len > 0) {
@@ -185,20 +322,193 @@ class Fused
             envFS = getenv("QDK_SIM_FUSESPAN");
             if (envFS != NULL && strlen(envFS) > 0) {
                 maxFusedSpan = atoi(envFS);
+                if (maxFusedSpan > 7) maxFusedSpan = 7;     // Highest we can handle
+            }
+#endif
+
+            // Set the tile size for cache-blocked flushes (2^15 amplitudes of 16 bytes fit a typical L2). A state
+            // that is mapped from a file is tiled in chunks of 2^24 amplitudes instead, so that a tiled group reads
+            // and writes the file once, and relayout swaps the qubits of the clusters below the chunk boundary.
+            char* envTB = NULL;
+            maxTileBits = maps_files(wfn.get_allocator()) ? 24 : 15;
+#ifdef _MSC_VER
+            err = _dupenv_s(&envTB, &len, "QDK_SIM_TILEBITS");
+            if (envTB != NULL && len > 0) {
+                maxTileBits = atoi(envTB);
+        }
+#else
+            envTB = getenv("QDK_SIM_TILEBITS");
+            if (envTB != NULL && strlen(envTB) > 0) {
+                maxTileBits = atoi(envTB);
             }
 #endif
+            // A tile larger than the state is the whole state, the clamp also keeps 1 << maxTileBits defined for any
+            // value of QDK_SIM_TILEBITS.
+            const int stateBits = static_cast<int>(floor_log2(wfnSize));
+            if (maxTileBits > stateBits) maxTileBits = stateBits;
+            if (maxTileBits < maxFusedSpan) maxTileBits = maxFusedSpan; // a tile must hold a whole fused gate
 
         }
         return false;
     }
 
+    /// Tuning profile of this simulator on this host, consulted by `shouldFlush` in place of the built-in heuristics
+    /// (the QDK_SIM_FUSESPAN and OMP_NUM_THREADS variables still take precedence). It is read once per process from the
+    /// file named by QDK_SIM_PROFILE. If QDK_SIM_CALIBRATE is set to anything but 0 and the file has no profile for this
+    /// simulator, the kernels are calibrated first (which takes a few seconds) and the profile is added to the file.
+    static const TuningProfile& profile()
+    {
+        static const TuningProfile tuned = load_profile();
+        return tuned;
+    }
+
+    /// Measures the fused kernels on this host and returns, for states of 2^10 to 2^maxQubits amplitudes, the fusion
+    /// span and thread count with the least time per gate. The workload for span k is the cluster that a layer of
+    /// single qubit gates followed by a CNOT ladder on k qubits fuses into, 2k-1 gates, which is about the number of
+    /// gates per cluster `Cluster::make_clusters` forms on such circuits. The time includes fusing the gates, which is
+    /// what makes wide spans a loss on small states.
+    static TuningProfile calibrate(unsigned maxQubits = 22)
+    {
+        using namespace std::chrono;
+        TuningProfile tuned(profile_tag());
+
+        std::vector<int> threads{0};
+#ifdef _OPENMP
+        const int saved_threads = omp_get_max_threads();
+        const int hw = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+        threads.clear();
+        for (int t = 1; t < hw; t *= 2)
+            threads.push_back(t);
+        if (hw > 4) threads.push_back(hw / 2); // one thread per core with hyperthreading
+        threads.push_back(hw);
+        std::sort(threads.begin(), threads.end());
+        threads.erase(std::unique(threads.begin(), threads.end()), threads.end());
+#endif
+
+        const double s = 1. / std::sqrt(2.);
+        const Fusion::Complex h[4] = {s, s, s, -s};
+        const Fusion::Complex x[4] = {0., 1., 1., 0.};
+
+        Fused fused;
+        FusedCluster fc;
+        for (unsigned n = 10; n <= maxQubits; n += 2)
+        {
+            WavefunctionStorage wfn(1ull << n, ComplexType(static_cast<RealType>(1. / std::sqrt(double(1ull << n)))));
+            double best = 0.;
+            for (int t : threads)
+            {
+#ifdef _OPENMP
+                omp_set_num_threads(t);
+#endif
+                for (unsigned k = 1; k <= Fusion::MaxQubits; ++k)
+                {
+                    // spread the qubits over the state, so that both near and far strides are part of the kernel
+                    Fusion::IndexVector qs;
+                    for (unsigned i = 0; i < k; ++i)
+                        qs.push_back(i * n / k);
+
+                    const unsigned gates = 2 * k - 1;
+                    unsigned reps = 0;
+                    const auto start = steady_clock::now();
+                    double elapsed = 0.;
+                    while (reps == 0 || elapsed < 0.01)
+                    {
+                        for (unsigned i = 0; i < k; ++i)
+                            fused.fusedgates.insert(h, Fusion::IndexVector{qs[i]}, 0);
+                        for (unsigned i = 0; i + 1 < k; ++i)
+                            fused.fusedgates.insert(x, Fusion::IndexVector{qs[i + 1]}, Fusion::IndexMask(1) << qs[i]);
+                        fused.take_fused(fc);
+                        apply_fused(wfn, fc, fc.cmask);
+                        ++reps;
+                        elapsed = duration<double>(steady_clock::now() - start).count();
+                    }
+
+                    const double per_gate = elapsed / (reps * gates);
+                    if (best == 0. || per_gate < best)
+                    {
+                        best = per_gate;
+                        tuned.set(n, static_cast<int>(k), t);
+                    }
+                }
+            }
+        }
+#ifdef _OPENMP
+        omp_set_num_threads(saved_threads);
+#endif
+        return tuned;
+    }
+
   private:
+    static Fusion::IndexMask make_mask(Fusion::IndexVector const& qs)
+    {
+      Fusion::IndexMask mask = 0;
+      for (auto q : qs)
+        mask |= Fusion::IndexMask(1) << q;
+      return mask;
+    }
+
+    static unsigned floor_log2(std::size_t n)
+    {
+      unsigned l = 0;
+      while (n >>= 1)
+        ++l;
+      return l;
+    }
+
+    static std::string get_env(const char* name)
+    {
+      std::string value;
+#ifdef _MSC_VER
+      char* env = NULL;
+      size_t len = 0;
+      if (_dupenv_s(&env, &len, name) == 0 && env != NULL)
+      {
+        value = env;
+        free(env);
+      }
+#else
+      const char* env = getenv(name);
+      if (env != NULL) value = env;
+#endif
+      return value;
+    }
+
+    /// profiles are specific to the kernels of a simulator and to the host they were measured on
+    static std::string profile_tag()
+    {
+#define FUSED_STRINGIFY_(x) #x
+#define FUSED_STRINGIFY(x) FUSED_STRINGIFY_(x)
+      return std::string(FUSED_STRINGIFY(SIMULATOR)) + "-" + std::to_string(std::thread::hardware_concurrency());
+#undef FUSED_STRINGIFY
+#undef FUSED_STRINGIFY_
+    }
+
+    static TuningProfile load_profile()
+    {
+      TuningProfile tuned(profile_tag());
+      const std::string path = get_env("QDK_SIM_PROFILE");
+      if (!path.empty()) tuned.load(path);
+
+      const std::string calibrate_env = get_env("QDK_SIM_CALIBRATE");
+      if (tuned.empty() && !calibrate_env.empty() && calibrate_env != "0")
+      {
+        tuned = calibrate();
+        if (!path.empty()) tuned.save(path);
+      }
+      return tuned;
+    }
+
     mutable Fusion fusedgates;
 
+    /// Reused storage for the cluster applied by `flush` and for the matrices of Pauli exponentials
+    mutable FusedCluster flushed;
+    mutable Fusion::Matrix expMatrix;
+
     //: New runtime optimizatin settings
-    mutable size_t wfnCapacity;
+    mutable size_t wfnSize;
     mutable int    maxFusedSpan;
     mutable int    maxFusedDepth;
+    mutable int    maxTileBits;
   };
   
   
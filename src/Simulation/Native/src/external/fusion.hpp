@@ -3,161 +3,203 @@
 #ifndef GATE_QUEUE_HPP_
 #define GATE_QUEUE_HPP_
 
-#include <set>
 #include <vector>
 #include <complex>
 #include <algorithm>
+#include <cstdint>
 #include <iostream>
 #include <cassert>
 #include "util/alignedalloc.hpp"
-#include <unordered_map>
-
-class Item{
-public:  
-	using Index = unsigned;
-	using IndexVector = std::vector<Index>;
-	using Complex = std::complex<double>;
-	using Matrix = std::vector<std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>>;
-	Item(Matrix mat, IndexVector idx) : mat_(std::move(mat)), idx_(idx) {}
-	Matrix& get_matrix() { return mat_; }
-	IndexVector& get_indices() const { return idx_; }
-	void remap_idx(std::unordered_map<unsigned, unsigned> elemDict) const {
-		for (size_t i = 0; i < idx_.size(); i++) {
-			idx_[i] = elemDict[idx_[i]];
-		}
-	}
-private:
-	Matrix mat_;
-	mutable IndexVector idx_;
-};
+#include "util/smallvector.hpp"
 
 // Class handling the fusion of gates
+//
+// Qubit sets are bit masks over the positions, the matrices of the queued gates live in one arena that is reused from
+// one fused cluster to the next, so once the arena has grown to its working size, queueing a gate doesn't allocate.
 class Fusion{
 public:
 	using Index = unsigned;
-	using IndexSet = std::set<Index>;
-	using IndexVector = std::vector<Index>;
+	using IndexMask = std::uint64_t; // bit i is set for position i
+	using IndexVector = Microsoft::Quantum::SmallVector<Index, 8>;
 	using Complex = std::complex<double>;
-    using Matrix = std::vector<std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>>;
+	using Storage = std::vector<Complex, Microsoft::Quantum::SIMULATOR::AlignedAlloc<Complex, 64>>;
+
+	// Widest matrix the fused kernels can apply: 2^7 x 2^7
+	static constexpr unsigned MaxQubits = 7;
+
+	// Square matrix stored row-major in one aligned block, entries are addressed as m[i][j]. Resizing keeps the
+	// capacity, so a reused matrix stops allocating once it has held the largest dimension.
+	class Matrix{
+	public:
+		Matrix() : dim_(0) {}
+		explicit Matrix(std::size_t dim) : dim_(0) { resize(dim); }
+
+		void resize(std::size_t dim){
+			dim_ = dim;
+			data_.assign(dim * dim, Complex(0.));
+		}
+		std::size_t size() const { return dim_; }
+		Complex* operator[](std::size_t i) { return data_.data() + i * dim_; }
+		Complex const* operator[](std::size_t i) const { return data_.data() + i * dim_; }
+
+	private:
+		Storage data_;
+		std::size_t dim_;
+	};
+
+	// Copy of a matrix of known dimension on the stack, for the kernels that work on a private copy of their matrix
+	template <std::size_t Dim>
+	class FixedMatrix{
+	public:
+		explicit FixedMatrix(Matrix const& m){
+			assert(m.size() == Dim);
+			std::copy(m[0], m[0] + Dim * Dim, data_);
+		}
+		std::size_t size() const { return Dim; }
+		Complex* operator[](std::size_t i) { return data_ + i * Dim; }
+		Complex const* operator[](std::size_t i) const { return data_ + i * Dim; }
+
+	private:
+		alignas(64) Complex data_[Dim * Dim];
+	};
+
+	// A queued gate, its matrix is the block of dim x dim entries at `offset` in the arena. Bit l of a matrix index
+	// refers to position idx[l].
+	struct Item{
+		std::size_t offset;
+		std::size_t dim;
+		IndexVector idx;
+	};
 	using ItemVector = std::vector<Item>;
-	
-	Fusion() : global_factor_(1.) {}
-	
+
+	// Structure of a fused matrix, used to pick the cheapest kernel to apply it
+	enum class MatrixKind { Dense, Diagonal, Monomial };
+
+	Fusion() : target_mask_(0), ctrl_mask_(0), global_factor_(1.) {}
+
 	Index num_qubits() const {
-		return static_cast<Index>(target_set_.size());
+		return popcount(target_mask_);
 	}
 
 	Index num_controls() const {
-		return static_cast<Index>( ctrl_set_.size());
+		return popcount(ctrl_mask_);
 	}
 
-	
+
 	Index size() const {
 		return static_cast<Index>(items_.size());
 	}
-	
+
+	// Drops all queued gates but keeps the storage for the next ones
+	void clear() const {
+		items_.clear();
+		arena_.clear();
+		target_mask_ = 0;
+		ctrl_mask_ = 0;
+		global_factor_ = 1.;
+	}
+
 	template <class T>
 	void global_factor(T const& factor) {
 		assert(items_.size() > 0); // make sure we never drop a global factor
 		global_factor_ *= factor;
-		IndexVector empty_vec;
-		Matrix empty_matrix;
-		handle_controls(empty_matrix, empty_vec, {}); // remove all current control qubits (this is a GLOBAL factor)
+		release_controls(0); // remove all current control qubits (this is a GLOBAL factor)
 	}
-	
-	const IndexSet& get_target_set() const {
-		return target_set_;
+
+	IndexMask get_target_mask() const {
+		return target_mask_;
 	}
 
 	const ItemVector& get_items() const {
 		return items_;
 	}
 
-	const IndexSet& get_ctrl_set() const {
-		return ctrl_set_;
+	IndexMask get_ctrl_mask() const {
+		return ctrl_mask_;
 	}
 
 	const Complex& get_global_factor() const {
 		return global_factor_;
 	}
 
-	static void remap_qubits(std::set<Index>& qubits, const std::unordered_map<unsigned, unsigned>& mapFromOldLocToNewLoc) {
-		std::set<Index> tempSet;
-		for (unsigned elem : qubits) {
-			if (mapFromOldLocToNewLoc.find(elem) != mapFromOldLocToNewLoc.end()) {
-				tempSet.insert(mapFromOldLocToNewLoc.at(elem));
-			}
-		}
-		qubits.swap(tempSet);
+	// Entry (i, j) of the matrix of a queued gate
+	const Complex& item_entry(Item const& item, std::size_t i, std::size_t j) const {
+		return arena_[item.offset + i * item.dim + j];
 	}
 
-	void remap_target_set(const std::unordered_map<unsigned, unsigned>& mapFromOldLocToNewLoc) const {
-		remap_qubits(target_set_, mapFromOldLocToNewLoc);
-	}
+	// Queues the gate with the row-major 2^k x 2^k `matrix` on the k positions `index_list`, controlled on the
+	// positions in `ctrls`.
+	void insert(Complex const* matrix, IndexVector const& index_list, IndexMask ctrls) const {
+		assert(index_list.size() <= MaxQubits);
+		Item item{arena_.size(), 1ULL << index_list.size(), index_list};
+		arena_.insert(arena_.end(), matrix, matrix + item.dim * item.dim);
 
-	void remap_ctrl_set(const std::unordered_map<unsigned, unsigned>& mapFromOldLocToNewLoc) const {
-		remap_qubits(ctrl_set_, mapFromOldLocToNewLoc);
-	}
-	
-	void set_items(ItemVector&& newItems) const {
-		items_.swap(newItems);
-	}
-
-	// This saves a class instance create/destroy on every gate insert
-	// Need a quick way to decide if we're going to grow too wide
-	int predict(IndexVector index_list, IndexVector const& ctrl_list = {}) {
-		int cnt = num_qubits() + num_controls();
 		for (auto idx : index_list)
-			if (target_set_.count(idx) == 0 && ctrl_set_.count(idx) == 0) cnt++;
-		for (auto idx : ctrl_list)
-			if (target_set_.count(idx) == 0 && ctrl_set_.count(idx) == 0) cnt++;
-		return cnt;
-	}
+			target_mask_ |= 1ULL << idx;
 
-	void insert(Matrix matrix, IndexVector index_list, IndexVector const& ctrl_list = {}) const {
-		for (auto idx : index_list)
-			target_set_.emplace(idx);
-		
-		if (global_factor_ != 1. && ctrl_list.size() > 0){
-			assert(ctrl_set_.size() == 0);
-			add_controls(matrix, index_list, ctrl_list);
+		if (global_factor_ != 1. && ctrls != 0){
+			assert(ctrl_mask_ == 0);
+			add_controls(item, ctrls);
+			target_mask_ |= ctrls;
 		}
 		else
-			handle_controls(matrix, index_list, ctrl_list);
-		Item item(matrix, index_list);
+			handle_controls(item, ctrls);
 		items_.push_back(item);
 	}
-	
+
 	void get_indices(IndexVector &indices) const{
-		for (auto idx : target_set_)
-			indices.push_back(idx);
+		for (Index idx = 0; idx < 64; ++idx)
+			if ((target_mask_ >> idx) & 1)
+				indices.push_back(idx);
+	}
+
+	// Diagonal if all off-diagonal entries are zero, monomial if every column has exactly one non-zero entry
+	// (a permutation times a diagonal), dense otherwise. Only exact zeros count, so the classification never
+	// drops an amplitude.
+	static MatrixKind classify(Matrix const& m){
+		bool diagonal = true;
+		for (std::size_t j = 0; j < m.size(); ++j){
+			std::size_t nonzeros = 0;
+			for (std::size_t i = 0; i < m.size(); ++i){
+				if (m[i][j] != 0.){
+					++nonzeros;
+					if (i != j)
+						diagonal = false;
+				}
+			}
+			if (nonzeros != 1)
+				return MatrixKind::Dense;
+		}
+		return diagonal ? MatrixKind::Diagonal : MatrixKind::Monomial;
 	}
-	
-	void perform_fusion(Matrix& fused_matrix, IndexVector& index_list, IndexVector& ctrl_list){
+
+	MatrixKind perform_fusion(Matrix& fused_matrix, IndexVector& index_list, IndexMask& ctrls){
 		if (global_factor_ != 1.)
-			assert(ctrl_set_.size() == 0);
-		
-		for (auto idx : target_set_)
-			index_list.push_back(idx);
-		
+			assert(ctrl_mask_ == 0);
+
+		index_list.clear();
+		get_indices(index_list);
+
 		unsigned N = num_qubits();
-		fused_matrix = Matrix(1ULL<<N, std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex, 64>>(1ULL<<N));
+		assert(N <= MaxQubits);
+		fused_matrix.resize(1ULL<<N);
 		auto &M = fused_matrix;
-		
+
 		for (std::size_t i = 0; i < (1ULL<<N); ++i)
 			M[i][i] = 1. * global_factor_;
-		
-		for (auto& item : items_){
-			auto const& idx = item.get_indices();
-			IndexVector idx2mat(idx.size());
+
+		for (auto const& item : items_){
+			auto const& idx = item.idx;
+			Index idx2mat[64];
 			for (std::size_t i = 0; i < idx.size(); ++i)
-				idx2mat[i] = static_cast<unsigned>(((std::equal_range(index_list.begin(), index_list.end(), idx[i])).first - index_list.begin()));
-			
+				idx2mat[i] = popcount(target_mask_ & ((1ULL << idx[i]) - 1));
+			Complex const* mat = &arena_[item.offset];
+
 			#pragma omp parallel for schedule(static)
 			for (unsigned long long k = 0; k < (1ULL<<N); ++k){ // loop over big matrix columns
 				// check if column index satisfies control-mask
 				// if not: leave it unchanged
-				std::vector<Complex> oldcol(1ULL<<N);
+				Complex oldcol[1ULL << MaxQubits];
 				for (std::size_t i = 0; i < (1ULL<<N); ++i)
 					oldcol[i] = M[i][k];
 
@@ -165,78 +207,97 @@ public:
 					unsigned local_i = 0;
 					for (std::size_t l = 0; l < idx.size(); ++l)
 						local_i |= ((i >> idx2mat[l])&1)<<l;
-						
+
 					Complex res = 0.;
 					for (std::size_t j = 0; j < (1ULL<<idx.size()); ++j){
 						std::size_t locidx = i;
 						for (std::size_t l = 0; l < idx.size(); ++l)
 							if (((j >> l)&1) != ((i >> idx2mat[l])&1))
 								locidx ^= (1ULL << idx2mat[l]);
-						res += oldcol[locidx] * item.get_matrix()[local_i][j];
+						res += oldcol[locidx] * mat[local_i * item.dim + j];
 					}
 					M[i][k] = res;
 				}
 			}
 		}
-		ctrl_list.reserve(ctrl_set_.size());
-		for (auto ctrl : ctrl_set_)
-			ctrl_list.push_back(ctrl);
+		ctrls = ctrl_mask_;
+		return classify(fused_matrix);
 	}
 
 private:
-	void add_controls(Matrix &matrix, IndexVector &indexList, IndexVector const& new_ctrls) const {
-		indexList.reserve(indexList.size()+new_ctrls.size());
-		indexList.insert(indexList.end(), new_ctrls.begin(), new_ctrls.end());
-		
-		std::size_t F = (1ULL << new_ctrls.size());
-		Matrix newmatrix(F*matrix.size(), std::vector<Complex, Microsoft::Quantum::Simulator::AlignedAlloc<Complex,64>>(F*matrix.size(), 0.));
-		
-		std::size_t Offset = newmatrix.size()-matrix.size();
-		
+	static Index popcount(IndexMask mask) {
+		Index count = 0;
+		for (; mask != 0; mask &= mask - 1)
+			++count;
+		return count;
+	}
+
+	// Makes the gate act only if all positions in `new_ctrls` are set: its matrix moves to the block of a new matrix
+	// where the controls (the new high bits of the index) are all one, the rest is the identity. The new matrix is
+	// appended to the arena, the old block is dropped with the arena when the fusion is cleared.
+	void add_controls(Item &item, IndexMask new_ctrls) const {
+		for (Index idx = 0; idx < 64; ++idx)
+			if ((new_ctrls >> idx) & 1)
+				item.idx.push_back(idx);
+
+		const std::size_t F = 1ULL << popcount(new_ctrls);
+		const std::size_t dim = F*item.dim;
+		const std::size_t offset = arena_.size();
+		arena_.resize(offset + dim*dim, 0.);
+
+		std::size_t Offset = dim-item.dim;
+		Complex* newmatrix = &arena_[offset];
+		Complex const* matrix = &arena_[item.offset];
+
 		for (std::size_t i = 0; i < Offset; ++i)
-			newmatrix[i][i] = 1.;
-		for (std::size_t i = 0; i < matrix.size(); ++i){
-			for (std::size_t j = 0; j < matrix.size(); ++j)
-				newmatrix[Offset+i][Offset+j] = matrix[i][j];
+			newmatrix[i*dim+i] = 1.;
+		for (std::size_t i = 0; i < item.dim; ++i){
+			for (std::size_t j = 0; j < item.dim; ++j)
+				newmatrix[(Offset+i)*dim+Offset+j] = matrix[i*item.dim+j];
 		}
-		matrix = std::move(newmatrix);
+		item.offset = offset;
+		item.dim = dim;
 	}
-	
-	void handle_controls(Matrix &matrix, IndexVector &indexList, IndexVector const& ctrlList) const {
-		auto unhandled_ctrl = ctrl_set_; // will contain all ctrls that are not part of the new command
+
+	void handle_controls(Item &item, IndexMask ctrls) const {
+		IndexMask unhandled_ctrl = ctrl_mask_; // will contain all ctrls that are not part of the new command
 		// --> need to be removed from the global mask and the controls incorporated into the old
 		// commands (the ones already in the list).
-		
-		for (auto ctrlIdx : ctrlList){
-			if (ctrl_set_.count(ctrlIdx) == 0){ // need to either add it to the list or to the command
+
+		for (Index ctrlIdx = 0; ctrlIdx < 64; ++ctrlIdx){
+			const IndexMask bit = 1ULL << ctrlIdx;
+			if ((ctrls & bit) == 0)
+				continue;
+			if ((ctrl_mask_ & bit) == 0){ // need to either add it to the list or to the command
 				if (items_.size() > 0){ // add it to the command
-					add_controls(matrix, indexList, {ctrlIdx});
-					target_set_.insert(ctrlIdx);
+					add_controls(item, bit);
+					target_mask_ |= bit;
 				}
 				else // add it to the list
-					ctrl_set_.emplace(ctrlIdx);
+					ctrl_mask_ |= bit;
 			}
 			else
-				unhandled_ctrl.erase(ctrlIdx);
-		}
-		// remove global controls which are no longer global (because the current command didn't
-		// have it)
-		if (unhandled_ctrl.size() > 0){
-			IndexVector new_ctrls;
-			new_ctrls.reserve(unhandled_ctrl.size());
-			for (auto idx : unhandled_ctrl){
-				new_ctrls.push_back(idx);
-				ctrl_set_.erase(idx);
-				target_set_.insert(idx);
-			}
-			for (auto &item : items_)
-				add_controls(item.get_matrix(), item.get_indices(), new_ctrls);
+				unhandled_ctrl &= ~bit;
 		}
+		release_controls(ctrl_mask_ & ~unhandled_ctrl);
 	}
-	
-	mutable IndexSet target_set_; //set of qubits being acted on
-	mutable ItemVector items_; //queue if gates to be fused
-	mutable IndexSet ctrl_set_; //set of controls
+
+	// remove global controls which are no longer global (because the current command didn't
+	// have it), apart from the ones in `keep`
+	void release_controls(IndexMask keep) const {
+		const IndexMask released = ctrl_mask_ & ~keep;
+		if (released == 0)
+			return;
+		ctrl_mask_ &= ~released;
+		target_mask_ |= released;
+		for (auto &item : items_)
+			add_controls(item, released);
+	}
+
+	mutable IndexMask target_mask_; // set of qubits being acted on
+	mutable ItemVector items_; // queue of gates to be fused
+	mutable Storage arena_; // matrices of the queued gates
+	mutable IndexMask ctrl_mask_; // set of controls
 	mutable Complex global_factor_;
 };
 
@@ -0,0 +1,142 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <vector>
+
+// Kernels for fused matrices that are diagonal or monomial (one non-zero per column, i.e. a permutation times a
+// diagonal). They are used instead of the dense `kernel` overloads and, like those, work on anything that provides
+// `size()` and `operator[]`. Qubit indices are given from low to high: bit l of a matrix index refers to ids[l]. The
+// matrices have at most 2^7 rows, so the tables derived from them are kept on the stack.
+
+// Multiplies `a` by the complex number fr + i*fi with plain real arithmetic. The operator* of std::complex has to handle
+// infinities and NaNs (C99 Annex G), which compiles to a library call per amplitude and keeps the loops from vectorizing.
+template <class T>
+inline std::complex<T> structured_scale(std::complex<T> const& a, double fr, double fi)
+{
+    const double re = a.real(), im = a.imag();
+    return std::complex<T>(static_cast<T>(re * fr - im * fi), static_cast<T>(re * fi + im * fr));
+}
+
+// Sorts the positions of the target and control bits into `fixed` and returns their number. The kernels enumerate the
+// other bits and deposit these, so only amplitudes with all controls set are visited.
+template <class I>
+inline std::size_t structured_fixed(I const& ids, std::size_t ctrlmask, unsigned* fixed)
+{
+    std::size_t n = 0;
+    for (std::size_t l = 0; l < ids.size(); ++l)
+        fixed[n++] = static_cast<unsigned>(ids[l]);
+    for (unsigned p = 0; p < 64; ++p)
+        if ((ctrlmask >> p) & 1)
+            fixed[n++] = p;
+    std::sort(fixed, fixed + n);
+    return n;
+}
+
+inline std::size_t structured_deposit(std::size_t i, unsigned const* fixed, std::size_t nfixed)
+{
+    for (std::size_t l = 0; l < nfixed; ++l)
+        i = ((i >> fixed[l]) << (fixed[l] + 1)) | (i & ((1ULL << fixed[l]) - 1));
+    return i;
+}
+
+// Multiplies every amplitude by the diagonal entry selected by its target bits. The amplitudes with all controls set
+// are visited in runs of contiguous entries below the lowest target or control, and each run is swept once per
+// diagonal entry that differs from 1, at the precomputed offset of that entry.
+template <class V, class I, class M>
+void kernel_diagonal(V& psi, I const& ids, M const& matrix, std::size_t ctrlmask)
+{
+    unsigned fixed[64 + 7];
+    const std::size_t nfixed = structured_fixed(ids, ctrlmask, fixed);
+    const std::size_t run = 1ULL << fixed[0];
+    const std::intptr_t nRuns = static_cast<std::intptr_t>((psi.size() >> nfixed) / run);
+
+    std::size_t nd = 0;
+    double re[128], im[128];
+    std::size_t offset[128];
+    for (std::size_t j = 0; j < (1ULL << ids.size()); ++j){
+        const std::complex<double> d = matrix[j][j];
+        if (d == 1.)
+            continue;
+        re[nd] = d.real();
+        im[nd] = d.imag();
+        offset[nd] = ctrlmask;
+        for (std::size_t l = 0; l < ids.size(); ++l)
+            if ((j >> l) & 1)
+                offset[nd] |= 1ULL << ids[l];
+        ++nd;
+    }
+
+    // called per tile from inside the parallel region of Fused::flush_tiled, the loop runs in the calling thread
+    #pragma omp parallel for schedule(static) if(!omp_in_parallel())
+    for (std::intptr_t r = 0; r < nRuns; ++r){
+        const std::size_t i0 = structured_deposit(static_cast<std::size_t>(r) * run, fixed, nfixed);
+        for (std::size_t k = 0; k < nd; ++k){
+            const std::size_t base = i0 + offset[k];
+            for (std::size_t i = 0; i < run; ++i)
+                psi[base + i] = structured_scale(psi[base + i], re[k], im[k]);
+        }
+    }
+}
+
+// Applies a matrix with exactly one non-zero entry per column: the amplitude in column j is scaled by that entry and
+// moved to its row. The blocks of 2^k amplitudes are enumerated like the runs of kernel_diagonal, up to `chunk`
+// neighbouring blocks are gathered at once and scattered once, with no matrix-vector product.
+template <class V, class I, class M>
+void kernel_monomial(V& psi, I const& ids, M const& matrix, std::size_t ctrlmask)
+{
+    using T = typename std::decay<decltype(psi[0])>::type;
+    constexpr std::size_t chunk = 8;
+    const std::size_t dim = 1ULL << ids.size();
+    unsigned fixed[64 + 7];
+    const std::size_t nfixed = structured_fixed(ids, ctrlmask, fixed);
+    const std::size_t run = 1ULL << fixed[0];
+    const std::size_t width = std::min(run, chunk);
+    const std::intptr_t nChunks = static_cast<std::intptr_t>((psi.size() >> nfixed) / width);
+
+    std::size_t row[128];
+    double re[128], im[128];
+    std::size_t offset[128];
+    for (std::size_t j = 0; j < dim; ++j){
+        offset[j] = ctrlmask;
+        for (std::size_t i = 0; i < dim; ++i){
+            if (matrix[i][j] != 0.){
+                const std::complex<double> v = matrix[i][j];
+                row[j] = i;
+                re[j] = v.real();
+                im[j] = v.imag();
+                break;
+            }
+        }
+        for (std::size_t l = 0; l < ids.size(); ++l)
+            if ((j >> l) & 1)
+                offset[j] |= 1ULL << ids[l];
+    }
+
+    #pragma omp parallel for schedule(static) if(!omp_in_parallel())
+    for (std::intptr_t c = 0; c < nChunks; ++c){
+        const std::size_t i0 = structured_deposit(static_cast<std::size_t>(c) * width, fixed, nfixed);
+        // split into real and imaginary parts, an array of std::complex would be zeroed for every chunk
+        double vre[128 * chunk], vim[128 * chunk];
+        for (std::size_t j = 0; j < dim; ++j)
+            for (std::size_t i = 0; i < width; ++i){
+                const T a = psi[i0 + offset[j] + i];
+                vre[j * chunk + i] = a.real();
+                vim[j * chunk + i] = a.imag();
+            }
+        for (std::size_t j = 0; j < dim; ++j){
+            const std::size_t base = i0 + offset[row[j]];
+            for (std::size_t i = 0; i < width; ++i){
+                const double ar = vre[j * chunk + i], ai = vim[j * chunk + i];
+                psi[base + i] = T(static_cast<typename T::value_type>(ar * re[j] - ai * im[j]),
+                                  static_cast<typename T::value_type>(ar * im[j] + ai * re[j]));
+            }
+        }
+    }
+}
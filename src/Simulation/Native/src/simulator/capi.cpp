@@ -6,6 +6,16 @@
 #include "simulator/simulator.hpp"
 using namespace Microsoft::Quantum::Simulator;
 
+namespace
+{
+// The factory throws for a precision it doesn't support, and exceptions mustn't cross the C boundary, so any precision
+// other than 32, 64 or 0 (the default of the build) falls back to double precision.
+unsigned supported_precision(unsigned precision)
+{
+    return (precision == 0 || precision == 32 || precision == 64) ? precision : 64u;
+}
+} // namespace
+
 extern "C"
 {
 
@@ -15,6 +25,16 @@ extern "C"
         return Microsoft::Quantum::Simulator::create();
     }
 
+    MICROSOFT_QUANTUM_DECL unsigned initWithPrecision(unsigned precision)
+    {
+        return Microsoft::Quantum::Simulator::create(0u, supported_precision(precision));
+    }
+
+    MICROSOFT_QUANTUM_DECL unsigned initWithReservation(unsigned precision, unsigned maxlocal, unsigned pageQubits)
+    {
+        return Microsoft::Quantum::Simulator::create(maxlocal, supported_precision(precision), pageQubits);
+    }
+
     MICROSOFT_QUANTUM_DECL void destroy(unsigned id)
     {
         Microsoft::Quantum::Simulator::destroy(id);
@@ -31,6 +51,21 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->random(n, p);
     }
 
+    MICROSOFT_QUANTUM_DECL bool Sample(
+        unsigned id,
+        unsigned n,
+        unsigned* q,
+        std::size_t shots,
+        std::size_t* results)
+    {
+        // the simulator throws for outcomes wider than a std::size_t, which mustn't cross the C boundary
+        if (n > 8 * sizeof(std::size_t)) return false;
+        std::vector<unsigned> qv(q, q + n);
+        std::vector<std::size_t> rv = Microsoft::Quantum::Simulator::get(id)->Sample(qv, shots);
+        std::copy(rv.begin(), rv.end(), results);
+        return true;
+    }
+
     MICROSOFT_QUANTUM_DECL double JointEnsembleProbability(
         unsigned id,
         unsigned n,
@@ -45,6 +80,23 @@ extern "C"
         return Microsoft::Quantum::Simulator::get(id)->JointEnsembleProbability(bv, qv);
     }
 
+    MICROSOFT_QUANTUM_DECL double PauliSumExpectation(
+        unsigned id,
+        unsigned n,
+        unsigned* q,
+        unsigned nterms,
+        int* b,
+        double* c)
+    {
+        std::vector<std::vector<Gates::Basis>> bv(nterms);
+        for (unsigned k = 0; k < nterms; ++k)
+            for (unsigned i = 0; i < n; ++i)
+                bv[k].push_back(static_cast<Gates::Basis>(*(b + k * n + i)));
+        std::vector<double> cv(c, c + nterms);
+        std::vector<unsigned> qv(q, q + n);
+        return Microsoft::Quantum::Simulator::get(id)->PauliSumExpectation(bv, cv, qv);
+    }
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
         unsigned sid,
         unsigned n,
@@ -53,7 +105,7 @@ extern "C"
         double* im)
     {
         const size_t N = (static_cast<size_t>(1) << n);
-        std::vector<ComplexType> amplitudes;
+        std::vector<std::complex<double>> amplitudes;
         amplitudes.reserve(N);
         for (size_t i = 0; i < N; i++)
         {
@@ -115,6 +167,19 @@ extern "C"
 #undef FWDCSGATE1
 #undef FWD
 
+    // two-qubit gates
+
+    MICROSOFT_QUANTUM_DECL void SWAP(unsigned id, unsigned q1, unsigned q2)
+    {
+        Microsoft::Quantum::Simulator::get(id)->SWAP(q1, q2);
+    }
+
+    MICROSOFT_QUANTUM_DECL void MCSWAP(unsigned id, unsigned n, unsigned* c, unsigned q1, unsigned q2)
+    {
+        std::vector<unsigned> vc(c, c + n);
+        Microsoft::Quantum::Simulator::get(id)->CSWAP(vc, q1, q2);
+    }
+
     // rotations
 
     MICROSOFT_QUANTUM_DECL void R(unsigned id, unsigned b, double phi, unsigned q)
@@ -171,6 +236,17 @@ extern "C"
     {
         return (unsigned)Microsoft::Quantum::Simulator::get(id)->M(q);
     }
+    MICROSOFT_QUANTUM_DECL void MultiM(
+        unsigned id,
+        unsigned n,
+        unsigned* q,
+        unsigned* results)
+    {
+        std::vector<unsigned> qv(q, q + n);
+        std::vector<bool> rv = Microsoft::Quantum::Simulator::get(id)->MultiM(qv);
+        for (unsigned i = 0; i < n; ++i)
+            results[i] = (unsigned)rv[i];
+    }
     MICROSOFT_QUANTUM_DECL unsigned Measure(
         unsigned id,
         unsigned n,
@@ -245,4 +321,11 @@ extern "C"
     {
         Microsoft::Quantum::Simulator::get(id)->dumpIds(callback);
     }
+
+    MICROSOFT_QUANTUM_DECL unsigned StatePlacement(unsigned id, unsigned n, std::size_t* pagesPerNode)
+    {
+        std::vector<std::size_t> counts = Microsoft::Quantum::Simulator::get(id)->statePlacement();
+        std::copy(counts.begin(), counts.begin() + std::min<std::size_t>(n, counts.size()), pagesPerNode);
+        return static_cast<unsigned>(counts.size());
+    }
 }
@@ -11,6 +11,12 @@ extern "C"
     // non-quantum
 
     MICROSOFT_QUANTUM_DECL unsigned init(); // NOLINT
+    // precision: bits of the real and imaginary parts of the amplitudes, 32 or 64 (0 for the default of the build),
+    // other values select 64
+    MICROSOFT_QUANTUM_DECL unsigned initWithPrecision(unsigned precision); // NOLINT
+    // maxlocal: qubits to reserve the state vector for (0 for none), pageQubits: page the reserved state in chunks of
+    // 2^pageQubits amplitudes, so that releasing a high qubit moves pages instead of amplitudes (0 for no paging)
+    MICROSOFT_QUANTUM_DECL unsigned initWithReservation(unsigned precision, unsigned maxlocal, unsigned pageQubits); // NOLINT
     MICROSOFT_QUANTUM_DECL void destroy(unsigned sid); // NOLINT
     MICROSOFT_QUANTUM_DECL void seed(unsigned sid, unsigned s); // NOLINT
     MICROSOFT_QUANTUM_DECL void Dump(unsigned sid, bool (*callback)(const char*, double, double));
@@ -44,14 +50,39 @@ extern "C"
 
     MICROSOFT_QUANTUM_DECL void DumpIds(unsigned sid, void (*callback)(unsigned));
 
+    // Diagnostics of the state vector placement: writes the number of sampled pages of the state vector on NUMA node i
+    // to pagesPerNode[i], for at most n nodes. Returns the number of nodes that hold pages, 0 if the platform doesn't
+    // report page placement.
+    MICROSOFT_QUANTUM_DECL unsigned StatePlacement(unsigned sid, unsigned n, std::size_t* pagesPerNode);
+
     MICROSOFT_QUANTUM_DECL std::size_t random_choice(unsigned sid, std::size_t n, double* p); // NOLINT
 
+    // Writes `shots` measurement outcomes of the qubits q[0..n-1] into `results` without collapsing the state. The
+    // result for q[l] is bit l of each outcome, so n can be at most 64; for larger n nothing is written and it returns
+    // false.
+    MICROSOFT_QUANTUM_DECL bool Sample(
+         unsigned sid,
+         unsigned n,
+         unsigned* q,
+         std::size_t shots, // NOLINT
+         std::size_t* results); // NOLINT
+
     MICROSOFT_QUANTUM_DECL double JointEnsembleProbability(
          unsigned sid,
          unsigned n,
          int* b,
          unsigned* q);
 
+    // Expectation value of sum_k c[k] * P_k without changing the state. The Pauli strings are packed row by row:
+    // b[k * n + i] is the Pauli of term k on qubit q[i].
+    MICROSOFT_QUANTUM_DECL double PauliSumExpectation(
+         unsigned sid,
+         unsigned n,
+         unsigned* q,
+         unsigned nterms,
+         int* b,
+         double* c);
+
     MICROSOFT_QUANTUM_DECL bool InjectState(
          unsigned sid,
          unsigned n,
@@ -87,6 +118,10 @@ extern "C"
     MICROSOFT_QUANTUM_DECL void MCAdjS(unsigned sid, unsigned n, unsigned* c, unsigned q);
     MICROSOFT_QUANTUM_DECL void MCAdjT(unsigned sid, unsigned n, unsigned* c, unsigned q);
 
+    // two-qubit gates
+    MICROSOFT_QUANTUM_DECL void SWAP(unsigned sid, unsigned q1, unsigned q2);
+    MICROSOFT_QUANTUM_DECL void MCSWAP(unsigned sid, unsigned n, unsigned* c, unsigned q1, unsigned q2);
+
     // rotations
     MICROSOFT_QUANTUM_DECL void R(unsigned sid, unsigned b, double phi, unsigned q);
 
@@ -117,6 +152,14 @@ extern "C"
 
     // measurements
     MICROSOFT_QUANTUM_DECL unsigned M(unsigned sid, unsigned q);
+    // Measures the n qubits q in the computational basis into results. Their outcomes are drawn jointly from one
+    // histogram of 2^n entries per thread; if those would take more doubles than the state has amplitudes (or 2^16),
+    // or n exceeds 31, the qubits are split into groups that fit, each costing two passes over the state.
+    MICROSOFT_QUANTUM_DECL void MultiM(
+         unsigned sid,
+         unsigned n,
+         unsigned* q,
+         unsigned* results);
     MICROSOFT_QUANTUM_DECL unsigned Measure(
          unsigned sid,
          unsigned n,
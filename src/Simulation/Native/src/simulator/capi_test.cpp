@@ -7,6 +7,7 @@
 #include <cmath>
 #include <complex>
 #include <iostream>
+#include <string>
 #include <vector>
 
 // some convenience functions
@@ -131,6 +132,55 @@ void test_gates()
     destroy(sim_id);
 }
 
+// the basis states with a nonzero amplitude in the dump, where bit j stands for the j-th id DumpIds reports
+std::vector<std::size_t> dumped_basis_states(unsigned sim_id)
+{
+    std::vector<std::size_t> states;
+    DumpToLocation(
+        sim_id,
+        [](size_t idx, double r, double i, TDumpLocation location) {
+            if (std::norm(std::complex<double>(r, i)) > 1e-12)
+                static_cast<std::vector<std::size_t>*>(location)->push_back(idx);
+            return true;
+        },
+        &states);
+    return states;
+}
+
+// the labels of the same basis states in the text dump, where character j stands for the j-th id
+std::vector<std::string> dumped_labels;
+std::vector<std::string> dumped_basis_labels(unsigned sim_id)
+{
+    dumped_labels.clear();
+    Dump(sim_id, [](const char* label, double r, double i) {
+        if (std::norm(std::complex<double>(r, i)) > 1e-12) dumped_labels.push_back(label);
+        return true;
+    });
+    return dumped_labels;
+}
+
+// all amplitudes of the dump, indexed like the basis states above
+std::vector<std::complex<double>> dumped_amplitudes(unsigned sim_id)
+{
+    std::vector<std::complex<double>> amplitudes(std::size_t(1) << num_qubits(sim_id));
+    DumpToLocation(
+        sim_id,
+        [](size_t idx, double r, double i, TDumpLocation location) {
+            (*static_cast<std::vector<std::complex<double>>*>(location))[idx] = std::complex<double>(r, i);
+            return true;
+        },
+        &amplitudes);
+    return amplitudes;
+}
+
+std::vector<unsigned> dumped_ids;
+std::vector<unsigned> dumped_qubit_ids(unsigned sim_id)
+{
+    dumped_ids.clear();
+    DumpIds(sim_id, [](unsigned id) { dumped_ids.push_back(id); });
+    return dumped_ids;
+}
+
 void test_allocate()
 {
     auto sim_id = init();
@@ -410,6 +460,384 @@ void test_permute_basis_adjoint()
     destroy(sim_id);
 }
 
+void test_single_precision()
+{
+    auto sim_single = initWithPrecision(32);
+    auto sim_double = initWithPrecision(64);
+    constexpr auto nqubits = 8u;
+
+    for (auto sim_id : {sim_single, sim_double})
+    {
+        for (unsigned i = 0; i < nqubits; ++i)
+            allocateQubit(sim_id, i);
+
+        // some entangled state, with both dense and diagonal fused gates
+        for (unsigned i = 0; i < nqubits; ++i)
+        {
+            H(sim_id, i);
+            Ry(sim_id, 0.3 * i, i);
+        }
+        for (unsigned i = 0; i + 1 < nqubits; ++i)
+        {
+            CX(sim_id, i, i + 1);
+            T(sim_id, i);
+            CRz(sim_id, 0.7, i + 1, i);
+        }
+    }
+
+    auto dump_callback = [](size_t idx, double r, double i, TDumpLocation location) {
+        (*static_cast<std::vector<std::complex<double>>*>(location))[idx] = {r, i};
+        return true;
+    };
+    std::vector<std::complex<double>> single_state(1ull << nqubits);
+    std::vector<std::complex<double>> double_state(1ull << nqubits);
+    DumpToLocation(sim_single, dump_callback, &single_state);
+    DumpToLocation(sim_double, dump_callback, &double_state);
+    for (std::size_t i = 0; i < double_state.size(); ++i)
+        assert(std::abs(single_state[i] - double_state[i]) < 1e-6);
+
+    destroy(sim_single);
+    destroy(sim_double);
+
+    // an unsupported precision falls back to double instead of throwing across the C boundary
+    auto sim_other = initWithPrecision(16);
+    allocateQubit(sim_other, 0);
+    H(sim_other, 0);
+    Ry(sim_other, 0.5, 0);
+    Ry(sim_other, -0.5, 0);
+    H(sim_other, 0);
+    assert(M(sim_other, 0) == false);
+    release(sim_other, 0);
+    destroy(sim_other);
+}
+
+void test_multim()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2, 3, 4};
+    for (unsigned q : qs)
+        allocateQubit(sim_id, q);
+
+    // a GHZ state on q0..q3 and q4 flipped to |1>
+    for (int round = 0; round < 20; ++round)
+    {
+        H(sim_id, 0);
+        for (unsigned t = 1; t < 4; ++t)
+            MCX(sim_id, 1, &qs[0], t);
+        X(sim_id, 4);
+
+        unsigned results[5];
+        MultiM(sim_id, 5, qs, results);
+        for (unsigned t = 1; t < 4; ++t)
+            assert(results[t] == results[0]);
+        assert(results[4] == 1);
+
+        // the state has collapsed onto the measured outcome
+        for (unsigned q : qs)
+        {
+            assert(M(sim_id, q) == results[q]);
+            if (results[q]) X(sim_id, q);
+        }
+    }
+
+    for (unsigned q : qs)
+        release(sim_id, q);
+    destroy(sim_id);
+}
+
+void test_sample()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2};
+    for (unsigned q : qs)
+        allocateQubit(sim_id, q);
+
+    // (|000> + |111>) / sqrt(2) on q0, q1 and q2, then q1 flipped: only 010 and 101 can be observed
+    H(sim_id, 0);
+    MCX(sim_id, 1, &qs[0], 1);
+    MCX(sim_id, 1, &qs[0], 2);
+    X(sim_id, 1);
+
+    const std::size_t shots = 1000;
+    std::vector<std::size_t> results(shots);
+    const bool sampled = Sample(sim_id, 3, qs, shots, results.data());
+    assert(sampled);
+    std::size_t ones = 0;
+    for (std::size_t r : results)
+    {
+        assert(r == 2 || r == 5);
+        ones += (r == 5);
+    }
+    assert(ones > 400 && ones < 600);
+
+    // the state has not collapsed
+    int z[] = {3};
+    assert(std::abs(JointEnsembleProbability(sim_id, 1, z, &qs[0]) - 0.5) < 1e-9);
+
+    X(sim_id, 1);
+    MCX(sim_id, 1, &qs[0], 2);
+    MCX(sim_id, 1, &qs[0], 1);
+    H(sim_id, 0);
+
+    // an outcome holds at most 64 qubits, more are rejected before anything is written
+    std::vector<unsigned> wide(65, 0);
+    std::size_t untouched = 7;
+    assert(!Sample(sim_id, 65, wide.data(), 1, &untouched));
+    assert(untouched == 7);
+
+    for (unsigned q : qs)
+        assert(release(sim_id, q));
+    destroy(sim_id);
+}
+
+void test_pauli_sum_expectation()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2, 3};
+    for (unsigned q : qs)
+        allocateQubit(sim_id, q);
+
+    H(sim_id, 0);
+    R(sim_id, 2, 0.7, 1);
+    MCX(sim_id, 1, &qs[0], 2);
+    T(sim_id, 2);
+    R(sim_id, 1, 1.3, 3);
+    MCY(sim_id, 1, &qs[1], 3);
+    X(sim_id, 1);
+    Z(sim_id, 3);
+
+    // I = 0, X = 1, Z = 2, Y = 3; several terms share the qubits they flip
+    const unsigned nterms = 6;
+    int b[nterms * 4] = {
+        1, 1, 0, 0, //
+        3, 1, 2, 0, //
+        2, 3, 2, 1, //
+        2, 0, 0, 2, //
+        0, 2, 2, 0, //
+        0, 0, 0, 0};
+    double c[nterms] = {0.5, -1.25, 0.75, 2., -0.3, 0.1};
+
+    double expected = 0.;
+    for (unsigned k = 0; k < nterms; ++k)
+    {
+        int* bk = &b[k * 4];
+        const bool identity = (bk[0] == 0 && bk[1] == 0 && bk[2] == 0 && bk[3] == 0);
+        expected += c[k] * (identity ? 1. : 1. - 2. * JointEnsembleProbability(sim_id, 4, bk, qs));
+    }
+    assert(std::abs(PauliSumExpectation(sim_id, 4, qs, nterms, b, c) - expected) < 1e-12);
+
+    destroy(sim_id);
+}
+
+void test_swap()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2, 3};
+    for (unsigned q : qs)
+        allocateQubit(sim_id, q);
+
+    // a Bell pair on q0 and q1 is moved to q2 and q3
+    for (int round = 0; round < 10; ++round)
+    {
+        H(sim_id, 0);
+        MCX(sim_id, 1, &qs[0], 1);
+        SWAP(sim_id, 0, 2);
+        SWAP(sim_id, 3, 1);
+        assert(M(sim_id, 0) == false && M(sim_id, 1) == false);
+        const bool r = M(sim_id, 2);
+        assert(M(sim_id, 3) == r);
+
+        // controlled on q3, the value of q2 moves back to q0, which leaves q2 in |0> either way
+        MCSWAP(sim_id, 1, &qs[3], 2, 0);
+        assert(M(sim_id, 0) == r && M(sim_id, 2) == false);
+        if (r) X(sim_id, 0);
+        if (r) X(sim_id, 3);
+    }
+
+    for (unsigned q : qs)
+        release(sim_id, q);
+    destroy(sim_id);
+}
+
+void test_swap_dump()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2};
+    for (unsigned q : qs)
+        allocateQubit(sim_id, q);
+
+    // the swapped qubits trade places in the dump, not just in the simulator's bookkeeping
+    X(sim_id, 0);
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"100"}));
+    SWAP(sim_id, 0, 1);
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"010"}));
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{2}));
+
+    X(sim_id, 2);
+    MCSWAP(sim_id, 1, &qs[2], 1, 0);
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"101"}));
+    MCSWAP(sim_id, 1, &qs[0], 1, 2);
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"110"}));
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{3}));
+
+    // with the control in superposition only the part where it is set is swapped
+    X(sim_id, 1);
+    H(sim_id, 2);
+    MCSWAP(sim_id, 1, &qs[2], 0, 1);
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"100", "011"}));
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{1, 6}));
+    destroy(sim_id);
+}
+
+void test_dump_order()
+{
+    auto sim_id = init();
+    allocateQubit(sim_id, 0);
+    allocateQubit(sim_id, 1);
+
+    // q1 enters the state before q0 does, the dump still lists the qubits in id order
+    H(sim_id, 1);
+    assert((dumped_qubit_ids(sim_id) == std::vector<unsigned>{0, 1}));
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{0, 2}));
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"00", "01"}));
+
+    H(sim_id, 1);
+    release(sim_id, 0);
+    release(sim_id, 1);
+    destroy(sim_id);
+}
+
+void test_dump_after_measurement()
+{
+    auto sim_id = init();
+    unsigned qs[] = {0, 1, 2};
+    for (unsigned q : qs)
+    {
+        allocateQubit(sim_id, q);
+        H(sim_id, q);
+    }
+    for (unsigned q : qs)
+        H(sim_id, q);
+
+    // q0 is measured out of the state and comes back above q1 and q2 when it's used again
+    X(sim_id, 0);
+    assert(M(sim_id, 0) == true);
+    H(sim_id, 0);
+    MCX(sim_id, 1, &qs[0], 2);
+    assert((dumped_qubit_ids(sim_id) == std::vector<unsigned>{0, 1, 2}));
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{0, 5}));
+    assert((dumped_basis_labels(sim_id) == std::vector<std::string>{"000", "101"}));
+    destroy(sim_id);
+}
+
+void test_wide_exp()
+{
+    // Pauli strings on more qubits than a fused gate spans are applied by the Exp kernel of the instruction set
+    auto sim_id = init();
+    constexpr unsigned n = 10;
+    for (unsigned q = 0; q < n; ++q)
+    {
+        allocateQubit(sim_id, q);
+        Ry(sim_id, 0.3 + 0.1 * q, q);
+    }
+    for (unsigned q = 0; q + 1 < n; ++q)
+        CRz(sim_id, 0.7, q, q + 1);
+
+    // exp(i phi P) on the indices with all controls set, where P|x> = i^ny (-1)^(Y or Z bits set in x) |t>
+    auto expected = [](std::vector<std::complex<double>> const& psi, std::vector<unsigned> const& bs, double phi,
+                       std::vector<unsigned> const& cs, std::vector<unsigned> const& ts) {
+        std::vector<std::complex<double>> out(psi);
+        for (std::size_t x = 0; x < psi.size(); ++x)
+        {
+            bool controlled = true;
+            for (unsigned c : cs)
+                controlled = controlled && ((x >> c) & 1);
+            if (!controlled) continue;
+            std::complex<double> px = 1.;
+            std::size_t t = x;
+            for (std::size_t i = 0; i < bs.size(); ++i)
+            {
+                const bool bit = (x >> ts[i]) & 1;
+                if (bs[i] == 1 || bs[i] == 3) t ^= std::size_t(1) << ts[i];
+                if (bs[i] == 3) px *= std::complex<double>(0., bit ? -1. : 1.);
+                if (bs[i] == 2 && bit) px = -px;
+            }
+            out[x] += (std::cos(phi) - 1.) * psi[x];
+            out[t] += std::complex<double>(0., std::sin(phi)) * px * psi[x];
+        }
+        return out;
+    };
+    auto check = [&](std::vector<unsigned> bs, double phi, std::vector<unsigned> cs, std::vector<unsigned> ts) {
+        const auto before = dumped_amplitudes(sim_id);
+        MCExp(sim_id, static_cast<unsigned>(bs.size()), bs.data(), phi, static_cast<unsigned>(cs.size()), cs.data(),
+              ts.data());
+        const auto after = dumped_amplitudes(sim_id);
+        const auto reference = expected(before, bs, phi, cs, ts);
+        for (std::size_t i = 0; i < after.size(); ++i)
+            assert(std::norm(after[i] - reference[i]) < 1e-20);
+    };
+
+    // 1 = X, 2 = Z, 3 = Y; flipping the lowest qubits pairs amplitudes within a vector
+    check({1, 2, 3, 3, 1, 2, 3, 1}, 0.37, {}, {0, 1, 2, 3, 4, 5, 6, 7});
+    check({3, 2, 1, 3, 0, 2, 3, 1}, -0.81, {9}, {1, 2, 3, 4, 5, 6, 7, 8});
+    check({2, 2, 2, 2, 2, 2, 2, 2}, 0.52, {}, {0, 1, 2, 3, 4, 5, 6, 7});
+    check({2, 0, 2, 2, 2, 2, 2, 2}, 1.1, {8, 9}, {0, 1, 2, 3, 4, 5, 6, 7});
+    check({2, 1, 1, 3, 2, 1, 1, 2}, 0.23, {0}, {2, 3, 4, 5, 6, 7, 8, 9});
+    destroy(sim_id);
+}
+
+void test_paged_init()
+{
+    // 2^10 amplitudes per chunk are whole pages, so releasing q10 and q11 moves pages
+    auto sim_id = initWithReservation(0, 20, 10);
+    unsigned qs[12];
+    for (unsigned q = 0; q < 12; ++q)
+    {
+        qs[q] = q;
+        allocateQubit(sim_id, q);
+        H(sim_id, q);
+    }
+    for (unsigned q = 0; q < 12; ++q)
+        H(sim_id, q);
+    X(sim_id, 11);
+    MCX(sim_id, 1, &qs[11], 0);
+    H(sim_id, 10);
+
+    assert(release(sim_id, 11) == false);
+    assert(M(sim_id, 0) == true);
+    X(sim_id, 0);
+    H(sim_id, 10);
+    assert(release(sim_id, 10) == true);
+    assert(num_qubits(sim_id) == 10);
+    assert((dumped_basis_states(sim_id) == std::vector<std::size_t>{0}));
+    destroy(sim_id);
+}
+
+void test_state_placement()
+{
+    auto sim_id = init();
+    // 2^17 amplitudes, large enough for the state to be touched in parallel when it is allocated
+    const unsigned n = 17;
+    for (unsigned q = 0; q < n; ++q)
+    {
+        allocateQubit(sim_id, q);
+        H(sim_id, q);
+    }
+    M(sim_id, 0);
+
+    std::vector<std::size_t> pages(64, 0);
+    const unsigned nodes = StatePlacement(sim_id, static_cast<unsigned>(pages.size()), pages.data());
+#ifdef __linux__
+    assert(nodes >= 1);
+#endif
+    std::size_t total = 0;
+    for (unsigned i = 0; i < std::min<unsigned>(nodes, static_cast<unsigned>(pages.size())); ++i)
+        total += pages[i];
+    assert(nodes == 0 || total > 0);
+
+    destroy(sim_id);
+}
+
 int main()
 {
     std::cerr << "Testing allocate\n";
@@ -421,6 +849,26 @@ int main()
     std::cerr << "Testing basis state permutation\n";
     test_permute_basis();
     test_permute_basis_adjoint();
+    std::cerr << "Testing single precision\n";
+    test_single_precision();
+    std::cerr << "Testing MultiM\n";
+    test_multim();
+    std::cerr << "Testing Sample\n";
+    test_sample();
+    std::cerr << "Testing PauliSumExpectation\n";
+    test_pauli_sum_expectation();
+    std::cerr << "Testing dump order\n";
+    test_dump_order();
+    test_dump_after_measurement();
+    std::cerr << "Testing SWAP\n";
+    test_swap();
+    test_swap_dump();
+    std::cerr << "Testing Exp\n";
+    test_wide_exp();
+    std::cerr << "Testing paged state\n";
+    test_paged_init();
+    std::cerr << "Testing StatePlacement\n";
+    test_state_placement();
     std::cerr << "Testing dump\n";
     // test_dump();
     // test_dump_qubits();
@@ -6,6 +6,7 @@
 #include "util/cpuid.hpp"
 #include <iostream>
 #include <shared_mutex>
+#include <stdexcept>
 
 namespace Microsoft
 {
@@ -13,19 +14,35 @@ namespace Quantum
 {
 namespace SimulatorGeneric
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
 }
 namespace SimulatorAVX
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
 }
 namespace SimulatorAVX2
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
 }
 namespace SimulatorAVX512
 {
-Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned);
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
+}
+namespace SimulatorGenericSingle
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
+}
+namespace SimulatorAVXSingle
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
+}
+namespace SimulatorAVX2Single
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
+}
+namespace SimulatorAVX512Single
+{
+Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned, unsigned);
 }
 } // namespace Quantum
 } // namespace Microsoft
@@ -39,27 +56,60 @@ namespace Simulator
 std::shared_mutex _mutex;
 std::vector<std::shared_ptr<SimulatorInterface>> _psis;
 
-SimulatorInterface* createSimulator(unsigned maxlocal)
+SimulatorInterface* createSimulator(unsigned maxlocal, unsigned precision, unsigned pageQubits)
 {
+    if (precision == 0)
+    {
+#ifdef DEFAULT_SINGLE_PRECISION
+        precision = 32;
+#else
+        precision = 64;
+#endif
+    }
+
+    if (precision == 32)
+    {
+        if (haveAVX512())
+        {
+            return SimulatorAVX512Single::createSimulator(maxlocal, pageQubits);
+        }
+        else if (haveFMA() && haveAVX2())
+        {
+            return SimulatorAVX2Single::createSimulator(maxlocal, pageQubits);
+        }
+        else if (haveAVX())
+        {
+            return SimulatorAVXSingle::createSimulator(maxlocal, pageQubits);
+        }
+        else
+        {
+            return SimulatorGenericSingle::createSimulator(maxlocal, pageQubits);
+        }
+    }
+    else if (precision != 64)
+    {
+        throw std::invalid_argument("the simulator supports 32 and 64 bit precision only");
+    }
+
     if (haveAVX512())
     {
-        return SimulatorAVX512::createSimulator(maxlocal);
+        return SimulatorAVX512::createSimulator(maxlocal, pageQubits);
     }
     else if (haveFMA() && haveAVX2())
     {
-        return SimulatorAVX2::createSimulator(maxlocal);
+        return SimulatorAVX2::createSimulator(maxlocal, pageQubits);
     }
     else if (haveAVX())
     {
-        return SimulatorAVX::createSimulator(maxlocal);
+        return SimulatorAVX::createSimulator(maxlocal, pageQubits);
     }
     else
     {
-        return SimulatorGeneric::createSimulator(maxlocal);
+        return SimulatorGeneric::createSimulator(maxlocal, pageQubits);
     }
 }
 
-MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
+MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal, unsigned precision, unsigned pageQubits)
 {
     std::lock_guard<std::shared_mutex> lock(_mutex);
 
@@ -75,12 +125,12 @@ MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal)
 
     if (emptySlot == (size_t)-1)
     {
-        _psis.push_back(std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal)));
+        _psis.push_back(std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal, precision, pageQubits)));
         emptySlot = _psis.size() - 1;
     }
     else
     {
-        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal));
+        _psis[emptySlot] = std::shared_ptr<SimulatorInterface>(createSimulator(maxlocal, precision, pageQubits));
     }
 
     return static_cast<unsigned>(emptySlot);
@@ -10,7 +10,11 @@ namespace Quantum
 {
 namespace Simulator
 {
-MICROSOFT_QUANTUM_DECL unsigned create(unsigned = 0u);
+/// `precision` is the number of bits of the real and imaginary parts of the amplitudes: 32 or 64, or 0 to use the
+/// default precision of the build. The state vector is reserved for `maxlocal` qubits (0 for no reservation), and
+/// with `pageQubits` > 0 the reservation is paged in chunks of 2^pageQubits amplitudes (see Wavefunction::reserve).
+/// Throws std::invalid_argument for a precision other than 0, 32 or 64; the C API falls back to 64 bits instead (see capi.cpp).
+MICROSOFT_QUANTUM_DECL unsigned create(unsigned maxlocal = 0u, unsigned precision = 0u, unsigned pageQubits = 0u);
 MICROSOFT_QUANTUM_DECL void destroy(unsigned);
 MICROSOFT_QUANTUM_DECL std::shared_ptr<SimulatorInterface>& get(unsigned);
 } // namespace Simulator
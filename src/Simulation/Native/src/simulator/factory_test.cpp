@@ -2,7 +2,9 @@
 // Licensed under the MIT License.
 
 #include "simulator/factory.hpp"
+#include <cmath>
 #include <iostream>
+#include <stdexcept>
 
 using namespace Microsoft::Quantum::Simulator;
 
@@ -24,5 +26,24 @@ int main(int argc, char** argv)
 
     sim->release(q);
 
+    // a single precision simulator takes and returns double amplitudes through the interface
+    auto single = get(create(0u, 32u));
+    single->allocateQubit(0);
+    single->allocateQubit(1);
+    const double amp = 1.0 / std::sqrt(2.0);
+    if (!single->InjectState({0, 1}, std::vector<std::complex<double>>{{amp, 0.}, {0., 0.}, {0., 0.}, {0., amp}}))
+        return 1;
+    const std::complex<double>* data = single->data();
+    if (std::abs(std::norm(data[0]) + std::norm(data[3]) - 1.) > 1e-6) return 1;
+
+    try
+    {
+        create(0u, 16u);
+        return 1;
+    }
+    catch (std::invalid_argument const&)
+    {
+    }
+
     return 0;
 }
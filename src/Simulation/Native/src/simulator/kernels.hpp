@@ -10,8 +10,17 @@
 #include "util/diagmatrix.hpp"
 #include "util/tinymatrix.hpp"
 
+#include <algorithm>
 #include <atomic>
 #include <complex>
+#include <map>
+#include <numeric>
+#include <type_traits>
+
+#ifdef HAVE_INTRINSICS
+#include "external/cintrin.hpp"
+#endif
+
 namespace Microsoft
 {
 namespace Quantum
@@ -41,22 +50,18 @@ void swap(std::vector<T, A>& wfn, unsigned q1, unsigned q2)
     std::size_t maskj = ((offset2 >> 1) - 1) ^ maskk; // bits [q1...q2-2]
     std::size_t maski = ~((offset2 >> 1) - 1);        // bits [q2-1...]
 
-#ifndef _MSC_VER
+    // One flat loop over runs of contiguous pairs, so that the threads share the work even when q2 is one of the
+    // highest positions and there are only one or two strides of 2 * offset2.
+    const std::size_t run = std::min<std::size_t>(offset1, 4096);
+    const std::intptr_t nruns = static_cast<std::intptr_t>(wfn.size() / 4 / run);
 #pragma omp parallel for schedule(static)
-    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i += 2 * offset2)
-        for (std::intptr_t j = 0; j < static_cast<std::intptr_t>(offset2); j += 2 * offset1)
-            for (std::intptr_t k = 0; k < static_cast<std::intptr_t>(offset1); k++)
-                std::swap(wfn[i + j + k + offset1], wfn[i + j + k + offset2]);
-#else
-#pragma omp parallel for schedule(static)
-    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(wfn.size()) / 4; ++l)
+    for (std::intptr_t r = 0; r < nruns; ++r)
     {
-        std::intptr_t k = l & maskk;
-        std::intptr_t j = (l & maskj) << 1;
-        std::intptr_t i = (l & maski) << 2;
-        std::swap(wfn[i + j + k + offset1], wfn[i + j + k + offset2]);
+        const std::size_t l = static_cast<std::size_t>(r) * run;
+        const std::size_t x = (l & maskk) + ((l & maskj) << 1) + ((l & maski) << 2);
+        for (std::size_t k = 0; k < run; ++k)
+            std::swap(wfn[x + k + offset1], wfn[x + k + offset2]);
     }
-#endif
 }
 
 template <class T, class A>
@@ -112,6 +117,150 @@ void collapse(std::vector<T, A>& wfn, unsigned q, bool val, bool compact = false
     }
 }
 
+// Adds a qubit in state |0> as the highest positional qubit, doubling the vector. Within the capacity of `wfn` only the
+// new upper half is written, otherwise the amplitudes are copied to a new vector. Both loops split the vector among
+// the threads like the kernels do, so pages that are touched here for the first time are placed on the NUMA node of
+// the thread that will work on them.
+template <class T, class A>
+void grow(std::vector<T, A>& wfn)
+{
+    const std::intptr_t n = static_cast<std::intptr_t>(wfn.size());
+    if (wfn.capacity() >= 2 * wfn.size())
+    {
+        // the new elements may be stale after a shrink, or left alone by the allocator
+        wfn.resize(2 * n);
+        T* data = wfn.data();
+#pragma omp parallel for schedule(static) proc_bind(spread)
+        for (std::intptr_t i = 0; i < 2 * n; ++i)
+            if (i >= n) data[i] = 0.;
+    }
+    else
+    {
+        std::vector<T, A> grown;
+        grown.reserve(2 * n);
+        grown.resize(2 * n);
+        T const* src = wfn.data();
+        T* dst = grown.data();
+#pragma omp parallel for schedule(static) proc_bind(spread)
+        for (std::intptr_t i = 0; i < 2 * n; ++i)
+            dst[i] = i < n ? src[i] : T(0.);
+        std::swap(wfn, grown);
+    }
+}
+
+// Moves the amplitudes where qubit q equals `val` to the lower half of `wfn`, scaled by `scale`, and drops the upper
+// half. This happens in place, so the capacity of `wfn` carries over and no second block of that capacity is needed.
+// Amplitude l of the lower half comes from an index i >= l, and the threads move them in rounds: first the l below
+// 2^q, whose sources are either themselves or lie above all of them, then the l in [s, 2s) for s = 2^q, 2^(q+1), ...,
+// whose sources lie at 2s and above. So no round reads what it writes, nor overwrites what a later round reads.
+template <class T, class A>
+void compact(std::vector<std::complex<T>, A>& wfn, unsigned q, bool val, T scale)
+{
+    const std::size_t offset = 1ull << q;
+    const std::size_t keep = val ? offset : 0;
+    const std::size_t half = wfn.size() / 2;
+    std::complex<T>* data = wfn.data();
+
+    for (std::size_t s = 0, e = std::min(offset, half); s < half; s = e, e = std::min(2 * e, half))
+    {
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t l = static_cast<std::intptr_t>(s); l < static_cast<std::intptr_t>(e); ++l)
+        {
+            const std::size_t i = ((l & ~(offset - 1)) << 1) | (l & (offset - 1));
+            data[l] = data[i | keep] * scale;
+        }
+    }
+    wfn.resize(half);
+}
+
+// Removes qubit q, which has to be in the classical state `val`: the half of the amplitudes where q differs from `val`
+// is checked to vanish, and the other half is compacted in place. Returns false and leaves `wfn` unchanged if the
+// vanishing half has an amplitude with a squared norm of at least `eps`.
+template <class T, class A>
+bool release(
+    std::vector<std::complex<T>, A>& wfn,
+    unsigned q,
+    bool val,
+    T eps = 100. * std::numeric_limits<T>::epsilon())
+{
+    const std::size_t offset = 1ull << q;
+    const std::size_t drop = val ? 0 : offset;
+    const std::size_t half = wfn.size() / 2;
+    bool dirty = false;
+
+#pragma omp parallel for schedule(static) reduction(|| : dirty)
+    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(half); ++l)
+    {
+        const std::size_t i = ((l & ~(offset - 1)) << 1) | (l & (offset - 1));
+        dirty = dirty || std::norm(wfn[i | drop]) >= eps;
+    }
+
+    if (dirty) return false;
+    compact(wfn, q, val, T(1));
+    return true;
+}
+
+// Measures qubit q out of the state: the half of the amplitudes where q equals `val`, whose squared norm is `prob`, is
+// compacted in place and renormalized. The other half is dropped unchecked, so this is `collapse` followed by `release`
+// without the extra passes.
+template <class T, class A>
+void collapse_out(std::vector<std::complex<T>, A>& wfn, unsigned q, bool val, double prob)
+{
+    assert(prob > 0.);
+    compact(wfn, q, val, static_cast<T>(1. / std::sqrt(prob)));
+}
+
+// Removes qubit q like `release`, without copying the amplitudes: the blocks of 2^q amplitudes where q equals `val` are
+// moved to the lower half by moving their pages, and the pages of the upper half are returned to the system. The
+// allocator has to provide `remap` and `discard` (see StateAlloc), and 2^q amplitudes have to fill whole pages.
+// Every moved block splits the mapping of the state, and a process may only have so many mappings, so at most
+// `max_remaps` blocks are moved and the others are copied.
+template <class T, class A>
+bool release_pages(
+    std::vector<std::complex<T>, A>& wfn,
+    unsigned q,
+    bool val,
+    T eps = 100. * std::numeric_limits<T>::epsilon(),
+    std::size_t max_remaps = 1024)
+{
+    const std::size_t offset = 1ull << q;
+    const std::size_t keep = val ? offset : 0;
+    const std::size_t drop = val ? 0 : offset;
+    const std::size_t half = wfn.size() / 2;
+    std::complex<T>* data = wfn.data();
+    bool dirty = false;
+
+#pragma omp parallel for schedule(static) reduction(|| : dirty)
+    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(half); ++l)
+    {
+        const std::size_t i = ((l & ~(offset - 1)) << 1) | (l & (offset - 1));
+        dirty = dirty || std::norm(data[i | drop]) >= eps;
+    }
+    if (dirty) return false;
+
+    // Block b moves to b * offset from a higher address, which has already been moved out unless it's dropped. The
+    // vacated blocks of the lower half are all filled again, the upper half is discarded as a whole.
+    const std::size_t nblocks = half / offset;
+    const std::size_t nremaps = std::min(nblocks, std::max<std::size_t>(max_remaps, 1));
+    for (std::size_t b = 0; b < nremaps; ++b)
+        if (b * offset != 2 * b * offset + keep) A::remap(data + b * offset, data + 2 * b * offset + keep, offset);
+
+    // The moved blocks left holes up to block 2 * nremaps, those in the lower half are mapped again to be copied to.
+    // The blocks [s, 2s) of each round are copied from [2s, 4s), above all destinations of the round, and the next
+    // round only overwrites them afterwards.
+    if (nremaps < nblocks) A::discard(data + nremaps * offset, (std::min(2 * nremaps, nblocks) - nremaps) * offset);
+    for (std::size_t s = nremaps; s < nblocks; s *= 2)
+    {
+        const std::intptr_t e = static_cast<std::intptr_t>(std::min(2 * s, nblocks));
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t b = static_cast<std::intptr_t>(s); b < e; ++b)
+            std::copy_n(data + 2 * b * offset + keep, offset, data + b * offset);
+    }
+    A::discard(data + half, half);
+    wfn.resize(half);
+    return true;
+}
+
 template <class T, class A>
 bool isclassical(
     std::vector<std::complex<T>, A> const& wfn,
@@ -160,6 +309,107 @@ double jointprobability(std::vector<T, A> const& wfn, std::vector<unsigned> cons
     return prob;
 }
 
+// Probabilities of all 2^qs.size() outcomes of measuring the qubits at positions `qs` (little-endian), gathered in a
+// single parallel pass into one histogram per thread. The outcome of an index is assembled from per-byte lookup tables
+// instead of extracting the bits one by one.
+template <class T, class A>
+std::vector<double> marginal(std::vector<std::complex<T>, A> const& wfn, std::vector<unsigned> const& qs)
+{
+    assert(qs.size() < 32);
+    const std::size_t bins = 1ull << qs.size();
+    const unsigned bytes = qs.empty() ? 0 : *std::max_element(qs.begin(), qs.end()) / 8 + 1;
+
+    std::vector<std::uint32_t> lut(256 * bytes, 0);
+    for (std::size_t l = 0; l < qs.size(); ++l)
+        for (unsigned v = 0; v < 256; ++v)
+            if ((v >> (qs[l] % 8)) & 1) lut[256 * (qs[l] / 8) + v] |= 1u << l;
+
+    std::vector<double> prob(bins, 0.);
+#pragma omp parallel
+    {
+        std::vector<double> local(bins, 0.);
+#pragma omp for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i++)
+        {
+            std::uint32_t outcome = 0;
+            for (unsigned b = 0; b < bytes; ++b)
+                outcome |= lut[256 * b + ((i >> (8 * b)) & 255)];
+            local[outcome] += std::norm(wfn[i]);
+        }
+#pragma omp critical
+        for (std::size_t k = 0; k < bins; ++k)
+            prob[k] += local[k];
+    }
+    return prob;
+}
+
+// Projects onto the subspace where the qubits at positions `qs` hold `outcome` (little-endian) and renormalizes by
+// `prob`, the squared norm of that subspace, in one pass.
+template <class T, class A>
+void multicollapse(std::vector<T, A>& wfn, std::vector<unsigned> const& qs, std::size_t outcome, double prob)
+{
+    assert(prob > 0.);
+    const std::size_t mask = make_mask(qs);
+    std::size_t state = 0;
+    for (std::size_t l = 0; l < qs.size(); ++l)
+        state |= ((outcome >> l) & 1) << qs[l];
+    const double scale = 1. / std::sqrt(prob);
+
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i++)
+        if ((i & mask) != state)
+            wfn[i] = 0.;
+        else
+            wfn[i] *= scale;
+}
+
+// Maps each of the sorted uniform variates in `u` to the basis index it selects from the distribution |wfn[i]|^2,
+// without modifying the state. One parallel pass sums the probabilities per chunk, a second walks every chunk once
+// and resolves the variates that fall into it, so drawing many samples costs two passes plus the lookups.
+template <class T, class A>
+std::vector<std::size_t> sample(std::vector<std::complex<T>, A> const& wfn, std::vector<double> const& u)
+{
+    assert(std::is_sorted(u.begin(), u.end()));
+    std::size_t threads = static_cast<std::size_t>(omp_get_max_threads());
+    std::vector<std::size_t> chunks = split_interval_in_chunks(wfn.size(), threads);
+    const std::intptr_t nchunks = static_cast<std::intptr_t>(chunks.size() - 1);
+
+    std::vector<double> cumulative(chunks.size(), 0.);
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+    {
+        double sum = 0.;
+        for (std::size_t i = chunks[c]; i < chunks[c + 1]; ++i)
+            sum += std::norm(wfn[i]);
+        cumulative[c + 1] = sum;
+    }
+    std::partial_sum(cumulative.begin(), cumulative.end(), cumulative.begin());
+    const double total = cumulative.back();
+
+    std::vector<std::size_t> indices(u.size());
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t c = 0; c < nchunks; ++c)
+    {
+        auto first = std::lower_bound(u.begin(), u.end(), cumulative[c] / total);
+        auto last = (c + 1 == nchunks) ? u.end() : std::lower_bound(u.begin(), u.end(), cumulative[c + 1] / total);
+
+        double sum = cumulative[c];
+        std::size_t i = chunks[c];
+        for (auto it = first; it != last; ++it)
+        {
+            const double target = *it * total;
+            while (i + 1 < chunks[c + 1] && sum + std::norm(wfn[i]) <= target)
+                sum += std::norm(wfn[i++]);
+            // rounding may stop on an amplitude that vanishes, fall back to the preceding one that doesn't
+            std::size_t j = i;
+            while (j > chunks[c] && std::norm(wfn[j]) == 0.)
+                --j;
+            indices[it - u.begin()] = j;
+        }
+    }
+    return indices;
+}
+
 template <class T, class A>
 double probability(std::vector<std::complex<T>, A> const& wfn, unsigned q)
 {
@@ -184,34 +434,240 @@ double probability(std::vector<std::complex<T>, A> const& wfn, unsigned q)
     return prob;
 }
 
-inline bool isDiagonal(std::vector<Gates::Basis> const& b)
-{
-    for (auto x : b)
-        if (x == Gates::PauliX || x == Gates::PauliY) return false;
-    return true;
-}
-
 // power of square root of -1
 inline ComplexType iExp(int power)
 {
-    using namespace std::literals::complex_literals;
     int p = ((power % 4) + 8) % 4;
     switch (p)
     {
     case 0:
         return 1;
     case 1:
-        return 1i;
+        return ComplexType(0., 1.);
     case 2:
         return -1;
     case 3:
-        return -1i;
+        return ComplexType(0., -1.);
     default:
         assert(false);
     }
     return 0;
 }
 
+// Splits the Pauli string `b` on the qubits at positions `qs` into the bits it flips (X or Y) and the bits whose value
+// contributes a sign (Y or Z), so that P|x> = i^ny (-1)^popcount(x & yz_bits) |x ^ xy_bits>.
+template <class B, class Q>
+void pauli_bits(
+    B const& b,
+    Q const& qs,
+    std::size_t& xy_bits,
+    std::size_t& yz_bits,
+    int& ny)
+{
+    xy_bits = 0;
+    yz_bits = 0;
+    ny = 0;
+    for (std::size_t i = 0; i < b.size(); ++i)
+    {
+        switch (b[i])
+        {
+        case Gates::PauliX:
+            xy_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliY:
+            xy_bits |= (1ull << qs[i]);
+            yz_bits |= (1ull << qs[i]);
+            ++ny;
+            break;
+        case Gates::PauliZ:
+            yz_bits |= (1ull << qs[i]);
+            break;
+        case Gates::PauliI:
+            break;
+        default:
+            assert(false);
+        }
+    }
+}
+
+// Positions of `fixed` bits are deposited into the index `l` of an enumeration that skips them, e.g. to visit only the
+// indices with all control bits set. `fixed` has to be sorted in ascending order.
+inline std::size_t deposit(std::size_t l, std::vector<unsigned> const& fixed)
+{
+    for (unsigned p : fixed)
+        l = ((l >> p) << (p + 1)) | (l & ((1ull << p) - 1));
+    return l;
+}
+
+// Takes the qubits at positions `qs` out of the state with the outcome `outcome` (little-endian), whose squared norm
+// is `prob`: the amplitudes where they hold it are renormalized and compacted in place into the first
+// wfn.size() >> qs.size() entries, in rounds that double like those of `compact`, so no round reads what it writes.
+template <class T, class A>
+void multicollapse_out(std::vector<std::complex<T>, A>& wfn, std::vector<unsigned> qs, std::size_t outcome, double prob)
+{
+    assert(prob > 0.);
+    std::size_t state = 0;
+    for (std::size_t l = 0; l < qs.size(); ++l)
+        state |= ((outcome >> l) & 1) << qs[l];
+    std::sort(qs.begin(), qs.end());
+    const T scale = static_cast<T>(1. / std::sqrt(prob));
+    const std::size_t size = wfn.size() >> qs.size();
+    std::complex<T>* data = wfn.data();
+
+    for (std::size_t s = 0, e = std::min(std::size_t(1) << qs.front(), size); s < size;
+         s = e, e = std::min(2 * e, size))
+    {
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t l = static_cast<std::intptr_t>(s); l < static_cast<std::intptr_t>(e); ++l)
+            data[l] = data[deposit(l, qs) | state] * scale;
+    }
+    wfn.resize(size);
+}
+
+#ifdef HAVE_INTRINSICS
+// Vector types of the translation unit for the runs of apply_controlled_exp on double precision amplitudes. Lanes are
+// permuted by flipping the low bits of their index, which is how an amplitude finds its partner under a Pauli string
+// that flips one of the low qubits.
+#ifdef HAVE_AVX512
+using exp_vector = __m512d;
+using exp_permutation = __m512i;
+inline exp_vector exp_load(std::complex<double> const* p)
+{
+    return _mm512_loadu_pd(reinterpret_cast<double const*>(p));
+}
+inline void exp_store(std::complex<double>* p, exp_vector const& v)
+{
+    _mm512_storeu_pd(reinterpret_cast<double*>(p), v);
+}
+inline exp_vector exp_scale(double s, exp_vector const& v)
+{
+    return _mm512_mul_pd(_mm512_set1_pd(s), v);
+}
+inline exp_vector exp_zero()
+{
+    return _mm512_setzero_pd();
+}
+inline exp_permutation exp_make_permutation(std::size_t m)
+{
+    return _mm512_set_epi64(
+        2 * (3 ^ m) + 1, 2 * (3 ^ m), 2 * (2 ^ m) + 1, 2 * (2 ^ m), 2 * (1 ^ m) + 1, 2 * (1 ^ m), 2 * m + 1, 2 * m);
+}
+inline exp_vector exp_permute(exp_vector const& v, exp_permutation const& p)
+{
+    return _mm512_permutexvar_pd(p, v);
+}
+#else
+using exp_vector = __m256d;
+using exp_permutation = bool;
+inline exp_vector exp_load(std::complex<double> const* p)
+{
+    return _mm256_loadu_pd(reinterpret_cast<double const*>(p));
+}
+inline void exp_store(std::complex<double>* p, exp_vector const& v)
+{
+    _mm256_storeu_pd(reinterpret_cast<double*>(p), v);
+}
+inline exp_vector exp_scale(double s, exp_vector const& v)
+{
+    return _mm256_mul_pd(_mm256_set1_pd(s), v);
+}
+inline exp_vector exp_zero()
+{
+    return _mm256_setzero_pd();
+}
+inline exp_permutation exp_make_permutation(std::size_t m)
+{
+    return m != 0;
+}
+inline exp_vector exp_permute(exp_vector const& v, exp_permutation const& p)
+{
+    return p ? _mm256_permute2f128_pd(v, v, 1) : v;
+}
+#endif
+constexpr std::size_t exp_lanes = sizeof(exp_vector) / sizeof(std::complex<double>);
+
+// Loads the coefficient of each lane, where the lane k takes coefs[parity != poppar(k & yz_bits)], for both parities
+// of the higher index bits.
+inline void exp_lane_coefficients(
+    std::complex<double> const coefs[2],
+    std::size_t yz_bits,
+    exp_vector lanes[2])
+{
+    std::complex<double> c[exp_lanes];
+    for (unsigned parity = 0; parity < 2; ++parity)
+    {
+        for (std::size_t k = 0; k < exp_lanes; ++k)
+            c[k] = coefs[(parity != 0) != poppar(k & yz_bits)];
+        lanes[parity] = exp_load(c);
+    }
+}
+
+// Vector version of the diagonal runs of apply_controlled_exp, the runs have to be at least exp_lanes long.
+inline void exp_diagonal_runs(
+    std::complex<double>* psi,
+    std::vector<unsigned> const& fixed,
+    std::size_t cmask,
+    std::size_t yz_bits,
+    std::size_t run,
+    std::intptr_t nruns,
+    std::complex<double> const phases[2])
+{
+    exp_vector p[2];
+    exp_lane_coefficients(phases, yz_bits, p);
+
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t r = 0; r < nruns; r++)
+    {
+        const std::size_t x0 = deposit(r * run, fixed) | cmask;
+        const bool parity0 = poppar(x0 & yz_bits);
+        for (std::size_t j = 0; j < run; j += exp_lanes)
+            exp_store(psi + x0 + j, fma(exp_load(psi + x0 + j), p[parity0 != poppar(j & yz_bits)], exp_zero()));
+    }
+}
+
+// Vector version of the off-diagonal runs of apply_controlled_exp, the runs have to be at least exp_lanes long. The
+// partners of a vector of amplitudes are in another vector, with their lanes permuted by the low bits of xy_bits.
+inline void exp_pair_runs(
+    std::complex<double>* psi,
+    std::vector<unsigned> const& fixed,
+    std::size_t cmask,
+    std::size_t xy_bits,
+    std::size_t yz_bits,
+    std::size_t run,
+    std::intptr_t nruns,
+    double alpha,
+    std::complex<double> const betas[2],
+    std::complex<double> const gammas[2])
+{
+    exp_vector vb[2], vg[2];
+    exp_lane_coefficients(betas, yz_bits, vb);
+    exp_lane_coefficients(gammas, yz_bits, vg);
+    const exp_permutation perm = exp_make_permutation(xy_bits & (exp_lanes - 1));
+    const std::size_t xy_high = xy_bits & ~(exp_lanes - 1);
+
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t r = 0; r < nruns; r++)
+    {
+        const std::size_t x0 = deposit(r * run, fixed) | cmask;
+        const bool parity0 = poppar(x0 & yz_bits);
+        for (std::size_t j = 0; j < run; j += exp_lanes)
+        {
+            const std::size_t x = x0 + j;
+            const std::size_t t = x ^ xy_high;
+            const bool parity = parity0 != poppar(j & yz_bits);
+            const exp_vector a = exp_load(psi + x);
+            const exp_vector b = exp_permute(exp_load(psi + t), perm);
+            exp_store(psi + x, fma(b, vb[parity], exp_scale(alpha, a)));
+            exp_store(psi + t, exp_permute(fma(a, vg[parity], exp_scale(alpha, b)), perm));
+        }
+    }
+}
+#endif
+
+// Only the indices with all controls set are visited, in contiguous runs below the lowest control (or the highest
+// flipped bit in the off-diagonal case). Off the diagonal every iteration handles one pair {x, x ^ xy_bits}, where x
+// has the highest flipped bit cleared, so no iteration is spent on the partner index, and the sign parity of a run is
+// computed once. With intrinsics, double precision runs of at least exp_lanes amplitudes are processed in vectors.
 template <class T, class A>
 void apply_controlled_exp(
     std::vector<std::complex<T>, A>& wfn,
@@ -221,136 +677,291 @@ void apply_controlled_exp(
     std::vector<unsigned> const& qs)
 {
     assert(qs.size() > 1);
-    unsigned lowest = *std::min_element(qs.begin(), qs.end());
+    const std::size_t cmask = make_mask(cs);
 
-    std::size_t offset = 1ull << lowest;
-    std::size_t cmask = make_mask(cs);
-    std::size_t cmasku = cmask & (~(offset - 1));
+    std::size_t xy_bits, yz_bits;
+    int y_count;
+    pauli_bits(b, qs, xy_bits, yz_bits, y_count);
 
-    if (isDiagonal(b))
+    std::vector<unsigned> fixed(cs);
+    if (xy_bits != 0)
     {
-        std::size_t mask = make_mask(qs);
-        ComplexType phase = std::exp(ComplexType(0., -phi));
+        unsigned top = 0;
+        while ((xy_bits >> top) > 1)
+            ++top;
+        fixed.push_back(top);
+    }
+    std::sort(fixed.begin(), fixed.end());
+    // runs are capped so that there is enough of them to spread over the threads
+    const std::size_t free_size = wfn.size() >> fixed.size();
+    const std::size_t run = std::min<std::size_t>(fixed.empty() ? free_size : 1ull << fixed.front(), 4096);
+    const std::intptr_t nruns = static_cast<std::intptr_t>(free_size / run);
+
+    if (xy_bits == 0)
+    {
+        const ComplexType phase = std::exp(ComplexType(0., -phi));
+        const ComplexType phases[2] = {std::conj(phase), phase};
+#ifdef HAVE_INTRINSICS
+        if constexpr (std::is_same<T, double>::value)
+        {
+            if (run >= exp_lanes)
+            {
+                exp_diagonal_runs(wfn.data(), fixed, cmask, yz_bits, run, nruns, phases);
+                return;
+            }
+        }
+#endif
 
 #pragma omp parallel for schedule(static)
-        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
-            if ((x & cmask) == cmask) wfn[x] *= (poppar(x & mask) ? phase : std::conj(phase));
+        for (std::intptr_t r = 0; r < nruns; r++)
+        {
+            const std::size_t x0 = deposit(r * run, fixed) | cmask;
+            const bool parity0 = poppar(x0 & yz_bits);
+            for (std::size_t j = 0; j < run; ++j)
+                wfn[x0 + j] *= phases[parity0 != poppar(j & yz_bits)];
+        }
     }
     else
     { // see Exp-implementation-details.txt for the explanation of the algorithm below
-        std::size_t xy_bits = 0;
-        std::size_t yz_bits = 0;
-        int y_count = 0;
-        for (std::size_t i = 0; i < b.size(); ++i)
+        T alpha = std::cos(phi);
+        ComplexType beta = static_cast<RealType>(std::sin(phi)) * iExp(3 * y_count + 1);
+        ComplexType gamma = static_cast<RealType>(std::sin(phi)) * iExp(y_count + 1);
+        const ComplexType betas[2] = {beta, -beta};
+        const ComplexType gammas[2] = {gamma, -gamma};
+#ifdef HAVE_INTRINSICS
+        if constexpr (std::is_same<T, double>::value)
         {
-            switch (b[i])
+            if (run >= exp_lanes)
             {
-            case Gates::PauliX:
-                xy_bits |= (1ull << qs[i]);
-                break;
-            case Gates::PauliY:
-                xy_bits |= (1ull << qs[i]);
-                yz_bits |= (1ull << qs[i]);
-                ++y_count;
-                break;
-            case Gates::PauliZ:
-                yz_bits |= (1ull << qs[i]);
-                break;
-            case Gates::PauliI:
-                break;
-            default:
-                assert(false);
+                exp_pair_runs(wfn.data(), fixed, cmask, xy_bits, yz_bits, run, nruns, alpha, betas, gammas);
+                return;
             }
         }
-
-        T alpha = std::cos(phi);
-        ComplexType beta = std::sin(phi) * iExp(3 * y_count + 1);
-        ComplexType gamma = std::sin(phi) * iExp(y_count + 1);
+#endif
 
 #pragma omp parallel for schedule(static)
-        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
+        for (std::intptr_t r = 0; r < nruns; r++)
         {
-            std::intptr_t t = x ^ xy_bits;
-            if (x < t && ((x & cmask) == cmask))
+            const std::size_t x0 = deposit(r * run, fixed) | cmask;
+            const bool parity0 = poppar(x0 & yz_bits);
+            for (std::size_t j = 0; j < run; ++j)
             {
-                auto parity = poppar(x & yz_bits);
+                const std::size_t x = x0 + j;
+                const std::size_t t = x ^ xy_bits;
+                const bool parity = parity0 != poppar(j & yz_bits);
                 auto a = wfn[x];
                 auto b = wfn[t];
-                wfn[x] = alpha * a + (parity ? -beta : beta) * b;
-                wfn[t] = alpha * b + (parity ? -gamma : gamma) * a;
+                wfn[x] = alpha * a + betas[parity] * b;
+                wfn[t] = alpha * b + gammas[parity] * a;
             }
         }
     }
 }
 
+// Swaps the bits at positions p1 and p2 where all controls `cs` are set. Only the pairs {x, x ^ p1 ^ p2} with bit p1 set
+// and bit p2 cleared differ, so those are the indices that are enumerated, in contiguous runs below the lowest fixed bit.
 template <class T, class A>
-double jointprobability(
-    std::vector<T, A> const& wfn,
-    std::vector<Gates::Basis> const& b,
-    std::vector<unsigned> const& qs,
-    bool val = true)
+void apply_controlled_swap(std::vector<T, A>& wfn, std::vector<unsigned> const& cs, unsigned p1, unsigned p2)
 {
-    assert(qs.size() > 1);
+    if (p1 == p2) return;
+    const std::size_t cmask = make_mask(cs);
+    const std::size_t both = (1ull << p1) | (1ull << p2);
 
-    double prob = 0.;
-    unsigned lowest = *std::min_element(qs.begin(), qs.end());
+    std::vector<unsigned> fixed(cs);
+    fixed.push_back(p1);
+    fixed.push_back(p2);
+    std::sort(fixed.begin(), fixed.end());
+    const std::size_t free_size = wfn.size() >> fixed.size();
+    const std::size_t run = std::min<std::size_t>(1ull << fixed.front(), 4096);
+    const std::intptr_t nruns = static_cast<std::intptr_t>(free_size / run);
+
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t r = 0; r < nruns; r++)
+    {
+        const std::size_t x0 = deposit(r * run, fixed) | cmask | (1ull << p1);
+        for (std::size_t j = 0; j < run; ++j)
+            std::swap(wfn[x0 + j], wfn[(x0 + j) ^ both]);
+    }
+}
 
-    std::size_t offset = 1 << lowest;
+// Expectation value of the Pauli string `b` on the qubits at positions `qs`, in a single pass. For a string that flips
+// bits, P only couples the pairs {x, x ^ xy_bits}, which are enumerated by inserting a zero at the highest flipped bit.
+template <class T, class A>
+double pauli_expectation(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs)
+{
+    std::size_t xy_bits, yz_bits;
+    int ny;
+    pauli_bits(b, qs, xy_bits, yz_bits, ny);
 
-    if (isDiagonal(b))
+    double expectation = 0.;
+    if (xy_bits == 0)
     {
-        std::size_t mask = make_mask(qs);
-#pragma omp parallel for schedule(static) reduction(+ : prob)
+#pragma omp parallel for schedule(static) reduction(+ : expectation)
         for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i++)
-            if (poppar(i & mask) == val) prob += std::norm(wfn[i]);
+            expectation += poppar(i & yz_bits) ? -std::norm(wfn[i]) : std::norm(wfn[i]);
+        return expectation;
     }
-    else
+
+    std::size_t top = xy_bits;
+    while (top & (top - 1))
+        top &= top - 1;
+    const std::size_t low = top - 1;
+    const std::complex<double> phase = iExp(ny);
+
+    // <P> = sum over pairs of 2 Re(conj(psi[t]) * i^ny (-1)^parity(x) * psi[x]), as P is hermitian
+#pragma omp parallel for schedule(static) reduction(+ : expectation)
+    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(wfn.size() / 2); l++)
+    {
+        const std::size_t x = ((l & ~low) << 1) | (l & low);
+        const std::size_t t = x ^ xy_bits;
+        const std::complex<double> c = poppar(x & yz_bits) ? -phase : phase;
+        expectation += 2. * std::real(std::conj(std::complex<double>(wfn[t])) * c * std::complex<double>(wfn[x]));
+    }
+    return expectation;
+}
+
+// Expectation value of sum_k coeffs[k] * P_k, where the Pauli string b[k] acts on the qubits at positions `qs`. Terms
+// that flip the same bits couple the same pairs of amplitudes, so each such group is evaluated in one sweep that reads
+// every amplitude once and accumulates the contributions of all of its terms.
+template <class T, class A>
+double pauli_sum_expectation(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<std::vector<Gates::Basis>> const& b,
+    std::vector<double> const& coeffs,
+    std::vector<unsigned> const& qs)
+{
+    assert(b.size() == coeffs.size());
+
+    // per group: the sign bits of its terms, and the real and imaginary weights of i^ny * coeff
+    struct Group
+    {
+        std::vector<std::size_t> yz_bits;
+        std::vector<double> re;
+        std::vector<double> im;
+    };
+    std::map<std::size_t, Group> groups;
+    for (std::size_t k = 0; k < b.size(); ++k)
     {
-        std::size_t xy_bits = 0;
-        std::size_t yz_bits = 0;
-        int ipow = 1;
-        for (unsigned i = 0; i < b.size(); ++i)
+        std::size_t xy_bits, yz_bits;
+        int ny;
+        pauli_bits(b[k], qs, xy_bits, yz_bits, ny);
+        const std::complex<double> c = coeffs[k] * std::complex<double>(iExp(ny));
+        Group& g = groups[xy_bits];
+        g.yz_bits.push_back(yz_bits);
+        g.re.push_back(c.real());
+        g.im.push_back(c.imag());
+    }
+
+    double total = 0.;
+    for (auto const& entry : groups)
+    {
+        const std::size_t xy_bits = entry.first;
+        Group const& g = entry.second;
+        const std::size_t nterms = g.yz_bits.size();
+        double sum = 0.;
+
+        if (xy_bits == 0)
         {
-            switch (b[i])
+#pragma omp parallel for schedule(static) reduction(+ : sum)
+            for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i++)
             {
-            case Gates::PauliX:
-                xy_bits |= (1ull << qs[i]);
-                break;
-            case Gates::PauliY:
-                xy_bits |= (1ull << qs[i]);
-                yz_bits |= (1ull << qs[i]);
-                ++ipow;
-                break;
-            case Gates::PauliZ:
-                yz_bits |= (1ull << qs[i]);
-                break;
-            default:
-                assert(false);
+                double weight = 0.;
+                for (std::size_t k = 0; k < nterms; ++k)
+                    weight += poppar(i & g.yz_bits[k]) ? -g.re[k] : g.re[k];
+                sum += weight * std::norm(wfn[i]);
             }
         }
+        else
+        {
+            std::size_t top = xy_bits;
+            while (top & (top - 1))
+                top &= top - 1;
+            const std::size_t low = top - 1;
 
-        auto parity_delta = poppar(xy_bits & yz_bits);
-        T alpha1 = 1. / sqrt(2.);
-        ComplexType beta1 = iExp(ipow) * alpha1;
-        ComplexType sum = 0.;
+            // each pair contributes 2 Re(conj(psi[t]) * i^ny * coeff * (-1)^parity(x) * psi[x]) per term
 #pragma omp parallel for schedule(static) reduction(+ : sum)
-        for (std::intptr_t x = 0; x < static_cast<std::intptr_t>(wfn.size()); x++)
-        {
-            std::size_t t = x ^ xy_bits;
-            if (x < t)
+            for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(wfn.size() / 2); l++)
             {
-                auto parity_x = poppar(x & yz_bits);
-                auto parity_t = parity_x ^ parity_delta;
-                // to be checked - may be wrong
-                sum += std::conj(wfn[x]) * (alpha1 * wfn[x] + (parity_x ^ val ? -beta1 : beta1) * wfn[t]);
-                sum += std::conj(wfn[t]) * (alpha1 * wfn[t] + (parity_t ? -beta1 : beta1) * wfn[x]);
+                const std::size_t x = ((l & ~low) << 1) | (l & low);
+                const std::complex<double> w =
+                    std::conj(std::complex<double>(wfn[x ^ xy_bits])) * std::complex<double>(wfn[x]);
+                double re = 0.;
+                double im = 0.;
+                for (std::size_t k = 0; k < nterms; ++k)
+                {
+                    const bool odd = poppar(x & g.yz_bits[k]);
+                    re += odd ? -g.re[k] : g.re[k];
+                    im += odd ? -g.im[k] : g.im[k];
+                }
+                sum += 2. * (re * w.real() - im * w.imag());
             }
         }
-        using namespace std::literals::complex_literals;
-        prob = std::real((0.5 * (sum * ComplexType(0., 1.) + 1.)));
+        total += sum;
     }
+    return total;
+}
 
-    return prob;
+// Probability that measuring the Pauli string `b` on the qubits at positions `qs` yields `val` (true for the -1
+// eigenvalue), without changing the basis first.
+template <class T, class A>
+double jointprobability(
+    std::vector<std::complex<T>, A> const& wfn,
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs,
+    bool val = true)
+{
+    const double expectation = pauli_expectation(wfn, b, qs);
+    return 0.5 * (val ? 1. - expectation : 1. + expectation);
+}
+
+// Projects onto the `val` eigenspace of the Pauli string `b` (true for the -1 eigenvalue), i.e. applies
+// (1 + (-1)^val P) / 2, and renormalizes by `prob`, the probability of that outcome, in a single pass.
+template <class T, class A>
+void jointcollapse(
+    std::vector<std::complex<T>, A>& wfn,
+    std::vector<Gates::Basis> const& b,
+    std::vector<unsigned> const& qs,
+    bool val,
+    double prob)
+{
+    assert(prob > 0.);
+    std::size_t xy_bits, yz_bits;
+    int ny;
+    pauli_bits(b, qs, xy_bits, yz_bits, ny);
+    const double scale = 1. / std::sqrt(prob);
+
+    if (xy_bits == 0)
+    {
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t i = 0; i < static_cast<std::intptr_t>(wfn.size()); i++)
+            if (poppar(i & yz_bits) != val)
+                wfn[i] = 0.;
+            else
+                wfn[i] *= static_cast<T>(scale);
+        return;
+    }
+
+    std::size_t top = xy_bits;
+    while (top & (top - 1))
+        top &= top - 1;
+    const std::size_t low = top - 1;
+    const std::complex<double> phase = 0.5 * scale * std::complex<double>(val ? -iExp(ny) : iExp(ny));
+
+#pragma omp parallel for schedule(static)
+    for (std::intptr_t l = 0; l < static_cast<std::intptr_t>(wfn.size() / 2); l++)
+    {
+        const std::size_t x = ((l & ~low) << 1) | (l & low);
+        const std::size_t t = x ^ xy_bits;
+        const std::complex<double> cx = poppar(x & yz_bits) ? -phase : phase;
+        const std::complex<double> ct = poppar(t & yz_bits) ? -phase : phase;
+        const std::complex<double> a = wfn[x];
+        const std::complex<double> c = wfn[t];
+        wfn[x] = 0.5 * scale * a + ct * c;
+        wfn[t] = 0.5 * scale * c + cx * a;
+    }
 }
 
 // get the 2-norm
@@ -532,6 +1143,98 @@ bool subsytemwavefunction(
 
     return true;
 }
+
+// Permutes the standard computational basis of the subsystem at positions `qs` (listed little-endian) in place: the
+// amplitude of register value j moves to register value table[j], or back from it if `adjoint` is set. The table is
+// split into cycles once, and every assignment of the remaining qubits then rotates the amplitudes along each cycle,
+// so no second state vector is needed. Register offsets are precomputed (a scatter of j into the bits of `qs`), and
+// the remaining qubits are deposited around them for each block.
+template <class T, class A>
+void permute_basis(
+    std::vector<T, A>& wfn,
+    std::vector<unsigned> const& qs,
+    std::size_t table_size,
+    std::size_t const* table,
+    bool adjoint)
+{
+    assert(table_size == (1ull << qs.size()));
+
+    std::vector<std::size_t> offset(table_size, 0);
+    for (std::size_t j = 0; j < table_size; ++j)
+        for (std::size_t l = 0; l < qs.size(); ++l)
+            if ((j >> l) & 1) offset[j] |= 1ull << qs[l];
+
+    // non-trivial cycles, stored back to back in `cycles` and delimited by `starts`
+    std::vector<std::size_t> cycles;
+    std::vector<std::size_t> starts;
+    {
+        std::vector<bool> seen(table_size, false);
+        for (std::size_t j0 = 0; j0 < table_size; ++j0)
+        {
+            if (seen[j0] || table[j0] == j0) continue;
+            starts.push_back(cycles.size());
+            for (std::size_t j = j0; !seen[j]; j = table[j])
+            {
+                seen[j] = true;
+                cycles.push_back(offset[j]);
+            }
+        }
+        starts.push_back(cycles.size());
+    }
+    if (cycles.empty()) return;
+
+    const std::size_t num_cycles = starts.size() - 1;
+    auto rotate = [&](std::size_t base, std::size_t c) {
+        const std::size_t* first = cycles.data() + starts[c];
+        const std::size_t* last = cycles.data() + starts[c + 1] - 1;
+        // cycles list j, table[j], table[table[j]], ...: the forward permutation moves every amplitude one step along
+        if (!adjoint)
+        {
+            T carry = wfn[base + *last];
+            for (const std::size_t* p = last; p != first; --p)
+                wfn[base + *p] = wfn[base + *(p - 1)];
+            wfn[base + *first] = carry;
+        }
+        else
+        {
+            T carry = wfn[base + *first];
+            for (const std::size_t* p = first; p != last; ++p)
+                wfn[base + *p] = wfn[base + *(p + 1)];
+            wfn[base + *last] = carry;
+        }
+    };
+
+    std::vector<unsigned> sorted(qs);
+    std::sort(sorted.begin(), sorted.end());
+    const std::intptr_t num_blocks = static_cast<std::intptr_t>(wfn.size() / table_size);
+
+    if (num_blocks >= omp_get_max_threads())
+    {
+#pragma omp parallel for schedule(static)
+        for (std::intptr_t b = 0; b < num_blocks; ++b)
+        {
+            // deposit the block index into the bits not covered by qs
+            std::size_t base = static_cast<std::size_t>(b);
+            for (unsigned q : sorted)
+                base = ((base >> q) << (q + 1)) | (base & ((1ull << q) - 1));
+            for (std::size_t c = 0; c < num_cycles; ++c)
+                rotate(base, c);
+        }
+    }
+    else
+    {
+        // few blocks (qs covers almost all qubits): the cycles are disjoint, so spread them over the threads instead
+        for (std::intptr_t b = 0; b < num_blocks; ++b)
+        {
+            std::size_t base = static_cast<std::size_t>(b);
+            for (unsigned q : sorted)
+                base = ((base >> q) << (q + 1)) | (base & ((1ull << q) - 1));
+#pragma omp parallel for schedule(dynamic)
+            for (std::intptr_t c = 0; c < static_cast<std::intptr_t>(num_cycles); ++c)
+                rotate(base, static_cast<std::size_t>(c));
+        }
+    }
+}
 } // namespace kernels
 } // namespace SIMULATOR
 } // namespace Quantum
@@ -7,9 +7,16 @@
 #include "util/bititerator.hpp"
 #include "util/bitops.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <bitset>
 #include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <new>
+#include <numeric>
+#include <random>
 
 using namespace Microsoft::Quantum::SIMULATOR;
 
@@ -246,10 +253,8 @@ TEST_CASE("Clustering", "[local_test]")
     }
 
     // X(q1), X(q2), CNOT(q2, q3), Y(q2), X(q3), Y(q1)
-    // Our clustering algorithm starts by clustering at width 1, which allows to combine Y(q1) and X(q1):
-    // {X(q1), Y(q1)}, {X(q2)}, {CNOT(q2, q3)}, {Y(q2)}, {X(q3)}
-    // The next step would create clusters of width 2:
-    // {X(q1), Y(q1), X(q2)}, {CNOT(q2, q3), Y(q2), X(q3)}
+    // The frontier of q1 is the first cluster, so Y(q1) joins it past the CNOT it commutes with:
+    // {X(q1), X(q2), Y(q1)}, {CNOT(q2, q3), Y(q2), X(q3)}
     SECTION("Pull gate through a CNOT (width 2)")
     {
         std::vector<DeferredGate> gates{g_n_1, g_n_2, g_2_3, g_n_2, g_n_3, g_n_1};
@@ -267,22 +272,61 @@ TEST_CASE("Clustering", "[local_test]")
 
     // X(q1), X(q2), X(q3), CNOT(q1, q2), CNOT(q1, q3), Y(q1), Y(q2), Y(q3)
     // For width 2 clustering our algorithm gets:
-    // {X(q1), X(q2), CNOT(q1, q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}, {Y(q2)}
-    // !and not this one: {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)} (because CNOT(q1, q3)
-    // cannot be merged into the first cluster and terminates it, preventing addition of Y(q2))
+    // {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}
+    // Y(q2) commutes with the second cluster, and the frontier of q2 is still the first one, so Y(q2) joins it.
     SECTION("Many CNOT gates")
     {
         std::vector<DeferredGate> gates{g_n_1, g_n_2, g_n_3, g_1_2, g_1_3, g_n_1, g_n_2, g_n_3};
         auto cls = Cluster::make_clusters(2 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
-        REQUIRE(cls.size() == 3);
+        REQUIRE(cls.size() == 2);
 
         auto it = cls.begin();
         CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 2});
-        CHECK(it->get_gates().size() == 3);
+        CHECK(it->get_gates().size() == 4);
+        CHECK(it->get_gates().back() == &gates[6]);
 
         ++it;
         CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 3});
         CHECK(it->get_gates().size() == 4);
+    }
+
+    // X(q1), CNOT(q1, q2), X(q2), X(q1)
+    // X(q2) and the last X(q1) must not move before the CNOT, and at width 1 they cannot join it either, although the
+    // first cluster has room for the last X(q1).
+    SECTION("Gates stay after their frontier")
+    {
+        std::vector<DeferredGate> gates{g_n_1, g_1_2, g_n_2, g_n_1};
+        auto cls = Cluster::make_clusters(1 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 4);
+
+        auto it = cls.begin();
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1});
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1, 2});
+        CHECK(it->get_gates().size() == 1);
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{2});
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1});
+    }
+
+    // X(q1), Exp([X, Y, Z], [q2, q3, q4]), Y(q1), Z(q2)
+    // The exponential is wider than the clusters, so it stays on its own, but doesn't stop Y(q1) from joining X(q1)
+    SECTION("Wide Exp")
+    {
+        DeferredGate g_exp({} /*controls*/, {Gates::PauliX, Gates::PauliY, Gates::PauliZ}, 0.3, {2, 3, 4});
+        std::vector<DeferredGate> gates{g_n_1, g_exp, g_n_1, g_n_2};
+        auto cls = Cluster::make_clusters(2 /*cluster qubit width*/, unlimited /*gates per cluster*/, gates);
+        REQUIRE(cls.size() == 3);
+
+        auto it = cls.begin();
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{1});
+        CHECK(it->get_gates().size() == 2);
+
+        ++it;
+        CHECK(it->get_qids() == std::vector<logical_qubit_id>{2, 3, 4});
+        CHECK(it->get_gates().size() == 1);
+        CHECK(it->get_gates().front()->is_exp());
 
         ++it;
         CHECK(it->get_qids() == std::vector<logical_qubit_id>{2});
@@ -320,6 +364,1167 @@ TEST_CASE("Clustering", "[local_test]")
     }
 }
 
+TEST_CASE("Perf of clustering", "[skip]") // local micro_benchmark
+{
+    using namespace std::chrono;
+
+    // Only the scheduling phase: the gates are never applied, so their matrices don't matter.
+    TinyMatrix<ComplexType, 2> ignore;
+    std::mt19937 gen(42);
+    auto make_gates = [&](unsigned n, bool layered) {
+        std::vector<DeferredGate> gates;
+        while (gates.size() < 999)
+        {
+            if (layered) // a layer of single qubit gates followed by a CNOT ladder
+            {
+                for (unsigned q = 0; q < n; q++)
+                    gates.emplace_back(QubitIds{}, q, ignore);
+                for (unsigned q = 0; q + 1 < n; q++)
+                    gates.emplace_back(QubitIds{q}, q + 1, ignore);
+            }
+            else // random single qubit gates and CNOTs
+            {
+                const unsigned c = gen() % n, t = gen() % n;
+                if (c != t && gen() % 3 == 0) gates.emplace_back(QubitIds{c}, t, ignore);
+                else gates.emplace_back(QubitIds{}, t, ignore);
+            }
+        }
+        gates.resize(999, gates.front());
+        return gates;
+    };
+
+    for (bool layered : {false, true})
+    {
+        for (unsigned n : {3, 8, 20})
+        {
+            for (unsigned span : {2, 4})
+            {
+                const std::vector<DeferredGate> gates = make_gates(n, layered);
+                const int reps = 1000;
+                size_t clusters = 0;
+                auto start = high_resolution_clock::now();
+                for (int i = 0; i < reps; i++)
+                {
+                    clusters = Cluster::make_clusters(span, 999, gates).size();
+                }
+                const double secs = duration<double>(high_resolution_clock::now() - start).count();
+                std::cout << (layered ? "layered" : "random ") << " n=" << n << " span=" << span
+                          << ":\t" << clusters << " clusters,\t" << reps * gates.size() / secs << " gates/s" << std::endl;
+            }
+        }
+    }
+}
+
+TEST_CASE("Tiled flush", "[local_test]")
+{
+    constexpr unsigned nq = 6;
+    constexpr int tileBits = 3;
+
+    WavefunctionStorage expected(1ull << nq);
+    for (size_t i = 0; i < expected.size(); i++)
+        expected[i] = ComplexType(std::cos(0.1 * i), std::sin(0.7 * i));
+    WavefunctionStorage actual(expected);
+
+    // {H(0), Rx(1)}, {C5-Ry(2)}, {C1-X(0)}: all targets are below the tile boundary, one control is above it
+    Fused fused;
+    std::vector<Fused::FusedCluster> group;
+
+    fused.apply(expected, Gates::H(0).matrix(), 0);
+    fused.apply(expected, Gates::Rx(0.3, 1).matrix(), 1);
+    fused.flush(expected);
+    fused.apply_controlled(expected, Gates::Ry(1.1, 2).matrix(), {5}, 2);
+    fused.flush(expected);
+    fused.apply_controlled(expected, Gates::X(0).matrix(), {1}, 0);
+    fused.flush(expected);
+
+    fused.apply(actual, Gates::H(0).matrix(), 0);
+    fused.apply(actual, Gates::Rx(0.3, 1).matrix(), 1);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    fused.apply_controlled(actual, Gates::Ry(1.1, 2).matrix(), {5}, 2);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    fused.apply_controlled(actual, Gates::X(0).matrix(), {1}, 0);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    Fused::flush_tiled(actual, group, tileBits);
+
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+        CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+    }
+
+    fused.apply(actual, Gates::H(3).matrix(), 3);
+    CHECK_FALSE(fused.fits_tile(actual, tileBits));
+}
+
+TEST_CASE("Out-of-core tiled flush", "[local_test]")
+{
+    constexpr unsigned nq = 17;
+    constexpr int tileBits = 12;
+    using Alloc = WavefunctionStorage::allocator_type;
+
+    WavefunctionStorage expected(1ull << nq);
+    for (size_t i = 0; i < expected.size(); i++)
+        expected[i] = ComplexType(std::cos(0.1 * i), std::sin(0.7 * i)) / std::sqrt(double(expected.size()));
+
+    // `actual` is mapped from a file in the working directory and streamed through by the tiled flush. The directory
+    // is shared by all state vectors of the process, so it's restored however the test ends.
+    struct StateDirGuard
+    {
+        const std::string saved = Alloc::state_dir();
+        ~StateDirGuard()
+        {
+            Alloc::state_dir() = saved;
+        }
+    } guard;
+    Alloc::state_dir() = ".";
+    WavefunctionStorage actual(expected);
+#ifdef __linux__
+    std::ifstream maps("/proc/self/maps");
+    std::string line;
+    bool mapped = false;
+    while (std::getline(maps, line))
+        mapped = mapped || line.find("qdk-sim-state-") != std::string::npos;
+    CHECK(mapped);
+#endif
+
+    // {C16-Rx(11)}, {C13-Ry(5)}, {H(0)}: the controls above the tile boundary select the tiles
+    Fused fused;
+    std::vector<Fused::FusedCluster> group;
+    fused.apply_controlled(expected, Gates::Rx(0.3, 11).matrix(), {16}, 11);
+    fused.flush(expected);
+    fused.apply_controlled(expected, Gates::Ry(1.1, 5).matrix(), {13}, 5);
+    fused.flush(expected);
+    fused.apply(expected, Gates::H(0).matrix(), 0);
+    fused.flush(expected);
+
+    fused.apply_controlled(actual, Gates::Rx(0.3, 11).matrix(), {16}, 11);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    fused.apply_controlled(actual, Gates::Ry(1.1, 5).matrix(), {13}, 5);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    fused.apply(actual, Gates::H(0).matrix(), 0);
+    CHECK(fused.fits_tile(actual, tileBits));
+    group.push_back(fused.take_fused());
+    Fused::flush_tiled(actual, group, tileBits);
+
+    size_t mismatches = 0;
+    for (size_t i = 0; i < expected.size(); i++)
+        if (std::norm(expected[i] - actual[i]) > 1e-20) ++mismatches;
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("Structured fused kernels", "[local_test]")
+{
+    constexpr unsigned nq = 6;
+
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.5 * i));
+
+    // Applies the cluster with the structured kernel and with the dense one, the results must agree
+    auto check = [&](Fused const& fused, Fusion::MatrixKind kind) {
+        Fused::FusedCluster fc = fused.take_fused();
+        CHECK(fc.kind == kind);
+
+        WavefunctionStorage expected(initial);
+        WavefunctionStorage actual(initial);
+        Fused::apply_fused(expected, fc.mat, fc.qs, fc.cmask);
+        Fused::apply_fused(actual, fc, fc.cmask);
+        for (size_t i = 0; i < expected.size(); i++)
+        {
+            INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+            CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+        }
+    };
+
+    Fused fused;
+
+    fused.apply(initial, Gates::T(1).matrix(), 1);
+    fused.apply(initial, Gates::S(3).matrix(), 3);
+    fused.apply_controlled(initial, Gates::Z(3).matrix(), {1}, 3);
+    check(fused, Fusion::MatrixKind::Diagonal);
+
+    fused.apply_controlled(initial, Gates::Rz(0.7, 2).matrix(), {0, 5}, 2);
+    check(fused, Fusion::MatrixKind::Diagonal);
+
+    fused.apply(initial, Gates::X(0).matrix(), 0);
+    fused.apply(initial, Gates::T(2).matrix(), 2);
+    fused.apply_controlled(initial, Gates::X(2).matrix(), {0}, 2);
+    fused.apply(initial, Gates::Y(4).matrix(), 4);
+    check(fused, Fusion::MatrixKind::Monomial);
+
+    fused.apply_controlled(initial, Gates::Y(1).matrix(), {3}, 1);
+    check(fused, Fusion::MatrixKind::Monomial);
+
+    // with the lowest target or control at 3 and 4, the kernels sweep runs of 8 and 16 contiguous amplitudes
+    fused.apply(initial, Gates::T(4).matrix(), 4);
+    fused.apply_controlled(initial, Gates::S(5).matrix(), {3}, 5);
+    check(fused, Fusion::MatrixKind::Diagonal);
+
+    fused.apply(initial, Gates::X(5).matrix(), 5);
+    fused.apply_controlled(initial, Gates::Y(4).matrix(), {5}, 4);
+    check(fused, Fusion::MatrixKind::Monomial);
+
+    fused.apply(initial, Gates::H(1).matrix(), 1);
+    fused.apply(initial, Gates::T(2).matrix(), 2);
+    check(fused, Fusion::MatrixKind::Dense);
+}
+
+TEST_CASE("Controlled fused kernels", "[local_test]")
+{
+    constexpr unsigned nq = 11;
+    const std::vector<unsigned> positions = {6, 0, 9, 2, 4, 7, 3};
+    const std::size_t cmask = (1ull << 1) | (1ull << 5) | (1ull << 10);
+
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.5 * i));
+
+    // the kernels only visit the indices with all control bits set, compare with a plain matrix-vector product
+    for (unsigned k = 1; k <= positions.size(); k++)
+    {
+        const std::size_t dim = 1ull << k;
+        Fusion::Matrix m(dim);
+        Fusion::IndexVector qs;
+        std::size_t tmask = 0;
+        for (unsigned l = 0; l < k; l++)
+        {
+            qs.push_back(positions[l]);
+            tmask |= 1ull << positions[l];
+        }
+        for (std::size_t r = 0; r < dim; r++)
+            for (std::size_t c = 0; c < dim; c++)
+                m[r][c] = Fusion::Complex(std::cos(0.7 * r + 0.2 * c), std::sin(1.3 * r * c + k));
+
+        WavefunctionStorage expected(initial);
+        for (std::size_t i = 0; i < expected.size(); i++)
+        {
+            if ((i & cmask) != cmask || (i & tmask) != 0) continue;
+            std::vector<std::size_t> idx(dim, i);
+            for (std::size_t r = 0; r < dim; r++)
+                for (unsigned l = 0; l < k; l++)
+                    if ((r >> l) & 1) idx[r] |= 1ull << positions[l];
+            std::vector<ComplexType> out(dim, 0.);
+            for (std::size_t r = 0; r < dim; r++)
+                for (std::size_t c = 0; c < dim; c++)
+                    out[r] += static_cast<ComplexType>(m[r][c]) * initial[idx[c]];
+            for (std::size_t r = 0; r < dim; r++)
+                expected[idx[r]] = out[r];
+        }
+
+        WavefunctionStorage actual(initial);
+        Fused::apply_fused(actual, m, qs, cmask);
+        size_t mismatches = 0;
+        for (size_t i = 0; i < expected.size(); i++)
+            if (std::norm(expected[i] - actual[i]) > 1e-16 * (1 + std::norm(expected[i]))) ++mismatches;
+        INFO(std::string("span ") + std::to_string(k));
+        CHECK(mismatches == 0);
+    }
+}
+
+TEST_CASE("Pauli frame", "[local_test]")
+{
+    // `psi` absorbs uncontrolled Paulis into its frame, `ref` applies them as gates with an empty list of controls
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < 3; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+    }
+    const std::vector<logical_qubit_id> none;
+
+    psi.apply(Gates::H(qs[0]));
+    psi.apply(Gates::X(qs[0]));
+    psi.apply(Gates::Y(qs[1]));
+    psi.apply_controlled(qs[0], Gates::X(qs[1]));
+    psi.apply(Gates::Z(qs[0]));
+    psi.apply(Gates::T(qs[1]));
+    psi.apply(Gates::Y(qs[2]));
+    psi.apply_controlled(qs[1], Gates::Rx(0.3, qs[2]));
+    psi.apply(Gates::Z(qs[2]));
+    psi.apply_controlled_exp({Gates::PauliX, Gates::PauliY}, 0.7, {}, {qs[0], qs[2]});
+
+    ref.apply(Gates::H(qs[0]));
+    ref.apply_controlled(none, Gates::X(qs[0]));
+    ref.apply_controlled(none, Gates::Y(qs[1]));
+    ref.apply_controlled(qs[0], Gates::X(qs[1]));
+    ref.apply_controlled(none, Gates::Z(qs[0]));
+    ref.apply(Gates::T(qs[1]));
+    ref.apply_controlled(none, Gates::Y(qs[2]));
+    ref.apply_controlled(qs[1], Gates::Rx(0.3, qs[2]));
+    ref.apply_controlled(none, Gates::Z(qs[2]));
+    ref.apply_controlled_exp({Gates::PauliX, Gates::PauliY}, 0.7, {}, {qs[0], qs[2]});
+
+    for (logical_qubit_id q : qs)
+    {
+        CHECK(std::abs(psi.probability(q) - ref.probability(q)) < 1e-12);
+    }
+    CHECK(std::abs(psi.jointprobability(qs) - ref.jointprobability(qs)) < 1e-12);
+
+    // the frame of a released classical qubit leaves a global phase behind
+    logical_qubit_id q = psi.allocate_qubit();
+    ref.allocate_qubit();
+    psi.apply(Gates::X(q));
+    psi.apply(Gates::Z(q));
+    ref.apply_controlled(none, Gates::X(q));
+    ref.apply_controlled(none, Gates::Z(q));
+    CHECK(psi.getvalue(q));
+    psi.apply(Gates::X(q));
+    ref.apply_controlled(none, Gates::X(q));
+    psi.release(q);
+    ref.release(q);
+
+    const WavefunctionStorage& actual = psi.data();
+    const WavefunctionStorage& expected = ref.data();
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+        CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+    }
+}
+
+TEST_CASE("Lazy qubit allocation", "[local_test]")
+{
+    // the qubits start out as classical bits, 64 of them wouldn't fit in memory otherwise
+    Wavefunction<ComplexType> psi;
+    std::vector<logical_qubit_id> qs;
+    for (int i = 0; i < 64; i++)
+        qs.push_back(psi.allocate_qubit());
+    REQUIRE(psi.num_qubits() == 64);
+
+    // gates on classical controls and Pauli targets are resolved without the state
+    psi.apply(Gates::X(qs[0]));
+    psi.apply_controlled(qs[0], Gates::X(qs[1]));
+    psi.apply_controlled(qs[0], qs[1], Gates::X(qs[2]));
+    psi.apply_controlled(qs[4], Gates::H(qs[3])); // control is 0
+    psi.apply_controlled(qs[2], Gates::Y(qs[5]));
+    psi.apply_controlled_exp({Gates::PauliX, Gates::PauliY}, 0.3, {qs[6]}, {qs[7], qs[8]});
+    CHECK(psi.measure(qs[2]));
+    CHECK(psi.isclassical(qs[3]));
+    CHECK(psi.jointprobability({qs[0], qs[1]}) == 0.);
+    CHECK(psi.jointmeasure({Gates::PauliZ, Gates::PauliI}, {qs[5], qs[6]}));
+    CHECK(psi.multimeasure({qs[0], qs[1], qs[2], qs[3], qs[4], qs[5]}) == std::vector<bool>{1, 1, 1, 0, 0, 1});
+
+    // a Bell pair adds just its own qubits to the state, a classical control on it turns into the frame
+    psi.apply(Gates::H(qs[10]));
+    psi.apply_controlled(qs[10], Gates::X(qs[11]));
+    psi.apply_controlled(qs[0], Gates::X(qs[11]));
+    CHECK(std::abs(psi.jointprobability({qs[10], qs[11], qs[0]})) < 1e-12);
+    CHECK(std::abs(psi.probability(qs[11]) - 0.5) < 1e-12);
+    const bool m = psi.measure(qs[10]);
+    CHECK(psi.measure(qs[11]) != m);
+
+    // the memory of the state is queried without adding the classical bits to it
+    CHECK(psi.storage().size() == 1);
+    SimulatorType sim;
+    for (int i = 0; i < 64; i++)
+        sim.allocate();
+    sim.statePlacement();
+
+    for (int i = 0; i < 64; i++)
+    {
+        const bool one = (i <= 2) || (i == 5) || (i == 10 && m) || (i == 11 && !m);
+        CHECK(psi.release(qs[i]) == !one);
+    }
+    CHECK(psi.num_qubits() == 0);
+
+    // dumping the state adds the classical bits to it
+    logical_qubit_id a = psi.allocate_qubit();
+    logical_qubit_id b = psi.allocate_qubit();
+    psi.apply(Gates::X(b));
+    const WavefunctionStorage& wfn = psi.data();
+    REQUIRE(wfn.size() == 4);
+    CHECK(std::abs(std::norm(wfn[1ull << psi.get_qubit_position(b)]) - 1.) < 1e-12);
+    CHECK(psi.getvalue(b));
+    CHECK(!psi.getvalue(a));
+}
+
+TEST_CASE("Exponentials, Pauli sums and samples on classical bits", "[local_test]")
+{
+    // q0 and q3 are in the state, q1 is a classical 1 and q2 a classical 0. The reference has all of them in the
+    // state, the results must agree and the lazy state must not grow.
+    auto prepare = [](Wavefunction<ComplexType>& psi, bool materialize) {
+        std::vector<logical_qubit_id> qs;
+        for (int i = 0; i < 4; i++)
+            qs.push_back(psi.allocate_qubit());
+        psi.apply(Gates::H(qs[0]));
+        psi.apply(Gates::H(qs[3]));
+        psi.apply(Gates::X(qs[1]));
+        if (materialize)
+        {
+            psi.apply(Gates::H(qs[1]));
+            psi.apply(Gates::H(qs[1]));
+            psi.apply(Gates::H(qs[2]));
+            psi.apply(Gates::H(qs[2]));
+        }
+        psi.apply_controlled_exp({Gates::PauliZ, Gates::PauliX}, 0.3, {}, {qs[1], qs[0]});
+        psi.apply_controlled_exp({Gates::PauliY, Gates::PauliZ, Gates::PauliI}, 0.4, {qs[3]}, {qs[0], qs[1], qs[2]});
+        psi.apply_controlled_exp({Gates::PauliZ, Gates::PauliZ}, 0.5, {qs[3]}, {qs[1], qs[2]});
+        psi.apply_controlled_exp({Gates::PauliZ, Gates::PauliZ}, 0.6, {}, {qs[2], qs[1]});
+        return qs;
+    };
+    Wavefunction<ComplexType> lazy, reference;
+    const std::vector<logical_qubit_id> qs = prepare(lazy, false);
+    prepare(reference, true);
+
+    const std::vector<std::vector<Gates::Basis>> terms = {
+        {Gates::PauliX, Gates::PauliZ, Gates::PauliI, Gates::PauliI},
+        {Gates::PauliY, Gates::PauliI, Gates::PauliZ, Gates::PauliX},
+        {Gates::PauliZ, Gates::PauliI, Gates::PauliI, Gates::PauliY},
+        {Gates::PauliI, Gates::PauliX, Gates::PauliI, Gates::PauliI},
+        {Gates::PauliI, Gates::PauliZ, Gates::PauliZ, Gates::PauliI}};
+    for (auto const& term : terms)
+    {
+        const double expected = reference.pauli_sum_expectation({term}, {1.}, qs);
+        CHECK(std::abs(lazy.pauli_sum_expectation({term}, {1.}, qs) - expected) < 1e-12);
+    }
+    const std::vector<std::vector<Gates::Basis>> classical = {
+        {Gates::PauliI, Gates::PauliX, Gates::PauliI, Gates::PauliI},
+        {Gates::PauliZ, Gates::PauliZ, Gates::PauliI, Gates::PauliI}};
+    CHECK(std::abs(lazy.pauli_sum_expectation(classical, {2., 3.}, {qs[1], qs[2], qs[0], qs[3]}) + 3.) < 1e-12);
+
+    for (size_t outcome : lazy.sample({qs[1], qs[0], qs[2]}, 100))
+        CHECK((outcome & 5) == 1);
+    CHECK(lazy.sample({qs[2], qs[1]}, 3) == std::vector<size_t>(3, 2));
+    CHECK_THROWS_AS(lazy.sample(std::vector<logical_qubit_id>(65, qs[1]), 1), std::invalid_argument);
+    CHECK(lazy.storage().size() == 4);
+}
+
+TEST_CASE("Measured qubits leave the state", "[local_test]")
+{
+    // the reference keeps measured qubits in the state, both draw the same outcomes with the same seed
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    ref.compact_measured(false);
+    psi.seed(7);
+    ref.seed(7);
+    std::vector<logical_qubit_id> qs;
+    for (int i = 0; i < 6; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+    }
+
+    for (Wavefunction<ComplexType>* w : {&psi, &ref})
+    {
+        for (int i = 0; i < 6; i++)
+            w->apply(Gates::H(qs[i]));
+        w->apply_controlled(qs[0], Gates::Rx(0.4, qs[3]));
+        w->apply(Gates::Z(qs[2]));
+        w->apply(Gates::X(qs[4]));
+        w->apply_controlled(qs[2], Gates::T(qs[5]));
+    }
+
+    // measured qubits come back into the state with the next gate that needs them there
+    for (int round = 0; round < 3; round++)
+    {
+        for (int i : {2, 4, 0})
+        {
+            const bool m = psi.measure(qs[i]);
+            REQUIRE(ref.measure(qs[i]) == m);
+        }
+        for (Wavefunction<ComplexType>* w : {&psi, &ref})
+        {
+            w->apply(Gates::H(qs[2]));
+            w->apply_controlled(qs[2], Gates::Ry(0.3 + round, qs[1]));
+            w->apply_controlled(qs[0], Gates::X(qs[4]));
+            w->apply_controlled(qs[4], Gates::S(qs[5]));
+        }
+    }
+
+    CHECK(psi.num_qubits() == 6);
+    for (logical_qubit_id q : qs)
+        CHECK(std::abs(psi.probability(q) - ref.probability(q)) < 1e-12);
+    CHECK(std::abs(psi.jointprobability(qs) - ref.jointprobability(qs)) < 1e-12);
+    CHECK(
+        std::abs(
+            psi.jointprobability({Gates::PauliX, Gates::PauliY, Gates::PauliZ}, {qs[1], qs[3], qs[5]}) -
+            ref.jointprobability({Gates::PauliX, Gates::PauliY, Gates::PauliZ}, {qs[1], qs[3], qs[5]})) < 1e-12);
+}
+
+// Counts the allocations of the whole test program through the global operator new. The state vector and the fusion
+// arena use aligned allocators, which don't go through it, but they keep their capacity anyway.
+static std::atomic<size_t> allocations{0};
+
+void* operator new(std::size_t size)
+{
+    ++allocations;
+    if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    std::free(p);
+}
+
+TEST_CASE("Queuing gates doesn't allocate", "[local_test]")
+{
+    Wavefunction<ComplexType> psi;
+    std::vector<logical_qubit_id> qs;
+    for (int i = 0; i < 12; i++)
+        qs.push_back(psi.allocate_qubit());
+    const std::vector<Gates::Basis> bs = {Gates::PauliX, Gates::PauliZ, Gates::PauliY};
+    const std::vector<logical_qubit_id> ts = {qs[1], qs[5], qs[9]};
+    const std::vector<logical_qubit_id> none;
+
+    auto circuit = [&]() {
+        for (int layer = 0; layer < 8; layer++)
+        {
+            for (int i = 0; i < 12; i++)
+            {
+                psi.apply(Gates::H(qs[i]));
+                psi.apply(Gates::T(qs[(i + layer) % 12]));
+                psi.apply_controlled(QubitIds{qs[i]}, Gates::X(qs[(i + 1) % 12]));
+            }
+            psi.apply_controlled(QubitIds{qs[0], qs[layer + 1]}, Gates::Rz(0.1 * layer, qs[11]));
+            psi.apply_controlled_exp(bs, 0.2, none, ts);
+        }
+    };
+
+    // the first rounds grow the pending gates and the pools of the flush to their working size
+    for (int round = 0; round < 2; round++)
+    {
+        circuit();
+        psi.flush();
+    }
+
+    const size_t before = allocations;
+    circuit();
+    CHECK(allocations - before == 0);
+
+    // the flush itself allocates its list of clusters and the like, per cluster rather than per gate
+    const size_t gates = 8 * (3 * 12 + 2);
+    psi.flush();
+    const size_t in_flush = allocations - before;
+    INFO("allocations in flush: " << in_flush);
+    CHECK(in_flush < gates / 4);
+}
+
+TEST_CASE("Peephole pass over the pending gates", "[local_test]")
+{
+    // the reference flushes after every gate, so its peephole pass never sees two gates
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    std::vector<logical_qubit_id> qs;
+    for (int i = 0; i < 4; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+        psi.apply(Gates::H(qs[i]));
+        ref.apply(Gates::H(qs[i]));
+    }
+    psi.flush();
+    ref.flush();
+    const PeepholeCounters before = psi.peephole_counters();
+
+    auto apply = [&](auto const& gate) {
+        psi.apply(gate);
+        ref.apply(gate);
+        ref.flush();
+    };
+    auto apply_controlled = [&](QubitIds const& cs, auto const& gate) {
+        psi.apply_controlled(cs, gate);
+        ref.apply_controlled(cs, gate);
+        ref.flush();
+    };
+    auto apply_exp = [&](std::vector<Gates::Basis> const& bs, double phi, std::vector<logical_qubit_id> const& ts) {
+        psi.apply_controlled_exp(bs, phi, {}, ts);
+        ref.apply_controlled_exp(bs, phi, {}, ts);
+        ref.flush();
+    };
+
+    // inverse pairs cancel across gates on other qubits and gates that are diagonal on the shared qubits
+    apply(Gates::H(qs[0]));
+    apply_controlled({qs[3]}, Gates::Ry(0.1, qs[1]));
+    apply(Gates::H(qs[0]));
+    apply_controlled({qs[0], qs[1]}, Gates::S(qs[2]));
+    apply(Gates::Rx(0.2, qs[3]));
+    apply_controlled({qs[1], qs[0]}, Gates::AdjS(qs[2]));
+    apply(Gates::T(qs[1]));
+    apply_controlled({qs[1]}, Gates::Z(qs[2]));
+    apply(Gates::AdjT(qs[1]));
+
+    // gates on the same qubits merge, here rotations about the same axis past a diagonal gate on the target
+    apply(Gates::Rz(0.3, qs[2]));
+    apply(Gates::Rz(0.4, qs[2]));
+
+    // a basis change on the control blocks the pair
+    apply_controlled({qs[1]}, Gates::X(qs[0]));
+    apply(Gates::H(qs[1]));
+    apply_controlled({qs[1]}, Gates::X(qs[0]));
+
+    apply_exp({Gates::PauliX, Gates::PauliY}, 0.3, {qs[0], qs[2]});
+    apply_controlled({qs[1]}, Gates::T(qs[3]));
+    apply_exp({Gates::PauliX, Gates::PauliY}, -0.3, {qs[0], qs[2]});
+
+    psi.flush();
+    CHECK(psi.peephole_counters().cancelled - before.cancelled == 8);
+    CHECK(psi.peephole_counters().merged - before.merged == 1);
+
+    const WavefunctionStorage& actual = psi.data();
+    const WavefunctionStorage& expected = ref.data();
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+        CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+    }
+}
+
+TEST_CASE("SWAP relabels the qubits", "[local_test]")
+{
+    // the reference decomposes the swaps into CNOTs, the simulated swaps move the qubits to other positions instead
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    std::vector<logical_qubit_id> qs;
+    for (int i = 0; i < 5; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+    }
+
+    auto apply = [&](auto const& gate) {
+        psi.apply(gate);
+        ref.apply(gate);
+    };
+    auto apply_controlled = [&](QubitIds const& cs, auto const& gate) {
+        psi.apply_controlled(cs, gate);
+        ref.apply_controlled(cs, gate);
+    };
+    auto swap = [&](std::vector<logical_qubit_id> const& cs, logical_qubit_id a, logical_qubit_id b) {
+        if (cs.empty()) psi.swap(a, b);
+        else psi.apply_controlled_swap(cs, a, b);
+        QubitIds ccs(cs.begin(), cs.end());
+        ref.apply_controlled(b, Gates::X(a));
+        ccs.push_back(a);
+        ref.apply_controlled(ccs, Gates::X(b));
+        ref.apply_controlled(b, Gates::X(a));
+    };
+
+    // pending gates before and after the swaps, qubits with a frame, and qubits that are still classical bits
+    apply(Gates::H(qs[0]));
+    apply(Gates::Ry(0.3, qs[1]));
+    apply_controlled({qs[0]}, Gates::X(qs[2]));
+    apply(Gates::Y(qs[1]));
+    apply(Gates::X(qs[3]));
+    swap({}, qs[0], qs[1]);
+    apply(Gates::T(qs[0]));
+    apply_controlled({qs[0]}, Gates::Rx(0.7, qs[2]));
+    swap({}, qs[1], qs[3]);
+    apply(Gates::H(qs[3]));
+    swap({}, qs[4], qs[2]);
+    psi.swap(qs[4], qs[4]); // swapping a qubit with itself does nothing
+    apply_controlled({qs[4]}, Gates::S(qs[1]));
+
+    // controlled swaps on quantum controls, on classical ones that are set and on one that is not
+    swap({qs[0]}, qs[1], qs[4]);
+    apply(Gates::Z(qs[4]));
+    swap({qs[3], qs[2]}, qs[0], qs[4]);
+    swap({qs[1]}, qs[2], qs[3]);
+    const logical_qubit_id one = psi.allocate_qubit();
+    ref.allocate_qubit();
+    apply(Gates::X(one));
+    swap({one}, qs[0], qs[2]);
+    const logical_qubit_id zero = psi.allocate_qubit();
+    ref.allocate_qubit();
+    psi.apply_controlled_swap({zero}, qs[0], qs[1]);
+    CHECK(psi.is_classical_bit(one));
+    CHECK(psi.is_classical_bit(zero));
+
+    const WavefunctionStorage& actual = psi.data();
+    const WavefunctionStorage& expected = ref.data();
+    REQUIRE(actual.size() == expected.size());
+    std::vector<logical_qubit_id> all(qs);
+    all.push_back(one);
+    all.push_back(zero);
+    for (size_t i = 0; i < expected.size(); i++)
+    {
+        size_t j = 0;
+        for (logical_qubit_id q : all)
+            j |= ((i >> ref.get_qubit_position(q)) & 1) << psi.get_qubit_position(q);
+        INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+        CHECK(std::norm(expected[i] - actual[j]) < 1e-20);
+    }
+}
+
+TEST_CASE("Release reports dirty qubits", "[local_test]")
+{
+    SimulatorType sim;
+    auto qs = sim.allocate(4);
+    sim.H(qs[0]);
+    sim.CX(qs[0], qs[1]);
+    sim.X(qs[2]);
+
+    CHECK(sim.release(qs[3]));       // clean
+    CHECK_FALSE(sim.release(qs[2])); // classical |1>, released without a measurement
+    CHECK(sim.num_qubits() == 2);
+
+    // entangled: measured before it is released, which leaves its partner in a classical state
+    CHECK_FALSE(sim.release(qs[1]));
+    CHECK(sim.isclassical(qs[0]));
+    const bool m = sim.M(qs[0]);
+    CHECK(sim.release(qs[0]) == !m);
+    CHECK(sim.num_qubits() == 0);
+}
+
+TEST_CASE("Batched measurement", "[local_test]")
+{
+    // a GHZ state with some qubits flipped in the frame
+    Wavefunction<ComplexType> psi;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < 18; i++)
+        qs.push_back(psi.allocate_qubit());
+    // an unmeasured qubit keeps its superposition when they leave the state
+    const logical_qubit_id a = psi.allocate_qubit();
+    psi.apply(Gates::H(a));
+
+    psi.apply(Gates::H(qs[0]));
+    for (unsigned i = 1; i < qs.size(); i++)
+        psi.apply_controlled(qs[0], Gates::X(qs[i]));
+    psi.apply(Gates::X(qs[3]));
+    psi.apply(Gates::X(qs[17]));
+
+    std::vector<double> marginal =
+        kernels::marginal(psi.data(), {psi.get_qubit_position(qs[0]), psi.get_qubit_position(qs[5])});
+    CHECK(marginal[0] + marginal[3] == Approx(1.));
+
+    // with eight threads, the histograms of all 18 qubits would outgrow the state, so they are split into two groups
+#ifdef _OPENMP
+    const int threads = omp_get_max_threads();
+    omp_set_num_threads(8);
+#endif
+    std::vector<bool> results = psi.multimeasure(qs);
+#ifdef _OPENMP
+    omp_set_num_threads(threads);
+#endif
+    for (unsigned i = 1; i < qs.size(); i++)
+    {
+        INFO(std::string("qubit ") + std::to_string(i));
+        CHECK(results[i] == (results[0] != (i == 3 || i == 17)));
+        CHECK(psi.getvalue(qs[i]) == results[i]);
+    }
+    CHECK(psi.probability(qs[0]) == Approx(results[0] ? 1. : 0.));
+    CHECK(psi.storage().size() == 2);
+    CHECK(psi.probability(a) == Approx(0.5));
+    psi.apply(Gates::H(a));
+    CHECK(psi.probability(a) == Approx(0.));
+
+    // measured qubits come back into the state with the value they were measured with
+    psi.apply_controlled(qs[5], Gates::X(a));
+    CHECK(psi.probability(a) == Approx(results[5] ? 1. : 0.));
+}
+
+TEST_CASE("Pauli-basis measurement without basis change", "[local_test]")
+{
+    // `psi` measures the Pauli strings directly, `ref` rotates them into the computational basis and back
+    auto prepare = [](Wavefunction<ComplexType>& w, std::vector<logical_qubit_id>& qs) {
+        for (unsigned i = 0; i < 4; i++)
+            qs.push_back(w.allocate_qubit());
+        w.apply(Gates::H(qs[0]));
+        w.apply(Gates::Ry(0.7, qs[1]));
+        w.apply_controlled(qs[0], Gates::X(qs[2]));
+        w.apply(Gates::T(qs[2]));
+        w.apply(Gates::Rx(1.3, qs[3]));
+        w.apply_controlled(qs[1], Gates::Y(qs[3]));
+        w.apply(Gates::X(qs[1])); // lands in the Pauli frame
+        w.apply(Gates::Z(qs[3]));
+    };
+    auto rotate = [](Wavefunction<ComplexType>& w, std::vector<Gates::Basis> const& bs,
+                     std::vector<logical_qubit_id> const& qs, bool back) {
+        for (size_t i = 0; i < bs.size(); i++)
+        {
+            if (bs[i] == Gates::PauliX) w.apply(Gates::H(qs[i]));
+            if (bs[i] == Gates::PauliY && !back) w.apply(Gates::AdjHY(qs[i]));
+            if (bs[i] == Gates::PauliY && back) w.apply(Gates::HY(qs[i]));
+        }
+    };
+
+    const std::vector<std::vector<Gates::Basis>> strings = {
+        {Gates::PauliX, Gates::PauliY, Gates::PauliZ},
+        {Gates::PauliY, Gates::PauliY, Gates::PauliX},
+        {Gates::PauliZ, Gates::PauliZ, Gates::PauliZ},
+        {Gates::PauliX, Gates::PauliX, Gates::PauliX}};
+    for (auto const& bs : strings)
+    {
+        Wavefunction<ComplexType> psi;
+        Wavefunction<ComplexType> ref;
+        std::vector<logical_qubit_id> qs, qr;
+        prepare(psi, qs);
+        prepare(ref, qr);
+        const std::vector<logical_qubit_id> targets = {qs[3], qs[1], qs[2]};
+
+        rotate(ref, bs, targets, false);
+        const double expected = ref.jointprobability(targets);
+        CHECK(psi.jointprobability(bs, targets) == Approx(expected).margin(1e-12));
+
+        psi.seed(7);
+        ref.seed(7);
+        const bool result = psi.jointmeasure(bs, targets);
+        CHECK(ref.jointmeasure(targets) == result);
+        rotate(ref, bs, targets, true);
+
+        WavefunctionStorage const& actual = psi.data();
+        WavefunctionStorage const& reference = ref.data();
+        for (size_t i = 0; i < reference.size(); i++)
+        {
+            INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+            CHECK(std::norm(reference[i] - actual[i]) < 1e-20);
+        }
+    }
+}
+
+TEST_CASE("Controlled Exp kernel", "[local_test]")
+{
+    constexpr unsigned nq = 7;
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.7 * i));
+
+    // reference: exp(i phi P), the convention of Q#'s Exp, on the indices with all controls set, built from the action
+    // of P on each basis state
+    auto reference = [](WavefunctionStorage& wfn, std::vector<Gates::Basis> const& bs, double phi,
+                        std::vector<unsigned> const& cs, std::vector<unsigned> const& qs) {
+        const size_t cmask = kernels::make_mask(cs);
+        WavefunctionStorage out(wfn);
+        for (size_t x = 0; x < wfn.size(); x++)
+        {
+            if ((x & cmask) != cmask) continue;
+            ComplexType px = 1.;
+            size_t t = x;
+            for (size_t i = 0; i < bs.size(); i++)
+            {
+                const bool bit = (x >> qs[i]) & 1;
+                if (bs[i] == Gates::PauliX) t ^= 1ull << qs[i];
+                if (bs[i] == Gates::PauliY)
+                {
+                    t ^= 1ull << qs[i];
+                    px *= bit ? ComplexType(0., -1.) : ComplexType(0., 1.);
+                }
+                if (bs[i] == Gates::PauliZ && bit) px = -px;
+            }
+            // exp(i phi P) = cos(phi) + i sin(phi) P, where P|x> = px |t>
+            out[x] += (std::cos(phi) - 1.) * wfn[x];
+            out[t] += ComplexType(0., std::sin(phi)) * px * wfn[x];
+        }
+        wfn.swap(out);
+    };
+
+    const std::vector<std::vector<Gates::Basis>> strings = {
+        {Gates::PauliX, Gates::PauliY, Gates::PauliZ},
+        {Gates::PauliZ, Gates::PauliZ, Gates::PauliZ},
+        {Gates::PauliY, Gates::PauliY, Gates::PauliX}};
+    for (auto const& bs : strings)
+    {
+        for (std::vector<unsigned> const& cs : {std::vector<unsigned>{}, std::vector<unsigned>{0, 5}})
+        {
+            WavefunctionStorage expected(initial);
+            WavefunctionStorage actual(initial);
+            reference(expected, bs, 0.37, cs, {1, 6, 3});
+            kernels::apply_controlled_exp(actual, bs, 0.37, cs, {1, 6, 3});
+            for (size_t i = 0; i < expected.size(); i++)
+            {
+                INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+                CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+            }
+        }
+    }
+}
+
+TEST_CASE("Fused Exp", "[local_test]")
+{
+    constexpr unsigned nq = 6;
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.7 * i));
+
+    // The exponential is fused together with single-qubit gates on its support and on other qubits, the result must
+    // agree with applying the gates one by one and the exponential with its own kernel
+    const std::vector<std::vector<Gates::Basis>> strings = {
+        {Gates::PauliX, Gates::PauliY, Gates::PauliZ},
+        {Gates::PauliZ, Gates::PauliZ},
+        {Gates::PauliY, Gates::PauliX}};
+    const std::vector<unsigned> positions{4, 1, 2};
+    for (auto const& bs : strings)
+    {
+        const std::vector<unsigned> qs(positions.begin(), positions.begin() + bs.size());
+        for (std::vector<unsigned> const& cs : {std::vector<unsigned>{}, std::vector<unsigned>{0}})
+        {
+            Fused fused;
+            WavefunctionStorage expected(initial);
+            fused.apply(expected, Gates::H(1).matrix(), 1);
+            fused.flush(expected);
+            kernels::apply_controlled_exp(expected, bs, 0.37, cs, qs);
+            fused.apply(expected, Gates::T(4).matrix(), 4);
+            fused.flush(expected);
+
+            WavefunctionStorage actual(initial);
+            fused.apply(actual, Gates::H(1).matrix(), 1);
+            fused.apply_controlled_exp(bs, 0.37, cs, qs);
+            fused.apply(actual, Gates::T(4).matrix(), 4);
+            fused.flush(actual);
+
+            for (size_t i = 0; i < expected.size(); i++)
+            {
+                INFO(std::string("amplitude mismatch at ") + std::to_string(i));
+                CHECK(std::norm(expected[i] - actual[i]) < 1e-20);
+            }
+        }
+    }
+}
+
+TEST_CASE("Qubit swap kernel", "[local_test]")
+{
+    constexpr unsigned nq = 14;
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.7 * i));
+
+    // the amplitude of x moves to x with the bits at q1 and q2 exchanged, also for pairs far above the runs of 4096
+    for (auto const& p : std::vector<std::pair<unsigned, unsigned>>{{0, 13}, {3, 7}, {12, 13}, {13, 2}, {5, 5}})
+    {
+        WavefunctionStorage actual(initial);
+        kernels::swap(actual, p.first, p.second);
+        for (size_t x = 0; x < initial.size(); x++)
+        {
+            const size_t b1 = (x >> p.first) & 1, b2 = (x >> p.second) & 1;
+            const size_t y = (x & ~((1ull << p.first) | (1ull << p.second))) | (b1 << p.second) | (b2 << p.first);
+            INFO(std::string("amplitude mismatch at ") + std::to_string(x));
+            CHECK(actual[y] == initial[x]);
+        }
+    }
+}
+
+TEST_CASE("Relayout of frequently targeted high qubits", "[local_test]")
+{
+    constexpr unsigned nq = 17;
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    std::vector<logical_qubit_id> qs;
+    for (unsigned i = 0; i < nq; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+    }
+    psi.data(); // adds the qubits to the state in the order of their ids
+    ref.data();
+    REQUIRE(psi.get_qubit_position(qs[16]) == 16);
+
+    // Each {CX(q16, qi), H(q16)} ends up in a cluster of its own that targets q16. The reference wave function is
+    // flushed after every gate, so it never has more than one pending cluster and keeps its layout.
+    for (unsigned i = 0; i < 8; i++)
+    {
+        psi.apply(Gates::H(qs[16]));
+        psi.apply_controlled(qs[16], Gates::X(qs[i]));
+        ref.apply(Gates::H(qs[16]));
+        ref.flush();
+        ref.apply_controlled(qs[16], Gates::X(qs[i]));
+        ref.flush();
+    }
+    psi.flush();
+    CHECK(psi.get_qubit_position(qs[16]) < 15);
+    CHECK(ref.get_qubit_position(qs[16]) == 16);
+
+    const WavefunctionStorage& actual = psi.data();
+    const WavefunctionStorage& expected = ref.data();
+    size_t mismatches = 0;
+    for (size_t k = 0; k < expected.size(); k++)
+    {
+        size_t pa = 0;
+        size_t pe = 0;
+        for (unsigned q = 0; q < nq; q++)
+        {
+            if ((k >> q) & 1)
+            {
+                pa |= 1ull << psi.get_qubit_position(qs[q]);
+                pe |= 1ull << ref.get_qubit_position(qs[q]);
+            }
+        }
+        if (std::norm(actual[pa] - expected[pe]) > 1e-20) mismatches++;
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("Calibration of the fused kernels", "[local_test]")
+{
+    const Microsoft::Quantum::TuningProfile tuned = Fused::calibrate(12);
+    CHECK(!tuned.tag().empty());
+    REQUIRE(tuned.entries().size() == 2);
+    for (const auto& e : tuned.entries())
+    {
+        CHECK((e.qubits == 10 || e.qubits == 12));
+        CHECK((e.span >= 1 && e.span <= 7));
+#ifdef _OPENMP
+        CHECK(e.threads >= 1);
+#endif
+    }
+    CHECK(tuned.lookup(30)->qubits == 12);
+}
+
+TEST_CASE("Reserved state grows in place", "[local_test]")
+{
+    constexpr unsigned nq = 17;
+    Wavefunction<ComplexType> psi;
+    psi.reserve(nq + 1);
+    std::vector<logical_qubit_id> qs;
+    qs.push_back(psi.allocate_qubit());
+    const ComplexType* data = psi.data().data();
+    for (unsigned i = 1; i < nq; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        psi.apply(Gates::H(qs.back()));
+    }
+    CHECK(psi.data().data() == data);
+    CHECK(psi.data().capacity() >= (1ull << (nq + 1)));
+
+    // the released half holds stale amplitudes, the regrown one has to be zero
+    psi.release(qs[1]);
+    CHECK(psi.data().capacity() >= (1ull << (nq + 1)));
+    CHECK(psi.data().data() == data);
+    qs[1] = psi.allocate_qubit();
+    WavefunctionStorage const& wfn = psi.data();
+    REQUIRE(wfn.size() == (1ull << nq));
+    CHECK(wfn.data() == data);
+    size_t nonzero = 0;
+    for (size_t i = wfn.size() / 2; i < wfn.size(); ++i)
+        if (wfn[i] != ComplexType(0.)) ++nonzero;
+    CHECK(nonzero == 0);
+    CHECK(std::abs(std::norm(wfn[0]) - 1. / (1ull << (nq - 2))) < 1e-6);
+}
+
+TEST_CASE("Measuring out compacts the state in place", "[local_test]")
+{
+    constexpr unsigned nq = 10;
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(std::cos(0.3 * i), std::sin(0.7 * i));
+
+    for (unsigned q : {0u, 1u, 4u, 8u, 9u})
+    {
+        for (bool val : {false, true})
+        {
+            WavefunctionStorage actual(initial);
+            const ComplexType* data = actual.data();
+            kernels::collapse_out(actual, q, val, 0.25);
+            REQUIRE(actual.size() == initial.size() / 2);
+            CHECK(actual.data() == data);
+            for (size_t l = 0; l < actual.size(); l++)
+            {
+                const size_t i = ((l >> q) << (q + 1)) | (l & ((1ull << q) - 1)) | (size_t(val) << q);
+                INFO(std::string("amplitude mismatch at ") + std::to_string(l));
+                CHECK(std::norm(actual[l] - 2. * initial[i]) < 1e-20);
+            }
+        }
+    }
+}
+
+TEST_CASE("Paged state releases qubits by moving pages", "[local_test]")
+{
+    // `psi` is paged in chunks of 2^8 amplitudes (a 4 KiB page), `ref` copies on release
+    constexpr unsigned nq = 17;
+    Wavefunction<ComplexType> psi;
+    Wavefunction<ComplexType> ref;
+    psi.reserve(nq + 1, 8);
+    std::vector<logical_qubit_id> qs;
+    const std::vector<logical_qubit_id> none;
+    for (unsigned i = 0; i < nq; i++)
+    {
+        qs.push_back(psi.allocate_qubit());
+        ref.allocate_qubit();
+        if (i == 12)
+        {
+            psi.apply_controlled(none, Gates::X(qs[i]));
+            ref.apply_controlled(none, Gates::X(qs[i]));
+        }
+        else if (i != 14)
+        {
+            psi.apply(Gates::H(qs[i]));
+            ref.apply(Gates::H(qs[i]));
+            psi.apply(Gates::T(qs[i]));
+            ref.apply(Gates::T(qs[i]));
+        }
+    }
+
+    auto check = [&]() {
+        WavefunctionStorage const& actual = psi.data();
+        WavefunctionStorage const& expected = ref.data();
+        REQUIRE(actual.size() == expected.size());
+        size_t mismatches = 0;
+        for (size_t i = 0; i < actual.size(); ++i)
+            if (std::norm(actual[i] - expected[i]) > 1e-12) ++mismatches;
+        CHECK(mismatches == 0);
+    };
+
+    // keeps the upper (|1>) and the lower (|0>) blocks
+    CHECK(!psi.release(qs[12]));
+    CHECK(!ref.release(qs[12]));
+    check();
+    CHECK(psi.release(qs[14]));
+    CHECK(ref.release(qs[14]));
+    check();
+
+    // the highest qubit, in |1> the upper half moves as a single block
+    for (bool one : {false, true})
+    {
+        logical_qubit_id q = psi.allocate_qubit();
+        ref.allocate_qubit();
+        if (one)
+        {
+            psi.apply_controlled(none, Gates::X(q));
+            ref.apply_controlled(none, Gates::X(q));
+        }
+        CHECK(psi.release(q) == !one);
+        CHECK(ref.release(q) == !one);
+        check();
+    }
+    CHECK(psi.data().capacity() >= (1ull << (nq + 1)));
+
+    // the regrown state starts from zero pages
+    qs[12] = psi.allocate_qubit();
+    ref.allocate_qubit();
+    check();
+    psi.reset();
+    CHECK(psi.data().size() == 1);
+}
+
+TEST_CASE("Paged release copies the blocks past the remap limit", "[local_test]")
+{
+    // 2^15 blocks of 2^8 amplitudes (a 4 KiB page) each, of which only 4 are moved by remapping their pages
+    for (bool value : {false, true})
+    {
+        WavefunctionStorage wfn(1ull << 16);
+        const size_t bit = 1ull << 8;
+        double norm = 0.;
+        for (size_t i = 0; i < wfn.size(); ++i)
+        {
+            if (((i & bit) != 0) != value) continue;
+            wfn[i] = ComplexType(RealType(i % 97), RealType(i % 89));
+            norm += std::norm(wfn[i]);
+        }
+        for (ComplexType& a : wfn)
+            a /= RealType(std::sqrt(norm));
+        WavefunctionStorage expected(wfn.begin(), wfn.end());
+
+        REQUIRE(kernels::release(expected, 8, value));
+        REQUIRE(kernels::release_pages(wfn, 8, value, RealType(1e-6), 4));
+        REQUIRE(wfn.size() == expected.size());
+        size_t mismatches = 0;
+        for (size_t i = 0; i < wfn.size(); ++i)
+            if (wfn[i] != expected[i]) ++mismatches;
+        CHECK(mismatches == 0);
+    }
+}
+
 TEST_CASE("isclassical", "[local_test]")
 {
     SimulatorType sim;
@@ -519,6 +1724,37 @@ TEST_CASE("permute_basis depends on the order of logical qubits (3)", "[local_te
     }
 }
 
+TEST_CASE("In-place permute_basis kernel", "[local_test]")
+{
+    constexpr unsigned nq = 8;
+
+    WavefunctionStorage initial(1ull << nq);
+    for (size_t i = 0; i < initial.size(); i++)
+        initial[i] = ComplexType(i, -0.5 * i);
+
+    std::mt19937 gen(42);
+    for (std::vector<unsigned> const& positions :
+         {std::vector<unsigned>{5, 1, 6}, std::vector<unsigned>{7, 0, 3, 2, 6, 1, 5, 4}})
+    {
+        std::vector<size_t> table(1ull << positions.size());
+        std::iota(table.begin(), table.end(), 0);
+        std::shuffle(table.begin(), table.end(), gen);
+
+        // reference: move each amplitude to its permuted index
+        const size_t qmask = kernels::make_mask(positions);
+        WavefunctionStorage expected(initial.size());
+        for (size_t i = 0; i < initial.size(); i++)
+            expected[detail::set_register(positions, qmask, table[detail::get_register(positions, i)], i)] = initial[i];
+
+        WavefunctionStorage actual(initial);
+        kernels::permute_basis(actual, positions, table.size(), table.data(), false);
+        CHECK(expected == actual);
+
+        kernels::permute_basis(actual, positions, table.size(), table.data(), true);
+        CHECK(initial == actual);
+    }
+}
+
 void CheckAllZeros(SimulatorType& sim, const std::vector<logical_qubit_id>& qs)
 {
     for (size_t i = 0; i < qs.size(); i++)
@@ -661,6 +1897,37 @@ TEST_CASE("Inject state on two qubits out of three", "[local_test]")
     CHECK((sim.isclassical(y) && !sim.M(y)));
 }
 
+TEST_CASE("Simulator interface in both precisions", "[local_test]")
+{
+    // the interface takes and returns either precision and converts to and from the one of the simulator
+    SimulatorType concrete;
+    Microsoft::Quantum::Simulator::SimulatorInterface& sim = concrete;
+    const logical_qubit_id a = sim.allocate();
+    const logical_qubit_id b = sim.allocate();
+    const logical_qubit_id c = sim.allocate();
+
+    const float amp = 1.0f / std::sqrt(2.0f);
+    REQUIRE(sim.InjectState({a, b}, std::vector<std::complex<float>>{{amp, 0.f}, {0.f, 0.f}, {0.f, 0.f}, {0.f, amp}}));
+    sim.H(c);
+
+    std::vector<std::complex<float>> single;
+    std::vector<std::complex<double>> wide;
+    CHECK_FALSE(sim.subsytemwavefunction({a}, single, 1e-6));
+    REQUIRE(sim.subsytemwavefunction({a, b}, single, 1e-6));
+    REQUIRE(sim.subsytemwavefunction({c}, wide, 1e-6));
+    REQUIRE(single.size() == 4);
+    REQUIRE(wide.size() == 2);
+    CHECK(std::norm(single[0]) + std::norm(single[3]) == Approx(1.));
+    CHECK(std::abs(single[1]) + std::abs(single[2]) == Approx(0.).margin(1e-6));
+    CHECK(std::abs(wide[0] - wide[1]) == Approx(0.).margin(1e-6));
+
+    const std::complex<double>* data = sim.data();
+    double norm = 0.;
+    for (size_t i = 0; i < 8; ++i)
+        norm += std::norm(data[i]);
+    CHECK(norm == Approx(1.));
+}
+
 TEST_CASE("Perf of injecting equal superposition state", "[skip]") // local micro_benchmark
 {
     using namespace std::chrono;
@@ -6,6 +6,7 @@
 #include "config.hpp"
 #include "gates.hpp"
 #include "simulatorinterface.hpp"
+#include "util/numa.hpp"
 #include "util/openmp.hpp"
 #include "wavefunction.hpp"
 
@@ -25,9 +26,12 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
   public:
     using WaveFunctionType = WFN;
 
-    Simulator(unsigned maxlocal = 0u)
+    /// `maxlocal` is the number of qubits to reserve the state vector for, 0 for no reservation. With `pageQubits` > 0
+    /// the reserved state is paged in chunks of 2^pageQubits amplitudes (see Wavefunction::reserve).
+    Simulator(unsigned maxlocal = 0u, unsigned pageQubits = 0u)
         : psi()
     {
+        psi.reserve(maxlocal, pageQubits);
     }
 
     std::size_t random(std::vector<double> const& d)
@@ -53,16 +57,28 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         }
 
         recursive_lock_type l(getmutex());
-        changebasis(bs, qs, true);
-        double p = psi.jointprobability(qs);
-        changebasis(bs, qs, false);
-        return p;
+        return psi.jointprobability(bs, qs);
     }
 
-    bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<ComplexType>& amplitudes)
+    double PauliSumExpectation(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> const& coeffs,
+        std::vector<logical_qubit_id> const& qs)
     {
         recursive_lock_type l(getmutex());
-        return psi.inject_state(qubits, amplitudes);
+        return psi.pauli_sum_expectation(bs, coeffs, qs);
+    }
+
+    bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<std::complex<double>>& amplitudes)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.inject_state(qubits, converted(amplitudes));
+    }
+
+    bool InjectState(const std::vector<logical_qubit_id>& qubits, const std::vector<std::complex<float>>& amplitudes)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.inject_state(qubits, converted(amplitudes));
     }
 
     bool isclassical(logical_qubit_id q)
@@ -107,14 +123,7 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
     bool release(logical_qubit_id q)
     {
         recursive_lock_type l(getmutex());
-        flush();
-        bool allok = isclassical(q);
-        if (allok)
-            allok = (psi.getvalue(q) == false);
-        else
-            M(q);
-        psi.release(q);
-        return allok;
+        return psi.release(q);
     }
 
     bool release(std::vector<logical_qubit_id> const& qs)
@@ -193,6 +202,19 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 #undef GATE1CIMPL
 #undef GATE1MCIMPL
 
+    // two-qubit gates
+    void SWAP(logical_qubit_id q1, logical_qubit_id q2)
+    {
+        recursive_lock_type l(getmutex());
+        psi.swap(q1, q2);
+    }
+
+    void CSWAP(std::vector<logical_qubit_id> const& c, logical_qubit_id q1, logical_qubit_id q2)
+    {
+        recursive_lock_type l(getmutex());
+        psi.apply_controlled_swap(c, q1, q2);
+    }
+
     // rotations
     void R(Gates::Basis b, double phi, logical_qubit_id q)
     {
@@ -244,23 +266,21 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
 
     std::vector<bool> MultiM(std::vector<logical_qubit_id> const& qs)
     {
-        // ***TODO*** optimized implementation
         recursive_lock_type l(getmutex());
-        std::vector<bool> res;
-        for (auto q : qs)
-            res.push_back(psi.measure(q));
-        return res;
+        return psi.multimeasure(qs);
+    }
+
+    std::vector<std::size_t> Sample(std::vector<logical_qubit_id> const& qs, std::size_t shots)
+    {
+        recursive_lock_type l(getmutex());
+        return psi.sample(qs, shots);
     }
 
     bool Measure(std::vector<Gates::Basis> bs, std::vector<logical_qubit_id> qs)
     {
         recursive_lock_type l(getmutex());
         removeIdentities(bs, qs);
-        // ***TODO*** optimized kernels
-        changebasis(bs, qs, true);
-        bool res = psi.jointmeasure(qs);
-        changebasis(bs, qs, false);
-        return res;
+        return psi.jointmeasure(bs, qs);
     }
 
     void seed(unsigned s)
@@ -284,10 +304,11 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         recursive_lock_type l(getmutex());
         psi.flush();
     }
-    ComplexType const* data() const
+    std::complex<double> const* data() const
     {
         recursive_lock_type l(getmutex());
-        return psi.data().data();
+        WavefunctionStorage const& wfn = psi.data();
+        return widened(wfn.data(), wfn.size());
     }
 
     void dump(bool (*callback)(const char*, double, double))
@@ -295,25 +316,30 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         recursive_lock_type l(getmutex());
         flush();
 
-        auto wfn = psi.data();
+        WavefunctionStorage const& wfn = psi.data();
+        const std::vector<positional_qubit_id> ps = psi.get_qubit_positions(psi.get_qubit_ids());
         auto nq = num_qubits();
         std::string label_str(nq, '0');
         for (std::size_t i = 0; i < wfn.size(); i++)
         {
             for (std::size_t j = 0; j < nq; ++j)
                 label_str[j] = ((i >> j)&1) ? '1' : '0';
-            if (!callback(label_str.c_str(), wfn[i].real(), wfn[i].imag())) return;
+            const ComplexType amp = wfn[stored_index(i, ps)];
+            if (!callback(label_str.c_str(), amp.real(), amp.imag())) return;
         }
     }
 
     void dump(TDumpToLocationCallback callback, TDumpLocation location) override
     {
+        recursive_lock_type l(getmutex());
         flush();
 
-        auto wfn = psi.data();
+        WavefunctionStorage const& wfn = psi.data();
+        const std::vector<positional_qubit_id> ps = psi.get_qubit_positions(psi.get_qubit_ids());
         for (std::size_t i = 0; i < wfn.size(); i++)
         {
-            if (!callback(i, wfn[i].real(), wfn[i].imag(), location)) return;
+            const ComplexType amp = wfn[stored_index(i, ps)];
+            if (!callback(i, amp.real(), amp.imag(), location)) return;
         }
     }
 
@@ -329,6 +355,13 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         }
     }
 
+    std::vector<std::size_t> statePlacement() override
+    {
+        recursive_lock_type l(getmutex());
+        WavefunctionStorage const& wfn = psi.storage();
+        return pages_per_node(wfn.data(), wfn.size() * sizeof(ComplexType));
+    }
+
     bool dumpQubits(std::vector<logical_qubit_id> const& qs, TDumpToLocationCallback callback, TDumpLocation location) override
     {
         assert(qs.size() <= num_qubits());
@@ -399,25 +432,55 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         return psi.subsytemwavefunction(qs, qubitswfn, tolerance);
     }
 
+    bool subsytemwavefunction(
+        std::vector<logical_qubit_id> const& qs,
+        std::vector<std::complex<double>>& qubitswfn,
+        double tolerance)
+    {
+        return subsytemwavefunction_converted(qs, qubitswfn, tolerance);
+    }
+
+    bool subsytemwavefunction(
+        std::vector<logical_qubit_id> const& qs,
+        std::vector<std::complex<float>>& qubitswfn,
+        double tolerance)
+    {
+        return subsytemwavefunction_converted(qs, qubitswfn, tolerance);
+    }
+
   private:
-    void changebasis(Gates::Basis b, logical_qubit_id q, bool back)
+    static std::vector<ComplexType> const& converted(std::vector<ComplexType> const& amplitudes)
     {
-        if (b == Gates::PauliX)
-            H(q);
-        else if (b == Gates::PauliY)
-        {
-            if (back)
-                AdjHY(q);
-            else
-                HY(q);
-        }
+        return amplitudes;
     }
 
-    void changebasis(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs, bool back)
+    template <class T>
+    static std::vector<ComplexType> converted(std::vector<std::complex<T>> const& amplitudes)
     {
-        assert(bs.size() == qs.size());
-        for (std::size_t i = 0; i < bs.size(); ++i)
-            changebasis(bs[i], qs[i], back);
+        return std::vector<ComplexType>(amplitudes.begin(), amplitudes.end());
+    }
+
+    std::complex<double> const* widened(std::complex<double> const* wfn, std::size_t) const
+    {
+        return wfn;
+    }
+
+    std::complex<double> const* widened(std::complex<float> const* wfn, std::size_t size) const
+    {
+        widened_.assign(wfn, wfn + size);
+        return widened_.data();
+    }
+
+    template <class T>
+    bool subsytemwavefunction_converted(
+        std::vector<logical_qubit_id> const& qs,
+        std::vector<std::complex<T>>& qubitswfn,
+        double tolerance)
+    {
+        WavefunctionStorage wfn(std::size_t(1) << qs.size());
+        const bool separable = subsytemwavefunction(qs, wfn, tolerance);
+        qubitswfn.assign(wfn.begin(), wfn.end());
+        return separable;
     }
 
     inline static void removeIdentities(std::vector<Gates::Basis>& b, std::vector<logical_qubit_id>& qs)
@@ -435,13 +498,27 @@ class Simulator : public Microsoft::Quantum::Simulator::SimulatorInterface
         }
     }
 
+    /// Index into the stored wave function of basis state `i` of a dump, whose bit j is the j-th qubit in id order.
+    /// Qubits enter the state in the order they are first used, or trade positions in a swap, so the stored order
+    /// is the one of `ps`, the positions of the qubits in id order.
+    inline static std::size_t stored_index(std::size_t i, std::vector<positional_qubit_id> const& ps)
+    {
+        std::size_t index = 0;
+        for (std::size_t j = 0; j < ps.size(); ++j)
+            index |= ((i >> j) & 1) << ps[j];
+        return index;
+    }
+
     WaveFunctionType psi;
+
+    /// State vector of a single precision simulator widened to double precision for `data`.
+    mutable std::vector<std::complex<double>> widened_;
 };
 
 using WavefunctionType = Wavefunction<ComplexType>;
 using SimulatorType = Simulator<WavefunctionType>;
 
-MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned = 0u);
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* createSimulator(unsigned = 0u, unsigned = 0u);
 
 } // namespace SIMULATOR
 } // namespace Quantum
@@ -7,7 +7,7 @@
 
 namespace sim = Microsoft::Quantum::SimulatorAVX;
 
-MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal)
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal, unsigned pageQubits)
 {
-    return new sim::SimulatorType(maxlocal);
+    return new sim::SimulatorType(maxlocal, pageQubits);
 }
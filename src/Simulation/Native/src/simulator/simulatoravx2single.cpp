@@ -0,0 +1,15 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#define HAVE_INTRINSICS
+#define HAVE_FMA
+#define USE_SINGLE_PRECISION
+
+#include "simulator/simulator.hpp"
+
+namespace sim = Microsoft::Quantum::SimulatorAVX2Single;
+
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal, unsigned pageQubits)
+{
+    return new sim::SimulatorType(maxlocal, pageQubits);
+}
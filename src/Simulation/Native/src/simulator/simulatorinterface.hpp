@@ -30,10 +30,18 @@ class SimulatorInterface
     virtual std::size_t random(std::size_t n, double* d) = 0;
 
     virtual double JointEnsembleProbability(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
+    virtual double PauliSumExpectation(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> const& coeffs,
+        std::vector<unsigned> const& qs) = 0;
 
+    // The amplitudes are converted to the precision of the simulator if they don't match it.
     virtual bool InjectState(
         const std::vector<logical_qubit_id>& qubits,
-        const std::vector<ComplexType>& amplitudes) = 0;
+        const std::vector<std::complex<double>>& amplitudes) = 0;
+    virtual bool InjectState(
+        const std::vector<logical_qubit_id>& qubits,
+        const std::vector<std::complex<float>>& amplitudes) = 0;
 
     // allocate and release
     virtual unsigned allocate() = 0;
@@ -61,6 +69,10 @@ class SimulatorInterface
 #undef GATE1CIMPL
 #undef GATE1MCIMPL
 
+    // two-qubit gates
+    virtual void SWAP(unsigned q1, unsigned q2) = 0;
+    virtual void CSWAP(std::vector<unsigned> const& c, unsigned q1, unsigned q2) = 0;
+
     // rotations
     virtual void R(Gates::Basis b, double phi, unsigned q) = 0;
     virtual void CR(Gates::Basis b, double phi, std::vector<unsigned> const& c, unsigned q) = 0;
@@ -80,13 +92,31 @@ class SimulatorInterface
     // measurements
 
     virtual bool M(unsigned q) = 0;
+    virtual std::vector<bool> MultiM(std::vector<unsigned> const& qs) = 0;
+    virtual std::vector<std::size_t> Sample(std::vector<unsigned> const& qs, std::size_t shots) = 0;
     virtual bool Measure(std::vector<Gates::Basis> bs, std::vector<unsigned> qs) = 0;
 
     virtual void seed(unsigned s) = 0;
     virtual void reset() = 0;
-    virtual ComplexType const* data() const = 0;
 
-    virtual bool subsytemwavefunction(std::vector<unsigned> const& qs, WavefunctionStorage& qubitswfn, double tolerance)
+    // The state vector in the order of the positional qubit ids. Single precision simulators return a copy widened to
+    // double precision, which stays valid until the next call.
+    virtual std::complex<double> const* data() const = 0;
+
+    // The state of the qubits `qs` if they are separable from the rest up to `tolerance`, in the precision of the
+    // vector it's written to.
+    virtual bool subsytemwavefunction(
+        std::vector<unsigned> const& qs,
+        std::vector<std::complex<double>>& qubitswfn,
+        double tolerance)
+    {
+        assert(false);
+        return false;
+    };
+    virtual bool subsytemwavefunction(
+        std::vector<unsigned> const& qs,
+        std::vector<std::complex<float>>& qubitswfn,
+        double tolerance)
     {
         assert(false);
         return false;
@@ -115,6 +145,12 @@ class SimulatorInterface
         assert(false);
     }
 
+    /// number of sampled pages of the state vector on each NUMA node, empty if the platform doesn't report placement
+    virtual std::vector<std::size_t> statePlacement()
+    {
+        return {};
+    }
+
     // apply permutation of basis states to the wave function
     virtual void permuteBasis(
         std::vector<unsigned> const& qs,
@@ -0,0 +1,13 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#define USE_SINGLE_PRECISION
+
+#include "simulator/simulator.hpp"
+
+namespace sim = Microsoft::Quantum::SIMULATOR;
+
+MICROSOFT_QUANTUM_DECL Microsoft::Quantum::Simulator::SimulatorInterface* sim::createSimulator(unsigned maxlocal, unsigned pageQubits)
+{
+    return new sim::SimulatorType(maxlocal, pageQubits);
+}
@@ -12,6 +12,7 @@ namespace Quantum
 namespace SIMULATOR
 {
 
+// The single precision simulators are built from translation units that define USE_SINGLE_PRECISION (see config.hpp).
 #ifndef USE_SINGLE_PRECISION
 using RealType = double;
 #else
@@ -20,7 +21,7 @@ using RealType = float;
 
 using ComplexType = std::complex<RealType>;
 
-using WavefunctionStorage = std::vector<ComplexType, AlignedAlloc<ComplexType, 64>>;
+using WavefunctionStorage = std::vector<ComplexType, StateAlloc<ComplexType, 64>>;
 
 // The positional id is an implementation details of the wave function store and shouldn't be used outside of it.
 // The `using` declarations document the intent of the code but provide no compile-time safety. Consider replacing those
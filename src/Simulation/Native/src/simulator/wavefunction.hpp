@@ -9,8 +9,10 @@
 #include <iostream>
 #include <iterator>
 #include <limits>
-#include <list>
+#include <numeric>
 #include <random>
+#include <set>
+#include <stdexcept>
 #include <string.h>
 #include <vector>
 #include <chrono>
@@ -19,6 +21,7 @@
 #include "types.hpp"
 
 #include "external/fused.hpp"
+#include "util/smallvector.hpp"
 
 namespace Microsoft
 {
@@ -64,28 +67,62 @@ inline size_t set_register(
 }
 } // namespace detail
 
+/// Short list of logical qubit ids, held inline for the gate widths seen in practice.
+using QubitIds = Microsoft::Quantum::SmallVector<logical_qubit_id, 8>;
+
 ///
 /// When a gate is invoked, we might not apply it immediately but save all its pertinent information into an immutable
 /// cache so we can apply the gate later, possibly fused with other gates to improve performance.
 ///
 class DeferredGate
 {
-    std::vector<logical_qubit_id> controls_;
+    QubitIds controls_;
     logical_qubit_id target_;
     TinyMatrix<ComplexType, 2> mat_;
 
+    /// A multi-qubit Pauli exponential exp(i*phi*P) stores its Pauli string and angle instead of a matrix, `targets_`
+    /// lists the qubits of the string. For single-qubit gates `paulis_` is empty and `targets_` is just the target.
+    Fused::Paulis paulis_;
+    double phi_ = 0.;
+    QubitIds targets_;
+
   public:
-    DeferredGate(
-        const std::vector<logical_qubit_id>& controls,
-        logical_qubit_id target,
-        const TinyMatrix<ComplexType, 2>& mat)
+    DeferredGate(const QubitIds& controls, logical_qubit_id target, const TinyMatrix<ComplexType, 2>& mat)
         : controls_(controls)
         , target_(target)
         , mat_(mat)
+        , targets_{target}
     {
     }
 
-    const std::vector<logical_qubit_id>& get_controls() const
+    DeferredGate(const QubitIds& controls, const Fused::Paulis& paulis, double phi, const QubitIds& targets)
+        : controls_(controls)
+        , target_(targets.front())
+        , paulis_(paulis)
+        , phi_(phi)
+        , targets_(targets)
+    {
+        assert(!paulis.empty() && paulis.size() == targets.size());
+    }
+
+    bool is_exp() const
+    {
+        return !paulis_.empty();
+    }
+    const Fused::Paulis& get_paulis() const
+    {
+        return paulis_;
+    }
+    double get_phi() const
+    {
+        return phi_;
+    }
+    const QubitIds& get_targets() const
+    {
+        return targets_;
+    }
+
+    const QubitIds& get_controls() const
     {
         return controls_;
     }
@@ -97,33 +134,97 @@ class DeferredGate
     {
         return mat_;
     }
+
+    /// Qubits the gate acts on, folded into 64 bits: gates with disjoint masks act on disjoint qubits.
+    uint64_t qubit_mask() const
+    {
+        uint64_t mask = 0;
+        for (logical_qubit_id q : targets_)
+            mask |= 1ull << (q & 63);
+        for (logical_qubit_id q : controls_)
+            mask |= 1ull << (q & 63);
+        return mask;
+    }
+
+    /// True if the gate acts on qubit q as a control or as a target.
+    bool acts_on(logical_qubit_id q) const
+    {
+        return std::find(targets_.begin(), targets_.end(), q) != targets_.end() ||
+               std::find(controls_.begin(), controls_.end(), q) != controls_.end();
+    }
+
+    /// True if the gate is block diagonal in the computational basis of qubit q, which it acts on: q is a control, the
+    /// target of a diagonal matrix, or a target of the Pauli string with Z or I on it.
+    bool is_diagonal_on(logical_qubit_id q) const
+    {
+        if (!is_exp())
+            return q != target_ || (mat_(0, 1) == ComplexType(0.) && mat_(1, 0) == ComplexType(0.));
+        for (size_t i = 0; i < targets_.size(); ++i)
+        {
+            if (targets_[i] == q) return paulis_[i] == Gates::PauliZ || paulis_[i] == Gates::PauliI;
+        }
+        return true;
+    }
+
+    /// True if the gates commute because each qubit they share is diagonal in both (a sufficient condition only).
+    bool commutes_with(const DeferredGate& other) const
+    {
+        for (logical_qubit_id q : controls_)
+        {
+            if (other.acts_on(q) && !other.is_diagonal_on(q)) return false;
+        }
+        for (logical_qubit_id q : targets_)
+        {
+            if (other.acts_on(q) && !(is_diagonal_on(q) && other.is_diagonal_on(q))) return false;
+        }
+        return true;
+    }
+
+    /// Exchanges the logical ids a and b wherever the gate refers to them.
+    void swap_qubits(logical_qubit_id a, logical_qubit_id b)
+    {
+        auto relabel = [a, b](logical_qubit_id& q) {
+            if (q == a) q = b;
+            else if (q == b) q = a;
+        };
+        relabel(target_);
+        for (logical_qubit_id& q : targets_)
+            relabel(q);
+        for (logical_qubit_id& q : controls_)
+            relabel(q);
+    }
+
+    /// True if both gates have the same controls, in any order, and the same targets.
+    bool same_qubits(const DeferredGate& other) const
+    {
+        if (controls_.size() != other.controls_.size() || targets_.size() != other.targets_.size()) return false;
+        if (!std::equal(targets_.begin(), targets_.end(), other.targets_.begin())) return false;
+        for (logical_qubit_id c : controls_)
+        {
+            if (std::find(other.controls_.begin(), other.controls_.end(), c) == other.controls_.end()) return false;
+        }
+        return true;
+    }
 };
 
 ///
-/// A few utility functions for Cluster class
+/// Gates the peephole pass of `Wavefunction::flush` took out of the pending gates: `merged` counts gates folded into an
+/// earlier gate on the same qubits, `cancelled` counts gates dropped because the merged product was the identity (both
+/// gates of a pair are counted).
 ///
-static bool is_sorted_assending(const std::vector<logical_qubit_id>& x)
+struct PeepholeCounters
 {
-    return std::adjacent_find(x.begin(), x.end(), std::greater<logical_qubit_id>()) == x.end();
-}
-
-static bool is_intersection_empty(const std::vector<logical_qubit_id>& x, const std::vector<logical_qubit_id>& y)
-{
-    assert(is_sorted_assending(x));
-    assert(is_sorted_assending(y));
-
-    std::vector<logical_qubit_id> intersection;
-    std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(intersection));
-    return intersection.empty();
-}
+    size_t merged = 0;
+    size_t cancelled = 0;
+};
 
-static bool is_intersection_empty(const std::vector<logical_qubit_id>& x, const std::set<logical_qubit_id>& y)
+///
+/// A utility function for Cluster class
+///
+template <class C>
+static bool is_sorted_assending(const C& x)
 {
-    assert(is_sorted_assending(x));
-
-    std::vector<logical_qubit_id> intersection;
-    std::set_intersection(x.begin(), x.end(), y.begin(), y.end(), std::back_inserter(intersection));
-    return intersection.empty();
+    return std::adjacent_find(x.begin(), x.end(), std::greater<logical_qubit_id>()) == x.end();
 }
 
 ///
@@ -133,24 +234,22 @@ class Cluster
 {
     /// Union of logical qubit ids for controls and targets of all gates in this cluster. For performance reasons must
     /// be sorted in assending order.
-    std::vector<logical_qubit_id> qids_;
+    QubitIds qids_;
 
-    /// Gates in this cluster. When flushing the cluster, the gates will be applied in order from left to rigth.
-    std::vector<DeferredGate> gates_;
+    /// Gates in this cluster, pointing into the list of gates the clusters were made from. When flushing the cluster,
+    /// the gates will be applied in order from left to rigth.
+    Microsoft::Quantum::SmallVector<const DeferredGate*, 8> gates_;
 
   public:
     Cluster() = default;
-    Cluster(const std::vector<logical_qubit_id>& qids, const std::vector<DeferredGate>& gates)
+    Cluster(const QubitIds& qids, const DeferredGate* gate)
         : qids_(qids)
-        , gates_(gates)
+        , gates_{gate}
     {
         assert(is_sorted_assending(qids));
     }
-    Cluster(Cluster&& other)
-        : qids_(std::move(other.qids_))
-        , gates_(std::move(other.gates_))
-    {
-    }
+    Cluster(Cluster&& other) = default;
+    Cluster& operator=(Cluster&& other) = default;
 
     // prevent gratuitous copying of clusters (which might be quite large)
     Cluster(const Cluster&) = delete;
@@ -158,28 +257,28 @@ class Cluster
 
     void swap(Cluster& other)
     {
-        qids_.swap(other.qids_);
-        gates_.swap(other.gates_);
+        std::swap(qids_, other.qids_);
+        std::swap(gates_, other.gates_);
     }
 
-    const std::vector<logical_qubit_id>& get_qids() const
+    const QubitIds& get_qids() const
     {
         return qids_;
     }
-    const std::vector<DeferredGate>& get_gates() const
+    const Microsoft::Quantum::SmallVector<const DeferredGate*, 8>& get_gates() const
     {
         return gates_;
     }
 
-    Cluster& append(const Cluster& other)
+    /// Appends `gate` to the cluster, `qids` are the sorted qubits of the gate.
+    void add(const DeferredGate* gate, const QubitIds& qids)
     {
-        gates_.insert(gates_.end(), other.gates_.begin(), other.gates_.end());
-
-        std::vector<logical_qubit_id> merged;
-        std::set_union(other.qids_.begin(), other.qids_.end(), qids_.begin(), qids_.end(), std::back_inserter(merged));
-        qids_.swap(merged);
+        assert(is_sorted_assending(qids));
+        gates_.push_back(gate);
 
-        return *this;
+        QubitIds merged;
+        std::set_union(qids.begin(), qids.end(), qids_.begin(), qids_.end(), std::back_inserter(merged));
+        qids_ = std::move(merged);
     }
 
     size_t size() const
@@ -192,48 +291,6 @@ class Cluster
         return gates_.empty();
     }
 
-    /// We say that two clusters "commute" if their sets of qubits don't intersect. The list of clusters given to this
-    /// method is assumed to be in temporal order, where this cluster is implicitly the earliest. Our goal is to find a
-    /// cluster that can be commuted to the front of the list and merged with this cluster without increasing its width
-    /// beyond `max_cluster_width`. The algorithm picks first such cluster from the start of the list (with the least
-    /// distance to commute).
-    std::list<Cluster>::const_iterator find_compatible_cluster(
-        const std::list<Cluster>& nextClusters,
-        unsigned max_cluster_width)
-    {
-        // Union of all qubits in clusters that we are skipping as we are searching for the compatible one.
-        std::set<logical_qubit_id> skipped_qids;
-
-        for (auto candidate = nextClusters.begin(); candidate != nextClusters.end(); ++candidate)
-        {
-            const std::vector<logical_qubit_id>& candidate_qids = candidate->get_qids();
-
-            // New qubits the candidate cluster would add into this cluster.
-            std::vector<logical_qubit_id> qids_new;
-            std::set_difference(
-                candidate_qids.begin(), candidate_qids.end(), qids_.begin(), qids_.end(), std::back_inserter(qids_new));
-
-            // If the new qubits from the candidate cluster don't touch any of the clusters we've skipped, the candidate
-            // cluster is compatible with this one. But we also need to check that the new qubits wouldn't increase the
-            // width of the cluster too much.
-            if (is_intersection_empty(qids_new, skipped_qids) && (qids_.size() + qids_new.size() <= max_cluster_width))
-            {
-                return candidate;
-            }
-
-            // If the candidate cluster isn't compatible with this one but shares qubits, we treat it as a barrier no
-            // other cluster can be pulled through (<irinayat> example #5 below shows that this might lead to more
-            // final clusters than necessary -- why this condition and not checking for intersection of candidate_qids
-            // with qids_skipped?).
-            if (!is_intersection_empty(candidate_qids, qids_)) break;
-
-            skipped_qids.insert(candidate_qids.begin(), candidate_qids.end());
-        }
-
-        // Found no compatible cluster.
-        return nextClusters.end();
-    }
-
     ///
     /// Group given gates into clusters that should be flushed together (in the order of the returned list). The order
     /// of elements in `gates` list represents the temporal order in which the gates were invoked.
@@ -245,11 +302,16 @@ class Cluster
     /// the order of gates inside the cluster is important but it's not guaranteed to be the same as in the original
     /// gates sequence.
     ///
-    /// The greedy algorithm we use doesn't necessarily produce an 'optimal' clustering (e.g. it might not find the
-    /// clustering with the least number of clusters, or balance clusters in terms of gate/qubit counts, or group qubits
-    /// with close positional id together). To delay creating clusters that interfere with each other, the merging is
-    /// done in multiple passes that increment the number of allowed qubits per cluster until the maximum of `fuseSpan`
-    /// is reached.
+    /// The gates are scheduled in a single pass. For every qubit we track the frontier: the last cluster that has a
+    /// gate on the qubit. A gate has to go into a cluster at or after the frontiers of all its qubits, because all
+    /// clusters after these frontiers commute with it. Among the frontier cluster and the few most recently opened
+    /// clusters after it, the gate joins the one it widens the least, as long as the cluster stays within `fuseSpan`
+    /// qubits and `maxFusedDepth` gates; otherwise it opens a new cluster. Qubits are numbered densely per call, so
+    /// that cluster widths are bit masks, and placing a gate costs a constant number of mask operations.
+    ///
+    /// The greedy algorithm doesn't necessarily produce an 'optimal' clustering (e.g. it might not find the clustering
+    /// with the least number of clusters, or balance clusters in terms of gate/qubit counts, or group qubits with
+    /// close positional id together).
     ///
     /// Examples:
     ///
@@ -261,70 +323,119 @@ class Cluster
     ///    {{q1: H(q1), Z(q1)}, {q1, q2: CNOT(q1, q2)}, {q1: X(q1)}}.
     ///    Note, that single-gate clusters might excede the maximum cluster width.
     /// 3. Sequence of gates: X(q1), X(q2), CNOT(q2, q3), Y(q2), X(q3), Y(q1)
-    ///    Because the algorithm grows the clusters gradually, it will be able to combine X(q1) and Y(q1) when creating
-    ///    clusters of width 1, and on the second step for width 2 it will create:
-    ///    {q1, q2: X(q1), Y(q1), X(q2)}, {q2, q3: CNOT(q2, q3), Y(q2), X(q3)}
-    ///    Note, that running the algorithm for width = 3 doesn't change the clusters, and for width = 4 it would
-    ///    combine all gates together into single sequence, but in different order than the original!
+    ///    For width 2, Y(q1) goes back into the first cluster past the CNOT it commutes with:
+    ///    {q1, q2: X(q1), X(q2), Y(q1)}, {q2, q3: CNOT(q2, q3), Y(q2), X(q3)}
+    ///    Note, that for width = 4 it would combine all gates together into single sequence, but in different order
+    ///    than the original!
     /// 4. Sequence of gates: X(q1), X(q2), X(q3), CNOT(q1, q2), CNOT(q1, q3), Y(q1), Y(q2), Y(q3)
-    ///    For width 2 clustering our algorithm gets:
-    ///    {X(q1), X(q2), CNOT(q1, q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}, {Y(q2)}
-    ///    and not this one: {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)} (see the comment
-    ///    in `find_compatible_cluster`)
-    static std::list<Cluster> make_clusters(
+    ///    For width 2 the frontier of q2 is still the first cluster when Y(q2) arrives, so it joins it:
+    ///    {X(q1), X(q2), CNOT(q1, q2), Y(q2)}, {X(q3), CNOT(q1, q3), Y(q1), Y(q3)}
+    ///
+    /// The clusters point into `gates`, which has to outlive them. The gates of one call may touch at most 64 distinct
+    /// qubits, which holds for the pending gates of any wave function that fits into memory.
+    static std::vector<Cluster> make_clusters(
         unsigned fuseSpan,
         int maxFusedDepth,
         const std::vector<DeferredGate>& gates)
     {
-        if (gates.empty()) return std::list<Cluster>{};
+        using Mask = uint64_t;
+        constexpr size_t none = std::numeric_limits<size_t>::max();
+
+        // Number of recently opened clusters, besides the frontier, that a gate may join.
+        constexpr size_t window = 4;
 
-        // Create initial clusters, containing one gate each.
-        std::list<Cluster> curClusters;
+        std::vector<Cluster> clusters;
+        if (gates.empty()) return clusters;
+        clusters.reserve(gates.size());
+
+        // Dense index of each logical qubit, and the last cluster with a gate on it.
+        logical_qubit_id max_id = 0;
         for (const DeferredGate& gate : gates)
         {
-            std::vector<logical_qubit_id> qids = gate.get_controls();
-            qids.push_back(gate.get_target());
-            std::sort(qids.begin(), qids.end());
-            curClusters.emplace_back(qids, std::vector<DeferredGate>{gate});
+            for (logical_qubit_id q : gate.get_controls()) max_id = std::max(max_id, q);
+            for (logical_qubit_id q : gate.get_targets()) max_id = std::max(max_id, q);
         }
+        std::vector<unsigned> dense(max_id + 1, std::numeric_limits<unsigned>::max());
+        unsigned num_dense = 0;
+        Microsoft::Quantum::SmallVector<size_t, 64> frontier;
 
-        // Run incremental left-to-right passes over the clusters, increasing the number of allowed qubits on each pass.
-        std::list<Cluster> prevClusters;
-        for (unsigned cluster_width = 1; cluster_width < fuseSpan + 1; cluster_width++)
-        {
-            assert(prevClusters.empty());
-            prevClusters.swap(curClusters);
+        std::vector<Mask> masks; // qubits of each cluster
+        masks.reserve(gates.size());
 
-            Cluster prevCluster;
-            prevCluster.swap(prevClusters.front());
-            prevClusters.pop_front();
+        for (const DeferredGate& gate : gates)
+        {
+            QubitIds qids = gate.get_controls();
+            for (logical_qubit_id q : gate.get_targets())
+                qids.push_back(q);
+            std::sort(qids.begin(), qids.end());
 
-            while (!prevClusters.empty())
+            Mask mask = 0;
+            size_t first = none; // latest frontier of the qubits of the gate, the earliest cluster it may join
+            for (logical_qubit_id q : qids)
             {
-                std::list<Cluster>::const_iterator clusterFound =
-                    prevCluster.find_compatible_cluster(prevClusters, cluster_width);
+                if (dense[q] == std::numeric_limits<unsigned>::max())
+                {
+                    assert(num_dense < 64);
+                    dense[q] = num_dense++;
+                    frontier.push_back(none);
+                }
+                mask |= Mask(1) << dense[q];
+                const size_t f = frontier[dense[q]];
+                if (f != none && (first == none || f > first)) first = f;
+            }
 
-                if (clusterFound == prevClusters.end() || prevCluster.size() >= maxFusedDepth)
+            // Candidates are the frontier cluster and the last `window` clusters after it, the gate joins the one it
+            // adds the fewest qubits to (the earliest on ties).
+            size_t best = none;
+            unsigned best_added = 0;
+            auto consider = [&](size_t c) {
+                if (clusters[c].size() >= static_cast<size_t>(maxFusedDepth)) return;
+                const unsigned merged = popcount(masks[c] | mask);
+                if (merged > fuseSpan) return;
+                const unsigned added = merged - popcount(masks[c]);
+                if (best == none || added < best_added)
                 {
-                    // Cannot extend this cluster anymore, stash it away for the next pass and try to extend the next
-                    // one from the list. Doing swap/move/pop in this order allows us to avoid copying clusters.
-                    prevCluster.swap(prevClusters.front());
-                    curClusters.push_back(std::move(prevClusters.front()));
-                    prevClusters.pop_front();
+                    best = c;
+                    best_added = added;
                 }
-                else
+            };
+            if (popcount(mask) <= fuseSpan)
+            {
+                size_t c = clusters.size() > window ? clusters.size() - window : 0;
+                if (first != none)
                 {
-                    // Extend this cluster and try again whether it can be extended even further while keeping its
-                    // width <= cluster_width.
-                    prevCluster.append(*clusterFound);
-                    prevClusters.erase(clusterFound);
+                    consider(first);
+                    c = std::max(c, first + 1);
                 }
+                for (; c < clusters.size(); ++c)
+                    consider(c);
             }
 
-            curClusters.push_back(std::move(prevCluster)); // Save the final cluster
+            if (best == none)
+            {
+                best = clusters.size();
+                clusters.emplace_back(qids, &gate);
+                masks.push_back(mask);
+            }
+            else
+            {
+                clusters[best].add(&gate, qids);
+                masks[best] |= mask;
+            }
+            for (logical_qubit_id q : qids)
+                frontier[dense[q]] = best;
         }
 
-        return curClusters;
+        return clusters;
+    }
+
+  private:
+    static unsigned popcount(uint64_t mask)
+    {
+        unsigned count = 0;
+        for (; mask != 0; mask &= mask - 1)
+            ++count;
+        return count;
     }
 };
 
@@ -345,14 +456,24 @@ class Wavefunction
     };
 #endif
 
-    /// Number of currently allocated qubits.
-    unsigned num_qubits_;
+    /// Number of currently allocated qubits that are part of the state.
+    mutable unsigned num_qubits_;
+
+    /// Number of allocated qubits that are still classical bits outside of the state (see `allocate_qubit`).
+    mutable unsigned num_classical_ = 0;
+
+    /// If set, `measure` and `multimeasure` take the measured qubits out of the state and keep them as classical bits.
+    bool compact_measured_ = true;
 
     /// Represents the state of the system with num_qubits_ qubits in little-endian notation (that is, the qubit
     /// with positional id = 0 corresponds to the least significant bit in the index of the standard computational
     /// basic vector of this wave function). Might not reflect the current state if there are pending fused gates.
     mutable WavefunctionStorage wfn_;
 
+    /// Positional qubits from this one on split the reserved state into blocks of whole pages, so releasing them
+    /// moves pages instead of amplitudes (see `reserve`). 0 if the state isn't paged.
+    unsigned page_qubits_ = 0;
+
     /// Each qubit has a client-facing id, which we call "logical qubit id" or just "logical qubit". However, the order
     /// of qubits in the internal representation of the state, that is, the positions of the qubits in the standard
     /// computational basis of the wave function, might not match their logical ids or even the order of the logical
@@ -364,9 +485,29 @@ class Wavefunction
     static constexpr int MAX_PENDING_GATES = 999;
     mutable std::vector<DeferredGate> pending_gates_;
 
+    /// Number of earlier pending gates the peephole pass of `flush` looks back at for a gate to merge with.
+    static constexpr size_t PEEPHOLE_WINDOW = 64;
+
+    /// Pauli frame, indexed by logical qubit id like `qubitmap_`. The state of the system is
+    /// i^frame_phase_ * Prod_q(X^frame_x_[q] * Z^frame_z_[q]) applied to the wave function storage with the pending gates.
+    /// Uncontrolled X, Y and Z gates only update the frame, other gates are conjugated through it, and the frame is
+    /// applied to the state only when the raw amplitudes are needed.
+    mutable std::vector<bool> frame_x_;
+    mutable std::vector<bool> frame_z_;
+    mutable unsigned frame_phase_ = 0;
+
+    mutable PeepholeCounters peephole_;
+
     /// TODO: add comment
     Fused fused_;
 
+    /// Pool of fused clusters for the tiled groups of `flush`, kept to reuse their storage.
+    mutable std::vector<Fused::FusedCluster> tiled_;
+
+    /// Qubit masks of the pending gates in `peephole` and of the clusters in `relayout`, kept to reuse their storage.
+    mutable std::vector<uint64_t> gate_masks_;
+    mutable std::vector<size_t> cluster_masks_;
+
     /// TODO: add comment
     using RngEngine = std::mt19937;
     RngEngine rng_;
@@ -375,6 +516,129 @@ class Wavefunction
     QubitAllocationPattern usage_ = QubitAllocationPattern::any;
 #endif
 
+    /// removes positional qubit p if it's in the classical state `value`, by moving pages where the state is paged
+    bool release_position(positional_qubit_id p, bool value)
+    {
+        if (page_qubits_ != 0 && p >= page_qubits_) return kernels::release_pages(wfn_, p, value);
+        return kernels::release(wfn_, p, value);
+    }
+
+    /// Closes the gap left by qubit q, which was at position p in the classical state `value` before it was removed from
+    /// the state. On a classical qubit the frame reduces to a flipped value and a global phase, only the latter is kept.
+    void remove_position(logical_qubit_id q, positional_qubit_id p, bool value)
+    {
+        if (frame_z_[q] && value) frame_phase_ = (frame_phase_ + 2) & 3;
+        frame_z_[q] = false;
+
+        for (size_t i = 0; i < qubitmap_.size(); ++i)
+            if (qubitmap_[i] > p && qubitmap_[i] < num_qubits_) qubitmap_[i]--;
+        --num_qubits_;
+    }
+
+    /// Takes qubit q out of the state as the classical bit `result`, which has probability p1 of being 1.
+    bool measure_out(logical_qubit_id q, bool result, double p1)
+    {
+        const positional_qubit_id p = get_qubit_position(q);
+        const bool value = (result != frame_x_[q]);
+        kernels::collapse_out(wfn_, p, value, result ? p1 : 1. - p1);
+        remove_position(q, p, value);
+        frame_x_[q] = result;
+        qubitmap_[q] = classical_qubit_position();
+        ++num_classical_;
+        return result;
+    }
+
+    bool measure_out(logical_qubit_id q)
+    {
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const double p1 = probability(q);
+        return measure_out(q, uniform(rng_) < p1, p1);
+    }
+
+    /// Adds a qubit that is still a classical bit to the state, in |0> at the next free position, where the X part of
+    /// its frame carries its value over. The pending gates don't act on it, so nothing has to be flushed.
+    void materialize_qubit(logical_qubit_id q) const
+    {
+        if (qubitmap_[q] != classical_qubit_position()) return;
+        kernels::grow(wfn_);
+        qubitmap_[q] = num_qubits_++;
+        --num_classical_;
+    }
+
+    template <class Qs>
+    void materialize_qubits(Qs const& qs) const
+    {
+        for (logical_qubit_id q : qs)
+            materialize_qubit(q);
+    }
+
+    /// Drops the controls that are classical bits from `cs`. Returns false if one of them is 0, so the gate is void.
+    template <class Qs>
+    bool resolve_classical_controls(Qs& cs) const
+    {
+        Qs quantum;
+        for (logical_qubit_id c : cs)
+        {
+            if (!is_classical_bit(c)) quantum.push_back(c);
+            else if (!frame_x_[c]) return false;
+        }
+        if (quantum.size() != cs.size()) cs = quantum;
+        return true;
+    }
+
+    /// Drops the classical bits with a Z or I factor from the Pauli string `bs` on `qs` and adds the remaining qubits to
+    /// the state. A classical bit is |0> in the state, so Z on it is +1 and the frame accounts for its value.
+    void drop_classical_z(std::vector<Gates::Basis>& bs, std::vector<logical_qubit_id>& qs) const
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i < qs.size(); ++i)
+        {
+            if (is_classical_bit(qs[i]) && (bs[i] == Gates::PauliZ || bs[i] == Gates::PauliI)) continue;
+            materialize_qubit(qs[i]);
+            bs[kept] = bs[i];
+            qs[kept] = qs[i];
+            ++kept;
+        }
+        bs.resize(kept);
+        qs.resize(kept);
+    }
+
+    /// Z and I factors on classical bits drop out of the Pauli string of an exponential, the frame gives their sign.
+    /// The factors that are left go to apply_controlled_exp, or turn into a rotation exp(i phi P) = R_P(-2 phi) on a
+    /// single target, or into the phase exp(i phi) where the controls are set. The controls are resolved already.
+    void apply_controlled_exp_on_classical_bits(
+        std::vector<Gates::Basis> bs,
+        double phi,
+        std::vector<logical_qubit_id> cs,
+        std::vector<logical_qubit_id> qs)
+    {
+        const bool anticommutes = frame_anticommutes(bs, qs);
+        drop_classical_z(bs, qs);
+        // the factors that are left take their own frame into account below
+        if (anticommutes != frame_anticommutes(bs, qs)) phi = -phi;
+        if (qs.size() > 1)
+            apply_controlled_exp(bs, phi, cs, qs);
+        else if (qs.size() == 1 && cs.empty())
+            apply(Gates::R(bs.front(), -2. * phi, qs.front()));
+        else if (qs.size() == 1)
+            apply_controlled(QubitIds(cs), Gates::R(bs.front(), -2. * phi, qs.front()));
+        else if (!cs.empty())
+        {
+            const logical_qubit_id target = cs.back();
+            cs.pop_back();
+            apply_controlled(QubitIds(cs), Gates::R1(-phi, target));
+        }
+    }
+
+    /// the qubits of `qs` that are part of the state
+    std::vector<logical_qubit_id> quantum_qubits(std::vector<logical_qubit_id> const& qs) const
+    {
+        std::vector<logical_qubit_id> quantum;
+        for (logical_qubit_id q : qs)
+            if (!is_classical_bit(q)) quantum.push_back(q);
+        return quantum;
+    }
+
   public:
     using value_type = T;
 
@@ -386,14 +650,55 @@ class Wavefunction
         rng_.seed((unsigned)std::chrono::system_clock::now().time_since_epoch().count());
     }
 
+    /// Reserve the state vector for `qubits` qubits up front, so that allocating qubits up to that number grows it in
+    /// place instead of copying it. Only address space is reserved, the pages are backed as the state grows into
+    /// them; where the allocator can't leave pages untouched this does nothing. A reservation that can't be made is
+    /// not an error either: the state then grows by copying as before.
+    ///
+    /// With `pageQubits` > 0 the reserved state is also paged: it is treated as chunks of 2^pageQubits amplitudes
+    /// (at least one page), and releasing a qubit whose position splits the state into whole chunks moves the kept
+    /// chunks by remapping their pages and returns the dropped ones to the system, instead of copying half the
+    /// state. Paging needs an allocator that can remap pages (Linux only) and is silently off otherwise.
+    void reserve(unsigned qubits, unsigned pageQubits = 0)
+    {
+        using Alloc = WavefunctionStorage::allocator_type;
+        if (!Alloc::lazy_pages) return;
+        if (qubits == 0 || qubits >= 8 * sizeof(std::size_t)) return;
+        try
+        {
+            wfn_.reserve(std::size_t(1) << qubits);
+        }
+        catch (const std::exception&)
+        {
+            return;
+        }
+
+        const std::size_t page = Alloc::page_elements(wfn_.capacity());
+        if (pageQubits == 0 || page == 0) return;
+        page_qubits_ = pageQubits;
+        while ((std::size_t(1) << page_qubits_) < page)
+            ++page_qubits_;
+    }
+
     void reset()
     {
         fused_.reset();
         rng_.seed((unsigned)std::chrono::system_clock::now().time_since_epoch().count());
         num_qubits_ = 0;
+        num_classical_ = 0;
+        if (page_qubits_ != 0)
+        {
+            // return all but the first chunk of the paged state to the system
+            using Alloc = WavefunctionStorage::allocator_type;
+            const std::size_t chunk = std::size_t(1) << page_qubits_;
+            if (wfn_.size() > chunk) Alloc::discard(wfn_.data() + chunk, wfn_.size() - chunk);
+        }
         wfn_.resize(1);
         wfn_[0] = 1.;
         qubitmap_.resize(0);
+        frame_x_.clear();
+        frame_z_.clear();
+        frame_phase_ = 0;
 
         // what about pending_gates_?
     }
@@ -408,9 +713,23 @@ class Wavefunction
         return std::numeric_limits<unsigned>::max();
     }
 
+    /// Position of a qubit that is allocated but not yet part of the state. Until a gate needs it in the state, such
+    /// a qubit is a classical bit whose value is the X part of its frame.
+    constexpr positional_qubit_id classical_qubit_position() const
+    {
+        return std::numeric_limits<unsigned>::max() - 1;
+    }
+
+    bool is_classical_bit(logical_qubit_id q) const
+    {
+        return qubitmap_[q] == classical_qubit_position();
+    }
+
+    /// position of the qubit in the state, a qubit that is still a classical bit is added to the state first
     positional_qubit_id get_qubit_position(logical_qubit_id q) const
     {
         assert(qubitmap_[q] != invalid_qubit_position());
+        materialize_qubit(q);
         return qubitmap_[q];
     }
 
@@ -427,6 +746,23 @@ class Wavefunction
         return ps;
     }
 
+    /// Positions of the qubits of a deferred gate, in a list that doesn't allocate for gates of the usual width.
+    Fusion::IndexVector get_qubit_positions(const QubitIds& qs) const
+    {
+        Fusion::IndexVector ps;
+        for (logical_qubit_id q : qs)
+            ps.push_back(get_qubit_position(q));
+        return ps;
+    }
+
+    size_t get_qubit_mask(const QubitIds& qs) const
+    {
+        size_t mask = 0;
+        for (logical_qubit_id q : qs)
+            mask |= 1ull << get_qubit_position(q);
+        return mask;
+    }
+
     /// Returns the list of logical ids of all currently allocated qubits.
     std::vector<logical_qubit_id> get_qubit_ids() const
     {
@@ -442,9 +778,277 @@ class Wavefunction
         return qs;
     }
 
+    /// Pauli exponentials that span more qubits than a fused cluster may are not folded into a fused matrix but applied
+    /// by their own kernel. Such a gate always forms a cluster of its own (see `Cluster::make_clusters`).
+    bool is_standalone(const DeferredGate& gate) const
+    {
+        return gate.is_exp() &&
+               gate.get_controls().size() + gate.get_targets().size() > static_cast<size_t>(fused_.maxSpan());
+    }
+
+    /// Positions of the qubits that the fused matrix of the cluster will act on, as a bit mask. Controls shared by all
+    /// gates of the cluster stay controls of the fused gate, all other controls become its targets.
+    size_t cluster_target_mask(const Cluster& cl) const
+    {
+        size_t targets = 0;
+        size_t all_controls = 0;
+        size_t common_controls = ~size_t(0);
+        for (const DeferredGate* gate : cl.get_gates())
+        {
+            targets |= get_qubit_mask(gate->get_targets());
+            size_t controls = get_qubit_mask(gate->get_controls());
+            all_controls |= controls;
+            common_controls &= controls;
+        }
+        return targets | (all_controls & ~common_controls);
+    }
+
+    /// Moves qubits that the pending clusters frequently target from high positions into low positions that these
+    /// clusters don't target, so that the clusters can be applied tile by tile (see `Fused::flush_tiled`). Each move
+    /// is a swap of two positions done in place, which costs one pass over the state vector, so a move is only made
+    /// if it turns more than one cluster from a full pass of its own into part of a tiled pass.
+    void relayout(const std::vector<Cluster>& clusters) const
+    {
+        const int tileBits = fused_.tileBits();
+        if (num_qubits_ <= static_cast<unsigned>(tileBits)) return;
+
+        const size_t low_mask = (1ull << tileBits) - 1;
+        std::vector<size_t>& masks = cluster_masks_;
+        masks.clear();
+        for (const Cluster& cl : clusters)
+        {
+            // standalone clusters are never tiled, a full mask keeps them out of the savings
+            masks.push_back(is_standalone(*cl.get_gates().front()) ? ~size_t(0) : cluster_target_mask(cl));
+        }
+
+        while (true)
+        {
+            // Savings of moving position `ph` to `pl`: clusters for which `ph` is the only high target become
+            // tileable, tileable clusters that target `pl` stop being so.
+            int best_savings = 1;
+            positional_qubit_id best_high = 0, best_low = 0;
+            for (positional_qubit_id ph = tileBits; ph < num_qubits_; ++ph)
+            {
+                const size_t hbit = 1ull << ph;
+                for (positional_qubit_id pl = 0; pl < static_cast<positional_qubit_id>(tileBits); ++pl)
+                {
+                    const size_t lbit = 1ull << pl;
+                    int savings = 0;
+                    for (size_t m : masks)
+                    {
+                        if ((m & ~low_mask) == hbit && (m & lbit) == 0) ++savings;
+                        else if ((m & ~low_mask) == 0 && (m & lbit) != 0) --savings;
+                    }
+                    if (savings > best_savings)
+                    {
+                        best_savings = savings;
+                        best_high = ph;
+                        best_low = pl;
+                    }
+                }
+            }
+            if (best_savings <= 1) break;
+
+            kernels::swap(wfn_, best_low, best_high);
+            for (positional_qubit_id& p : qubitmap_)
+            {
+                if (p == best_low) p = best_high;
+                else if (p == best_high) p = best_low;
+            }
+
+            const size_t hbit = 1ull << best_high;
+            const size_t lbit = 1ull << best_low;
+            for (size_t& m : masks)
+            {
+                if (((m & hbit) != 0) != ((m & lbit) != 0)) m ^= (hbit | lbit);
+            }
+        }
+    }
+
+    /// Pushes the frame of qubit `q`, multiplied by `factor`, to the pending gates and clears it.
+    void materialize_frame(logical_qubit_id q, ComplexType factor = 1.) const
+    {
+        materialize_qubit(q);
+        const ComplexType last = frame_z_[q] ? -factor : factor;
+        TinyMatrix<ComplexType, 2> mat;
+        if (frame_x_[q])
+            mat = {{ComplexType(0.), last}, {factor, ComplexType(0.)}};
+        else
+            mat = {{factor, ComplexType(0.)}, {ComplexType(0.), last}};
+        frame_x_[q] = false;
+        frame_z_[q] = false;
+
+        pending_gates_.emplace_back(QubitIds(), q, mat);
+        if (pending_gates_.size() > MAX_PENDING_GATES)
+        {
+            flush();
+        }
+    }
+
+    void materialize_frame(const std::vector<logical_qubit_id>& qs) const
+    {
+        for (logical_qubit_id q : qs)
+        {
+            if (frame_x_[q] || frame_z_[q]) materialize_frame(q);
+        }
+    }
+
+    /// Pushes the whole frame, including its global phase, to the pending gates.
+    void materialize_frame() const
+    {
+        static const ComplexType powers_of_i[4] = {{1., 0.}, {0., 1.}, {-1., 0.}, {0., -1.}};
+        ComplexType factor = powers_of_i[frame_phase_];
+        frame_phase_ = 0;
+        for (logical_qubit_id q = 0; q < frame_x_.size(); q++)
+        {
+            // the frame of a classical bit is its value, it stays classical
+            if ((frame_x_[q] || frame_z_[q]) && !is_classical_bit(q))
+            {
+                materialize_frame(q, factor);
+                factor = 1.;
+            }
+        }
+        if (factor == ComplexType(1.)) return;
+
+        auto it = std::find_if(
+            qubitmap_.begin(), qubitmap_.end(), [this](positional_qubit_id p) { return p < num_qubits_; });
+        if (it != qubitmap_.end())
+        {
+            materialize_frame(static_cast<logical_qubit_id>(it - qubitmap_.begin()), factor);
+        }
+        else
+        {
+            flush();
+            wfn_[0] *= factor;
+        }
+    }
+
+    const PeepholeCounters& peephole_counters() const
+    {
+        return peephole_;
+    }
+
+    /// Simplifies the pending gates before they are clustered. Each gate is merged into the latest earlier gate with
+    /// the same controls and targets, if the gates in between commute with it: single-qubit gates by multiplying
+    /// their matrices, Pauli exponentials with the same string by adding their angles. Pairs that merge into the
+    /// identity, such as H*H, S*AdjS or Rz(a)*Rz(-a), are dropped. The search stops at the first gate that doesn't
+    /// commute, and after PEEPHOLE_WINDOW gates.
+    void peephole() const
+    {
+        const double eps = 100. * std::numeric_limits<ComplexType::value_type>::epsilon();
+        // The simplified gates so far are pending_gates_[0, kept), with their qubit masks in `masks`. Cancelled gates
+        // get an empty mask, which the search skips, and are taken out at the end.
+        size_t kept = 0;
+        std::vector<uint64_t>& masks = gate_masks_;
+        masks.resize(pending_gates_.size());
+        for (size_t i = 0; i < pending_gates_.size(); ++i)
+        {
+            const DeferredGate& gate = pending_gates_[i];
+            const uint64_t mask = gate.qubit_mask();
+            bool folded = false;
+            const size_t stop = kept > PEEPHOLE_WINDOW ? kept - PEEPHOLE_WINDOW : 0;
+            for (size_t k = kept; k-- > stop;)
+            {
+                if ((masks[k] & mask) == 0) continue;
+                const DeferredGate& earlier = pending_gates_[k];
+                if (gate.is_exp() == earlier.is_exp() && gate.same_qubits(earlier) &&
+                    (!gate.is_exp() || gate.get_paulis() == earlier.get_paulis()))
+                {
+                    bool identity = false;
+                    if (gate.is_exp())
+                    {
+                        const double phi = earlier.get_phi() + gate.get_phi();
+                        identity = std::abs(phi) < eps;
+                        pending_gates_[k] =
+                            DeferredGate(earlier.get_controls(), earlier.get_paulis(), phi, earlier.get_targets());
+                    }
+                    else
+                    {
+                        const TinyMatrix<ComplexType, 2>& a = gate.get_mat();
+                        const TinyMatrix<ComplexType, 2>& b = earlier.get_mat();
+                        TinyMatrix<ComplexType, 2> mat;
+                        for (unsigned r = 0; r < 2; ++r)
+                            for (unsigned c = 0; c < 2; ++c)
+                                mat(r, c) = a(r, 0) * b(0, c) + a(r, 1) * b(1, c);
+                        identity = std::abs(mat(0, 1)) < eps && std::abs(mat(1, 0)) < eps &&
+                                   std::abs(mat(0, 0) - ComplexType(1.)) < eps &&
+                                   std::abs(mat(1, 1) - ComplexType(1.)) < eps;
+                        pending_gates_[k] = DeferredGate(earlier.get_controls(), earlier.get_target(), mat);
+                    }
+
+                    if (identity)
+                    {
+                        peephole_.cancelled += 2;
+                        masks[k] = 0;
+                    }
+                    else
+                    {
+                        ++peephole_.merged;
+                    }
+                    folded = true;
+                    break;
+                }
+                if (!gate.commutes_with(earlier)) break;
+            }
+            if (!folded)
+            {
+                if (kept != i) pending_gates_[kept] = std::move(pending_gates_[i]);
+                masks[kept++] = mask;
+            }
+        }
+
+        size_t n = 0;
+        for (size_t k = 0; k < kept; ++k)
+        {
+            if (masks[k] == 0) continue;
+            if (n != k) pending_gates_[n] = std::move(pending_gates_[k]);
+            ++n;
+        }
+        pending_gates_.erase(pending_gates_.begin() + n, pending_gates_.end());
+    }
+
+    /// Conjugates the matrix of a gate that targets qubit `q` by the frame of that qubit: Z^z * X^x * U * X^x * Z^z.
+    TinyMatrix<ComplexType, 2> through_frame(logical_qubit_id q, TinyMatrix<ComplexType, 2> mat) const
+    {
+        if (frame_x_[q])
+        {
+            std::swap(mat(0, 0), mat(1, 1));
+            std::swap(mat(0, 1), mat(1, 0));
+        }
+        if (frame_z_[q])
+        {
+            mat(0, 1) = -mat(0, 1);
+            mat(1, 0) = -mat(1, 0);
+        }
+        return mat;
+    }
+
+    /// True if the X part of the frame flips the joint parity of the qubits.
+    bool frame_parity(const std::vector<logical_qubit_id>& qs) const
+    {
+        bool parity = false;
+        for (logical_qubit_id q : qs)
+            parity = (parity != frame_x_[q]);
+        return parity;
+    }
+
+    /// True if the frame anticommutes with the Pauli string `bs` on the qubits `qs`.
+    bool frame_anticommutes(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs) const
+    {
+        bool anticommutes = false;
+        for (size_t i = 0; i < qs.size(); ++i)
+        {
+            const bool anticommutes_x = frame_x_[qs[i]] && (bs[i] == Gates::PauliZ || bs[i] == Gates::PauliY);
+            const bool anticommutes_z = frame_z_[qs[i]] && (bs[i] == Gates::PauliX || bs[i] == Gates::PauliY);
+            anticommutes = (anticommutes != (anticommutes_x != anticommutes_z));
+        }
+        return anticommutes;
+    }
+
     void flush() const
     {
-        std::list<Cluster> clusters = Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
+        peephole();
+        std::vector<Cluster> clusters = Cluster::make_clusters(fused_.maxSpan(), fused_.maxDepth(), pending_gates_);
 
         if (clusters.empty())
         {
@@ -452,30 +1056,84 @@ class Wavefunction
         }
         else
         {
+            relayout(clusters);
+
+            // Consecutive clusters that only target qubits below the tile boundary are collected into a group and
+            // applied tile by tile, so the whole group costs one pass over the state instead of one pass per cluster.
+            // The first `ntiled` entries of `tiled_` hold the group, the pool only grows, so that the fused matrices of
+            // the clusters keep their storage from one flush to the next.
+            const int tileBits = fused_.tileBits();
+            size_t ntiled = 0;
+
             // logic to flush gates in each cluster
             for (const Cluster& cl : clusters)
             {
-                for (const DeferredGate& gate : cl.get_gates())
+                const DeferredGate& first = *cl.get_gates().front();
+                if (is_standalone(first))
                 {
-                    const std::vector<logical_qubit_id>& cs = gate.get_controls();
-                    if (cs.size() == 0)
+                    if (ntiled > 0)
                     {
-                        fused_.apply(wfn_, gate.get_mat(), get_qubit_position(gate.get_target()));
+                        Fused::flush_tiled(wfn_, tiled_.data(), ntiled, tileBits);
+                        ntiled = 0;
+                    }
+                    kernels::apply_controlled_exp(
+                        wfn_,
+                        first.get_paulis().to_vector(),
+                        first.get_phi(),
+                        get_qubit_positions(first.get_controls()).to_vector(),
+                        get_qubit_positions(first.get_targets()).to_vector());
+                    continue;
+                }
+
+                for (const DeferredGate* gate : cl.get_gates())
+                {
+                    const QubitIds& cs = gate->get_controls();
+                    if (gate->is_exp())
+                    {
+                        fused_.apply_controlled_exp(
+                            gate->get_paulis(),
+                            gate->get_phi(),
+                            get_qubit_positions(cs),
+                            get_qubit_positions(gate->get_targets()));
+                    }
+                    else if (cs.size() == 0)
+                    {
+                        fused_.apply(wfn_, gate->get_mat(), get_qubit_position(gate->get_target()));
                     }
                     else
                     {
                         fused_.apply_controlled(
-                            wfn_, gate.get_mat(), get_qubit_positions(cs), get_qubit_position(gate.get_target()));
+                            wfn_, gate->get_mat(), get_qubit_positions(cs), get_qubit_position(gate->get_target()));
                     }
                 }
 
+                if (fused_.fits_tile(wfn_, tileBits))
+                {
+                    if (ntiled == tiled_.size()) tiled_.emplace_back();
+                    fused_.take_fused(tiled_[ntiled++]);
+                    continue;
+                }
+
+                if (ntiled > 0)
+                {
+                    Fused::flush_tiled(wfn_, tiled_.data(), ntiled, tileBits);
+                    ntiled = 0;
+                }
                 fused_.flush(wfn_);
             }
+
+            if (ntiled > 0)
+            {
+                Fused::flush_tiled(wfn_, tiled_.data(), ntiled, tileBits);
+            }
         }
         pending_gates_.clear();
     }
 
     /// Allocate a qubit with implicitly assigned logical qubit id.
+    /// The new qubit starts out as a classical bit in |0> outside of the state: X gates, classical controls and
+    /// measurements on it are resolved from its frame, and it is added to the state only once a gate could take it out
+    /// of the computational basis. Allocating therefore neither flushes nor grows the state.
     logical_qubit_id allocate_qubit()
     {
 #ifndef NDEBUG
@@ -483,26 +1141,27 @@ class Wavefunction
         usage_ = QubitAllocationPattern::implicitLogicalId;
 #endif
 
-        flush();
-        wfn_.resize(2 * wfn_.size());
+        ++num_classical_;
 
         // Reuse a logical qubit id, if any is available.
         auto it = std::find(qubitmap_.begin(), qubitmap_.end(), invalid_qubit_position());
         if (it != qubitmap_.end())
         {
             logical_qubit_id num = static_cast<unsigned>(it - qubitmap_.begin());
-            qubitmap_[num] = num_qubits_++;
+            qubitmap_[num] = classical_qubit_position();
             return num;
         }
         else
         {
-            qubitmap_.push_back(num_qubits_++);
+            qubitmap_.push_back(classical_qubit_position());
+            frame_x_.resize(qubitmap_.size());
+            frame_z_.resize(qubitmap_.size());
             return static_cast<unsigned>(qubitmap_.size() - 1);
         }
     }
 
     /// Allocate a qubit with explicitly provided logical qubit id. The caller is responsible for ensuring the id
-    /// doesn't collide with other allocated qubits.
+    /// doesn't collide with other allocated qubits. Like above, the qubit starts out as a classical bit.
     void allocate_qubit(logical_qubit_id id)
     {
 #ifndef NDEBUG
@@ -510,60 +1169,136 @@ class Wavefunction
         usage_ = QubitAllocationPattern::explicitLogicalId;
 #endif
 
-        flush();
-        wfn_.resize(2 * wfn_.size());
+        ++num_classical_;
 
         if (id < qubitmap_.size())
         {
             assert(qubitmap_[id] == invalid_qubit_position());
-            qubitmap_[id] = num_qubits_++;
+            qubitmap_[id] = classical_qubit_position();
         }
         else
         {
             assert(id == qubitmap_.size()); // we want qubitmap_ to be as small as possible
-            qubitmap_.push_back(num_qubits_++);
+            qubitmap_.push_back(classical_qubit_position());
+            frame_x_.resize(qubitmap_.size());
+            frame_z_.resize(qubitmap_.size());
         }
         assert((wfn_.size() >> num_qubits_) == 1);
     }
 
     /// release the specified qubit
-    /// \pre the qubit has to be in a classical state in the computational basis
-    void release(logical_qubit_id q)
+    /// If the qubit is not in a classical state it gets measured first. Returns true if the qubit was in state |0>.
+    bool release(logical_qubit_id q)
     {
-        positional_qubit_id p = get_qubit_position(q);
+        if (is_classical_bit(q))
+        {
+            // X^x * Z^z |0> = |x>, so the frame leaves no phase behind
+            const bool clean = !frame_x_[q];
+            frame_x_[q] = false;
+            frame_z_[q] = false;
+            qubitmap_[q] = invalid_qubit_position();
+            --num_classical_;
+            return clean;
+        }
+
         flush();
-        kernels::collapse(wfn_, p, getvalue(q), true);
-        for (size_t i = 0; i < qubitmap_.size(); ++i)
-            if (qubitmap_[i] > p && qubitmap_[i] != invalid_qubit_position()) qubitmap_[i]--;
+        positional_qubit_id p = get_qubit_position(q);
+
+        // A clean qubit holds the physical value frame_x_[q], so that half is tried first: the kernel compacts and
+        // checks classicality in the same pass, and falls back only for qubits left in |1> or in a superposition.
+        bool value = frame_x_[q];
+        bool clean = release_position(p, value);
+        if (!clean)
+        {
+            value = !value;
+            if (!release_position(p, value))
+            {
+                // measuring the qubit out of the state leaves a classical bit
+                measure_out(q);
+                release(q);
+                return false;
+            }
+        }
+
+        remove_position(q, p, value);
+        frame_x_[q] = false;
         qubitmap_[q] = invalid_qubit_position();
-        --num_qubits_;
+        return clean;
     }
 
-    /// the number of used qubits
+    /// the number of used qubits, including the ones that are still classical bits
     unsigned num_qubits() const
     {
-        return num_qubits_;
+        return num_qubits_ + num_classical_;
     }
 
     /// probability of measuring a 1
     double probability(logical_qubit_id q) const
     {
+        if (is_classical_bit(q)) return frame_x_[q] ? 1. : 0.;
         flush();
-        return kernels::probability(wfn_, get_qubit_position(q));
+        const double p = kernels::probability(wfn_, get_qubit_position(q));
+        return frame_x_[q] ? 1. - p : p;
     }
 
     /// probability of jointly measuring a 1
     double jointprobability(std::vector<logical_qubit_id> const& qs) const
     {
-        flush();
-        return kernels::jointprobability(wfn_, get_qubit_positions(qs));
+        // classical bits only add their value to the parity, which the frame already accounts for
+        const std::vector<logical_qubit_id> quantum = quantum_qubits(qs);
+        double p = 0.;
+        if (!quantum.empty())
+        {
+            flush();
+            p = kernels::jointprobability(wfn_, get_qubit_positions(quantum));
+        }
+        return frame_parity(qs) ? 1. - p : p;
     }
 
     /// probability of jointly measuring a 1
-    double jointprobability(std::vector<Gates::Basis> const& bs, std::vector<logical_qubit_id> const& qs) const
+    double jointprobability(std::vector<Gates::Basis> bs, std::vector<logical_qubit_id> qs) const
     {
+        const bool anticommutes = frame_anticommutes(bs, qs);
+        drop_classical_z(bs, qs);
+        if (qs.empty()) return anticommutes ? 1. : 0.;
         flush();
-        return kernels::jointprobability(wfn_, bs, get_qubit_positions(qs));
+        return kernels::jointprobability(wfn_, bs, get_qubit_positions(qs), !anticommutes);
+    }
+
+    /// expectation value of the sum of coeffs[k] times the Pauli string bs[k], whose i-th entry acts on qs[i]
+    double pauli_sum_expectation(
+        std::vector<std::vector<Gates::Basis>> const& bs,
+        std::vector<double> coeffs,
+        std::vector<logical_qubit_id> const& qs) const
+    {
+        // A term with X or Y on a classical bit has expectation 0, Z and I on one only add the sign of its frame, so
+        // the terms are reduced to the qubits in the state.
+        const std::vector<logical_qubit_id> quantum = quantum_qubits(qs);
+        std::vector<std::vector<Gates::Basis>> reduced;
+        std::vector<double> weights;
+        double classical = 0.;
+        for (size_t k = 0; k < bs.size(); ++k)
+        {
+            std::vector<Gates::Basis> term;
+            bool vanishes = false;
+            for (size_t i = 0; i < qs.size(); ++i)
+            {
+                if (!is_classical_bit(qs[i])) term.push_back(bs[k][i]);
+                else if (bs[k][i] == Gates::PauliX || bs[k][i] == Gates::PauliY) vanishes = true;
+            }
+            if (vanishes) continue;
+            const double c = frame_anticommutes(bs[k], qs) ? -coeffs[k] : coeffs[k];
+            if (quantum.empty())
+                classical += c;
+            else
+            {
+                reduced.push_back(std::move(term));
+                weights.push_back(c);
+            }
+        }
+        if (reduced.empty()) return classical;
+        flush();
+        return kernels::pauli_sum_expectation(wfn_, reduced, weights, get_qubit_positions(quantum));
     }
 
     /// \pre: Each qubit, listed in `q`, must be unentangled and in state |0>. If the prerequisite isn't satisfied,
@@ -575,6 +1310,8 @@ class Wavefunction
     {
         assert((static_cast<size_t>(1) << qubits.size()) == amplitudes.size());
 
+        materialize_qubits(qubits);
+        materialize_frame();
         flush();
 
         if (qubits.size() == num_qubits_)
@@ -608,13 +1345,13 @@ class Wavefunction
             }
 
             // The current state can be thought of as Sum(a_i*|i>|0...0>), after the state injection it will become
-            // Sum(a_i*|i>Sum(b_j*|j>)) = Sum(a_i*b_j|i>|j>). Thus, to compute amplitude of a term |k> after the state
-            // injection we need to find the corresponding |i> vector from the original wave function and |j> vector
-            // from the state being injected, and multiply their amplitudes. The things are complicated by the fact that
-            // the state might not be injected on adjacently positioned qubits, but get/set_register takes care of that.
+            // Sum(a_i*|i>Sum(b_j*|j>)) = Sum(a_i*b_j|i>|j>). As the injected qubits are |0>, a_i sits at the index with
+            // their bits cleared and its terms a_i*b_j only differ from it in those bits, so each a_i is read once and
+            // its terms are written in place, which keeps the reservation of the state. The things are complicated by
+            // the fact that the state might not be injected on adjacently positioned qubits, but set_register takes
+            // care of that.
             const int64_t num_states = static_cast<int64_t>(wfn_.size());
             const size_t mask = kernels::make_mask(positions);
-            WavefunctionStorage wfn_new(num_states);
 
             // For systems with more qubits (>16) the pragma yields x2-x4 performance boost in the micro benchmarks run
             // on a machine with 16 cores. For systems with fewer qubits (<10) the pragma might regress perf somewhat
@@ -624,51 +1361,165 @@ class Wavefunction
 #pragma omp parallel for schedule(static)
             for (int64_t basis_index = 0; basis_index < num_states; basis_index++)
             {
-                const size_t injected_index = detail::get_register(positions, basis_index);
-                const size_t original_term = detail::set_register(positions, mask, 0, basis_index);
-                wfn_new[basis_index] = wfn_[original_term] * amplitudes[injected_index];
+                if ((static_cast<size_t>(basis_index) & mask) != 0) continue;
+                const ComplexType original = wfn_[basis_index];
+                for (size_t j = 0; j < amplitudes.size(); ++j)
+                    wfn_[detail::set_register(positions, mask, j, basis_index)] = original * amplitudes[j];
             }
-            std::swap(wfn_, wfn_new);
         }
 
         return true;
     }
 
     /// measure a qubit
+    /// The measured qubit is taken out of the state, which halves it, and becomes a classical bit until a gate needs
+    /// it in the state again, unless that is turned off with `compact_measured`.
     bool measure(logical_qubit_id q)
     {
+        if (is_classical_bit(q)) return frame_x_[q];
         flush();
         std::uniform_real_distribution<double> uniform(0., 1.);
-        bool result = (uniform(rng_) < probability(q));
-        kernels::collapse(wfn_, get_qubit_position(q), result);
+        const double p = probability(q);
+        const bool result = (uniform(rng_) < p);
+        if (compact_measured_) return measure_out(q, result, p);
+        kernels::collapse(wfn_, get_qubit_position(q), result != frame_x_[q]);
         kernels::normalize(wfn_);
         return result;
     }
 
+    /// Whether `measure` takes measured qubits out of the state (the default). Keeping them saves growing the state
+    /// again if they are put back into superposition right away, at the cost of carrying zeros until then.
+    void compact_measured(bool on)
+    {
+        compact_measured_ = on;
+    }
+
     bool jointmeasure(std::vector<logical_qubit_id> const& qs)
     {
+        const std::vector<logical_qubit_id> quantum = quantum_qubits(qs);
+        if (quantum.empty()) return frame_parity(qs);
         flush();
-        std::vector<positional_qubit_id> ps = get_qubit_positions(qs);
+        std::vector<positional_qubit_id> ps = get_qubit_positions(quantum);
         std::uniform_real_distribution<double> uniform(0., 1.);
         bool result = (uniform(rng_) < jointprobability(qs));
-        kernels::jointcollapse(wfn_, ps, result);
+        kernels::jointcollapse(wfn_, ps, result != frame_parity(qs));
         kernels::normalize(wfn_);
         return result;
     }
 
+    /// measure the Pauli string `bs` on the qubits `qs` directly, without rotating them into the computational basis
+    bool jointmeasure(std::vector<Gates::Basis> bs, std::vector<logical_qubit_id> qs)
+    {
+        const bool anticommutes = frame_anticommutes(bs, qs);
+        drop_classical_z(bs, qs);
+        if (qs.empty()) return anticommutes;
+        flush();
+        std::vector<positional_qubit_id> ps = get_qubit_positions(qs);
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        const double p = kernels::jointprobability(wfn_, bs, ps, !anticommutes);
+        bool result = (uniform(rng_) < p);
+        kernels::jointcollapse(wfn_, bs, ps, result != anticommutes, result ? p : 1. - p);
+        return result;
+    }
+
+    /// measure each of the qubits in the computational basis
+    /// The outcomes are sampled jointly from the marginal distribution of the qubits, which takes one pass to gather
+    /// and one to collapse per group, instead of three passes per qubit. A group holds as many qubits as the
+    /// histograms of all threads can count outcomes for in as many doubles as the state has amplitudes (at least
+    /// 2^16), and at most 31, so all qubits form a single group unless that would outgrow the state. Like `measure`,
+    /// the collapse takes the measured qubits out of the state unless that is turned off with `compact_measured`.
+    std::vector<bool> multimeasure(std::vector<logical_qubit_id> const& qs)
+    {
+        std::vector<bool> results(qs.size());
+        std::vector<size_t> quantum; // indices into qs of the qubits that are part of the state
+        for (size_t i = 0; i < qs.size(); ++i)
+        {
+            if (is_classical_bit(qs[i])) results[i] = frame_x_[qs[i]];
+            else quantum.push_back(i);
+        }
+        if (quantum.empty()) return results;
+
+        flush();
+        std::uniform_real_distribution<double> uniform(0., 1.);
+
+        const size_t threads = static_cast<size_t>(omp_get_max_threads());
+        for (size_t first = 0, group = 0; first < quantum.size(); first += group)
+        {
+            const size_t bins = std::max(wfn_.size(), size_t(1) << 16) / threads;
+            const size_t left = std::min(quantum.size() - first, size_t(31));
+            for (group = 1; group < left && (size_t(2) << group) <= bins; ++group)
+                ;
+            std::vector<logical_qubit_id> gqs;
+            for (size_t i = first; i < std::min(first + group, quantum.size()); ++i)
+                gqs.push_back(qs[quantum[i]]);
+            std::vector<positional_qubit_id> ps = get_qubit_positions(gqs);
+            std::vector<double> prob = kernels::marginal(wfn_, ps);
+
+            double r = uniform(rng_) * std::accumulate(prob.begin(), prob.end(), 0.);
+            size_t outcome = 0;
+            for (; outcome + 1 < prob.size() && r >= prob[outcome]; ++outcome)
+                r -= prob[outcome];
+            while (prob[outcome] == 0. && outcome > 0) // rounding may run past the last possible outcome
+                --outcome;
+
+            for (size_t l = 0; l < gqs.size(); ++l)
+                results[quantum[first + l]] = (((outcome >> l) & 1) == 1) != frame_x_[gqs[l]];
+            if (!compact_measured_)
+            {
+                kernels::multicollapse(wfn_, ps, outcome, prob[outcome]);
+                continue;
+            }
+
+            // like `measure_out` for the whole group, the positions above a removed one move down, so they are
+            // removed from the highest one
+            kernels::multicollapse_out(wfn_, ps, outcome, prob[outcome]);
+            std::vector<size_t> order(gqs.size());
+            std::iota(order.begin(), order.end(), size_t(0));
+            std::sort(order.begin(), order.end(), [&ps](size_t a, size_t b) { return ps[a] > ps[b]; });
+            for (size_t l : order)
+            {
+                remove_position(gqs[l], ps[l], (outcome >> l) & 1);
+                frame_x_[gqs[l]] = results[quantum[first + l]];
+                qubitmap_[gqs[l]] = classical_qubit_position();
+                ++num_classical_;
+            }
+        }
+        return results;
+    }
+
     void apply_controlled_exp(
         std::vector<Gates::Basis> const& bs,
         double phi,
-        std::vector<logical_qubit_id> const& cs,
+        std::vector<logical_qubit_id> cs,
         std::vector<logical_qubit_id> const& qs)
     {
-        flush();
-        kernels::apply_controlled_exp(wfn_, bs, phi, get_qubit_positions(cs), get_qubit_positions(qs));
+        // X in the frame of a control flips the control condition, so it has to be applied first. On the targets,
+        // the frame either commutes or anticommutes with the Pauli string, the latter flips the sign of the angle.
+        if (!resolve_classical_controls(cs)) return;
+        for (logical_qubit_id c : cs)
+        {
+            if (frame_x_[c]) materialize_frame(c);
+        }
+        if (std::any_of(qs.begin(), qs.end(), [this](logical_qubit_id q) { return is_classical_bit(q); }))
+        {
+            apply_controlled_exp_on_classical_bits(bs, phi, cs, qs);
+            return;
+        }
+        if (frame_anticommutes(bs, qs)) phi = -phi;
+
+        pending_gates_.emplace_back(cs, bs, phi, qs);
+        if (pending_gates_.size() > MAX_PENDING_GATES)
+        {
+            flush();
+        }
+
+        fused_.shouldFlush(wfn_, cs, qs.front());
     }
 
     /// checks if the qubit is in classical state
     bool isclassical(logical_qubit_id q) const
     {
+        if (is_classical_bit(q)) return true;
         flush();
         return kernels::isclassical(wfn_, get_qubit_position(q));
     }
@@ -677,34 +1528,103 @@ class Wavefunction
     /// \pre the qubit has to be in a classical state in the computational basis
     bool getvalue(logical_qubit_id q) const
     {
+        if (is_classical_bit(q)) return frame_x_[q];
         flush();
         assert(isclassical(q));
         int res = kernels::getvalue(wfn_, get_qubit_position(q));
         if (res == 2) std::cout << *this;
 
         assert(res < 2);
-        return res == 1;
+        return (res == 1) != frame_x_[q];
     }
 
-    /// the stored wave function as a vector
+    /// the stored wave function as a vector, with all allocated qubits in it, for dumps
     WavefunctionStorage const& data() const
+    {
+        for (logical_qubit_id q = 0; q < qubitmap_.size(); ++q)
+            materialize_qubit(q);
+        materialize_frame();
+        flush();
+        return wfn_;
+    }
+
+    /// the stored amplitudes with the pending gates applied, which leaves out the classical qubits and the Pauli frame
+    /// and thus doesn't grow the state, for queries about its memory
+    WavefunctionStorage const& storage() const
     {
         flush();
         return wfn_;
     }
 
+    /// sample measurement outcomes of the qubits without collapsing the state
+    /// Returns `shots` independent outcomes, each with the result for qs[l] in bit l. The uniform variates are sorted so
+    /// that a single sweep over the state resolves all of them, and the outcomes are shuffled afterwards. Throws
+    /// std::invalid_argument if an outcome has fewer bits than there are qubits.
+    std::vector<size_t> sample(std::vector<logical_qubit_id> const& qs, size_t shots)
+    {
+        if (qs.size() > 8 * sizeof(size_t))
+            throw std::invalid_argument("sample: an outcome holds at most 64 qubits");
+        // classical bits are 0 in the state, their outcome is the value in the frame
+        size_t flip = 0;
+        for (size_t l = 0; l < qs.size(); ++l)
+            if (frame_x_[qs[l]]) flip |= 1ull << l;
+        const std::vector<logical_qubit_id> quantum = quantum_qubits(qs);
+        if (quantum.empty()) return std::vector<size_t>(shots, flip);
+
+        flush();
+        std::uniform_real_distribution<double> uniform(0., 1.);
+        std::vector<double> u(shots);
+        for (double& x : u)
+            x = uniform(rng_);
+        std::sort(u.begin(), u.end());
+
+        std::vector<size_t> outcomes = kernels::sample(wfn_, u);
+        // the classical bits read the position above the state, which is 0 in every outcome
+        std::vector<positional_qubit_id> ps(qs.size(), num_qubits_);
+        for (size_t l = 0; l < qs.size(); ++l)
+            if (!is_classical_bit(qs[l])) ps[l] = get_qubit_position(qs[l]);
+        for (size_t& outcome : outcomes)
+            outcome = detail::get_register(ps, outcome) ^ flip;
+        std::shuffle(outcomes.begin(), outcomes.end(), rng_);
+        return outcomes;
+    }
+
     /// seed the random number engine for measurements
     void seed(unsigned s)
     {
         rng_.seed(s);
     }
 
+    /// uncontrolled Pauli gates are absorbed into the frame
+    void apply(Gates::X const& g)
+    {
+        frame_x_[g.qubit()] = !frame_x_[g.qubit()];
+    }
+
+    void apply(Gates::Y const& g)
+    {
+        // Y * X^x * Z^z = i * (-1)^x * X^(x+1) * Z^(z+1)
+        const logical_qubit_id q = g.qubit();
+        frame_phase_ = (frame_phase_ + (frame_x_[q] ? 3 : 1)) & 3;
+        frame_x_[q] = !frame_x_[q];
+        frame_z_[q] = !frame_z_[q];
+    }
+
+    void apply(Gates::Z const& g)
+    {
+        // Z * X^x * Z^z = (-1)^x * X^x * Z^(z+1)
+        const logical_qubit_id q = g.qubit();
+        if (frame_x_[q]) frame_phase_ = (frame_phase_ + 2) & 3;
+        frame_z_[q] = !frame_z_[q];
+    }
+
     /// generic application of a gate
     template <class Gate>
     void apply(Gate const& g)
     {
-        std::vector<logical_qubit_id> cs;
-        pending_gates_.emplace_back(cs, g.qubit(), g.matrix());
+        materialize_qubit(g.qubit());
+        QubitIds cs;
+        pending_gates_.emplace_back(cs, g.qubit(), through_frame(g.qubit(), g.matrix()));
         if (pending_gates_.size() > MAX_PENDING_GATES)
         {
             flush();
@@ -715,9 +1635,25 @@ class Wavefunction
 
     /// generic application of a multiply controlled gate
     template <class Gate>
-    void apply_controlled(std::vector<logical_qubit_id> cs, Gate const& g)
+    void apply_controlled(QubitIds cs, Gate const& g)
     {
-        pending_gates_.emplace_back(cs, g.qubit(), g.matrix());
+        // Controls that are classical bits either void the gate or drop out of it, which may leave an uncontrolled
+        // Pauli gate for the frame.
+        const size_t ncontrols = cs.size();
+        if (!resolve_classical_controls(cs)) return;
+        if (cs.size() == 0 && ncontrols > 0)
+        {
+            apply(g);
+            return;
+        }
+
+        // Z in the frame of a control commutes with the gate, X flips the control condition and has to be applied
+        for (logical_qubit_id c : cs)
+        {
+            if (frame_x_[c]) materialize_frame(c);
+        }
+        materialize_qubit(g.qubit());
+        pending_gates_.emplace_back(cs, g.qubit(), through_frame(g.qubit(), g.matrix()));
         if (pending_gates_.size() > MAX_PENDING_GATES)
         {
             flush();
@@ -730,19 +1666,57 @@ class Wavefunction
     template <class Gate>
     void apply_controlled(logical_qubit_id c, Gate const& g)
     {
-        apply_controlled(std::vector<logical_qubit_id>{c}, g);
+        apply_controlled(QubitIds{c}, g);
     }
 
     /// unoptimized application of a doubly controlled gate
     template <class Gate>
     void apply_controlled(logical_qubit_id c1, logical_qubit_id c2, Gate const& g)
     {
-        apply_controlled(std::vector<logical_qubit_id>{c1, c2}, g);
+        apply_controlled(QubitIds{c1, c2}, g);
+    }
+
+    /// SWAP of qubits a and b. The qubits trade their positions in the state instead of their amplitudes: the pending
+    /// gates are relabelled so they still act on the positions they were queued for, and the frames trade places too.
+    void swap(logical_qubit_id a, logical_qubit_id b)
+    {
+        if (a == b) return;
+        for (DeferredGate& g : pending_gates_)
+            g.swap_qubits(a, b);
+        std::swap(qubitmap_[a], qubitmap_[b]);
+        const bool xa = frame_x_[a], za = frame_z_[a];
+        frame_x_[a] = frame_x_[b];
+        frame_z_[a] = frame_z_[b];
+        frame_x_[b] = xa;
+        frame_z_[b] = za;
+    }
+
+    /// SWAP of qubits a and b controlled on `cs`, applied right away to the part of the state where all controls are
+    /// set.
+    void apply_controlled_swap(std::vector<logical_qubit_id> cs, logical_qubit_id a, logical_qubit_id b)
+    {
+        if (a == b || !resolve_classical_controls(cs)) return;
+        if (cs.empty())
+        {
+            swap(a, b);
+            return;
+        }
+
+        // X in the frame of a control flips the control condition, the frames of a and b don't commute with the swap
+        for (logical_qubit_id c : cs)
+        {
+            if (frame_x_[c]) materialize_frame(c);
+        }
+        materialize_frame(std::vector<logical_qubit_id>{a, b});
+        flush();
+        kernels::apply_controlled_swap(wfn_, get_qubit_positions(cs), get_qubit_position(a), get_qubit_position(b));
     }
 
     template <class A>
     bool subsytemwavefunction(std::vector<logical_qubit_id> const& qs, std::vector<T, A>& qubitswfn, double tolerance)
     {
+        materialize_qubits(qs);
+        materialize_frame();
         flush(); // we have to flush before we can extract the state
         return kernels::subsytemwavefunction(wfn_, get_qubit_positions(qs), qubitswfn, tolerance);
     }
@@ -757,7 +1731,8 @@ class Wavefunction
     /// Implementation notes: the current positions of the provided qubits might not match the order in which they are
     /// listed, so the unitary has to be Adjoint(V)*U*V, where V permutes the _provided qubits_ to match their positions
     /// to the requested, and U does the specified permutation of the _standard computational basis_ of these qubits.
-    /// Note, that the positions of the qubits in the end remain unchanged.
+    /// Note, that the positions of the qubits in the end remain unchanged. The permutation is applied in place by
+    /// rotating the amplitudes along its cycles (see kernels::permute_basis).
     void permute_basis(
         std::vector<logical_qubit_id> const& qs,
         size_t table_size,
@@ -775,47 +1750,11 @@ class Wavefunction
         assert(*(--permutations.end()) == table_size - 1); // max element in ordered set
 #endif
 
+        materialize_qubits(qs);
+        materialize_frame(qs);
         flush();
 
-        std::vector<positional_qubit_id> positions = get_qubit_positions(qs);
-
-        const size_t num_states = wfn_.size();
-        WavefunctionStorage psi_new(num_states);
-        const size_t qmask = kernels::make_mask(positions);
-
-        auto permute = [&positions, qmask, table_size, permutation_table](size_t basis_vector) {
-            size_t qstate = detail::get_register(positions, basis_vector);
-            return detail::set_register(positions, qmask, permutation_table[qstate], basis_vector);
-        };
-
-#ifndef NDEBUG
-        std::set<size_t> permuted;
-#endif
-        if (!adjoint)
-        {
-            for (size_t i = 0; i < num_states; ++i)
-            {
-                const size_t target = permute(i);
-                assert(permuted.insert(target).second); // should see no duplicates
-                psi_new[target] = wfn_[i];
-            }
-        }
-        else
-        {
-            for (size_t i = 0; i < num_states; ++i)
-            {
-                const size_t source = permute(i);
-                assert(permuted.insert(source).second); // should see no duplicates
-                psi_new[i] = wfn_[source];
-            }
-        }
-
-        // check that this was, indeed, a permutation of the basis
-        assert(permuted.size() == num_states);         // would follow if no duplicates encountered above
-        assert(*permuted.begin() == 0);                // min element in ordered set
-        assert(*(--permuted.end()) == num_states - 1); // max element in ordered set
-
-        std::swap(wfn_, psi_new);
+        kernels::permute_basis(wfn_, get_qubit_positions(qs), table_size, permutation_table, adjoint);
     }
 
     RngEngine& rng()
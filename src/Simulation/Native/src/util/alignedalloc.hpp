@@ -3,14 +3,29 @@
 
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <memory>
 #include <new>
+#include <string>
+#include <utility>
 
 #ifdef _WIN32
 #include <malloc.h>
-#else
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#endif
 #include <cstdlib>
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #include "SafeInt.hpp"
@@ -112,6 +127,303 @@ class AlignedAlloc
     }
 };
 
+/// An allocator for the state vector, whose blocks are zero when they are handed out. Linux and Windows place a page
+/// on the NUMA node of the thread that touches it first, so large blocks are not written here where the system can
+/// avoid it: on Linux and Windows they are mapped directly and stay untouched until the kernels (or the parallel
+/// growth of the state) first write them, elsewhere they are zero-filled right after allocation by all OpenMP threads,
+/// with the static schedule and the thread binding of the kernels. Either way each page lands on the node of the
+/// thread that will work on it, instead of all pages landing on the node of the thread that allocated the block.
+/// Untouched pages don't use memory yet. On Linux reserving capacity only reserves address space; on Windows the pages
+/// of a block are committed when it is allocated, so a reservation is charged against the commit limit in full even
+/// though it isn't backed until touched. That's why the kernels compact a reserved state in place rather than into a
+/// second block of its capacity. If QDK_SIM_HUGEPAGES is set to anything but 0, large blocks are aligned to 2 MiB and
+/// marked for transparent huge pages (Linux only).
+///
+/// If QDK_SIM_STATEDIR names a directory (Linux only), large blocks are mapped from temporary files in that directory
+/// instead, so that states larger than the memory of the machine spill to disk through the page cache. Such a state
+/// is simulated out of core: see `maps_files` and `prefetch` below, which the tiled flush uses to stream through it.
+///
+/// Since fresh blocks are zero, elements that std::vector value-initializes are left alone, which only works for
+/// element types like std::complex whose zero value is all zero bytes. Code that regrows a vector within its
+/// capacity (after shrinking it) has to zero the new elements itself, as kernels::grow does.
+
+template <typename T, unsigned Align = 64>
+class StateAlloc : public AlignedAlloc<T, Align>
+{
+    static_assert(Align <= 4096, "mapped blocks are only page aligned");
+
+  public:
+    using typename AlignedAlloc<T, Align>::pointer;
+    using typename AlignedAlloc<T, Align>::size_type;
+
+    template <typename U>
+    struct rebind
+    {
+        using other = StateAlloc<U, Align>;
+    };
+
+    /// blocks from this size on are mapped directly or touched in parallel
+    static constexpr std::size_t first_touch_bytes = std::size_t(1) << 20;
+    static constexpr std::size_t huge_page_bytes = std::size_t(1) << 21;
+
+    /// true if large blocks are left untouched, so that capacity costs no memory until it's used (but commit charge on
+    /// Windows)
+#if defined(__linux__) || defined(_WIN32)
+    static constexpr bool lazy_pages = true;
+#else
+    static constexpr bool lazy_pages = false;
+#endif
+
+    StateAlloc() noexcept = default;
+
+    StateAlloc(StateAlloc const&) noexcept = default;
+
+    template <typename U>
+    StateAlloc(StateAlloc<U, Align> const&) noexcept
+        : AlignedAlloc<T, Align>()
+    {
+    }
+
+    pointer allocate(size_type n)
+    {
+        SafeInt<size_type> sz(n);
+        sz *= sizeof(T);
+        const std::size_t bytes = sz;
+        if (bytes < first_touch_bytes)
+        {
+            pointer ptr = AlignedAlloc<T, Align>::allocate(n);
+            std::memset(static_cast<void*>(ptr), 0, bytes);
+            return ptr;
+        }
+
+        const bool huge = use_huge_pages() && bytes >= huge_page_bytes;
+#ifdef __linux__
+        if (!state_dir().empty()) return map_file(state_dir(), bytes);
+
+        // Over-map by 2 MiB for huge pages and unmap the unaligned head and tail. MAP_NORESERVE lets a reservation
+        // for more amplitudes than fit in memory succeed; only the pages that get touched are backed.
+        const std::size_t extra = huge ? huge_page_bytes : 0;
+        void* map = mmap(nullptr, bytes + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                         -1, 0);
+        if (map == MAP_FAILED) throw std::bad_alloc();
+        char* ptr = static_cast<char*>(map);
+        if (huge)
+        {
+            const std::size_t head =
+                (huge_page_bytes - reinterpret_cast<std::uintptr_t>(ptr) % huge_page_bytes) % huge_page_bytes;
+            if (head != 0) munmap(ptr, head);
+            if (extra - head != 0) munmap(ptr + head + bytes, extra - head);
+            ptr += head;
+            madvise(ptr, bytes, MADV_HUGEPAGE); // only a hint, the block is fine without huge pages
+        }
+        return reinterpret_cast<pointer>(ptr);
+#elif defined(_WIN32)
+        // Committed pages are backed and zeroed on first access, but count against the commit limit right away. The
+        // elements are written without a hook here, so the block can't be committed later as it grows. Large pages
+        // would need a privilege, so no huge pages.
+        (void)huge;
+        void* ptr = VirtualAlloc(nullptr, bytes, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+        if (ptr == nullptr) throw std::bad_alloc();
+        return reinterpret_cast<pointer>(ptr);
+#else
+        pointer ptr;
+        if (posix_memalign(reinterpret_cast<void**>(&ptr), huge ? huge_page_bytes : Align, bytes))
+            throw std::bad_alloc();
+        first_touch(reinterpret_cast<char*>(ptr), bytes);
+        return ptr;
+#endif
+    }
+
+    void deallocate(pointer ptr, size_type n) noexcept
+    {
+#if defined(__linux__) || defined(_WIN32)
+        // allocate succeeded for n, so this doesn't overflow
+        if (n * sizeof(T) >= first_touch_bytes)
+        {
+#ifdef _WIN32
+            VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+            munmap(ptr, n * sizeof(T));
+#endif
+            return;
+        }
+#endif
+        AlignedAlloc<T, Align>::deallocate(ptr, n);
+    }
+
+    /// value-initialization: the element is already zero
+    template <typename C>
+    void construct(C*)
+    {
+    }
+
+    template <typename C, class... Args>
+    void construct(C* c, Args&&... args)
+    {
+        new ((void*)c) C(std::forward<Args>(args)...);
+    }
+
+    /// true if pages of a mapped block can be moved and discarded (Linux only)
+#ifdef __linux__
+    static constexpr bool can_remap = true;
+#else
+    static constexpr bool can_remap = false;
+#endif
+
+    /// The number of elements in a page of a block of `capacity` elements, which is the granularity of `remap` and
+    /// `discard`, or 0 if the block isn't mapped directly. Blocks with huge pages count 2 MiB pages, so that moving
+    /// pages doesn't split them.
+    static size_type page_elements(size_type capacity)
+    {
+#ifdef __linux__
+        // discarding pages of a file would replace them with memory
+        const std::size_t bytes = capacity * sizeof(T); // capacity has been allocated, so this doesn't overflow
+        if (bytes < first_touch_bytes || !state_dir().empty()) return 0;
+        if (use_huge_pages() && bytes >= huge_page_bytes) return huge_page_bytes / sizeof(T);
+        return static_cast<std::size_t>(sysconf(_SC_PAGESIZE)) / sizeof(T);
+#else
+        (void)capacity;
+        return 0;
+#endif
+    }
+
+    /// Moves `n` elements from `src` to `dst` by moving their pages instead of copying them. Both have to lie in the
+    /// same block and on page boundaries (see page_elements), and must not overlap. Afterwards `src` has no pages, so
+    /// the caller has to move other elements there or `discard` it before it's read again.
+    static void remap(pointer dst, pointer src, size_type n)
+    {
+#ifdef __linux__
+        const std::size_t bytes = n * sizeof(T);
+        if (mremap(src, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, dst) != MAP_FAILED) return;
+        // The range can be split over several mappings by earlier moves, or the process can run out of them. The
+        // source stays mapped on failure, so copy instead.
+        std::memcpy(static_cast<void*>(dst), static_cast<void const*>(src), bytes);
+#else
+        std::copy_n(src, n, dst);
+#endif
+    }
+
+    /// Replaces the pages of `n` elements at `data` with zero pages that aren't backed yet, which returns their memory
+    /// to the system. The range has to lie on page boundaries.
+    static void discard(pointer data, size_type n)
+    {
+#ifdef __linux__
+        const std::size_t bytes = n * sizeof(T);
+        if (mmap(data, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) ==
+            MAP_FAILED)
+            throw std::bad_alloc();
+        if (use_huge_pages()) madvise(data, bytes, MADV_HUGEPAGE);
+#else
+        std::fill_n(data, n, T());
+#endif
+    }
+
+    /// Hints that `n` elements at `data` are about to be used, so that the pages of a block mapped from a file are read
+    /// ahead while the previous ones are being worked on.
+    static void prefetch(T const* data, size_type n)
+    {
+#ifdef __linux__
+        const std::uintptr_t page = static_cast<std::uintptr_t>(sysconf(_SC_PAGESIZE));
+        const std::uintptr_t begin = reinterpret_cast<std::uintptr_t>(data) & ~(page - 1);
+        const std::uintptr_t end = reinterpret_cast<std::uintptr_t>(data + n);
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_WILLNEED);
+#else
+        (void)data;
+        (void)n;
+#endif
+    }
+
+    /// Directory that large blocks are mapped from, empty for memory. Initialized from QDK_SIM_STATEDIR, and only
+    /// meant to be changed while no state vector is allocated.
+    static std::string& state_dir()
+    {
+        static std::string dir = []() {
+#ifdef _MSC_VER
+            return std::string(); // not supported
+#else
+            const char* env = std::getenv("QDK_SIM_STATEDIR");
+            return std::string(env != nullptr ? env : "");
+#endif
+        }();
+        return dir;
+    }
+
+    /// true if QDK_SIM_HUGEPAGES asks for huge pages, read once per process
+    static bool use_huge_pages()
+    {
+        static const bool huge = []() {
+#ifdef _MSC_VER
+            char* env = NULL;
+            size_t len = 0;
+            if (_dupenv_s(&env, &len, "QDK_SIM_HUGEPAGES") != 0 || env == NULL) return false;
+            const bool set = env[0] != '\0' && std::strcmp(env, "0") != 0;
+            free(env);
+            return set;
+#else
+            const char* env = std::getenv("QDK_SIM_HUGEPAGES");
+            return env != nullptr && env[0] != '\0' && std::strcmp(env, "0") != 0;
+#endif
+        }();
+        return huge;
+    }
+
+  private:
+#ifdef __linux__
+    /// Maps `bytes` from a new file in `dir`, which reads as zero until written. The file is unlinked right away, so
+    /// its space is freed when the block is unmapped, or when the process ends.
+    static pointer map_file(std::string const& dir, std::size_t bytes)
+    {
+        std::string path = dir + "/qdk-sim-state-XXXXXX";
+        const int fd = mkstemp(&path[0]);
+        if (fd < 0) throw std::bad_alloc();
+        unlink(path.c_str());
+        void* map = MAP_FAILED;
+        if (ftruncate(fd, static_cast<off_t>(bytes)) == 0)
+            map = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (map == MAP_FAILED) throw std::bad_alloc();
+        return reinterpret_cast<pointer>(map);
+    }
+#endif
+
+    /// zero-fills the block in chunks of 4 KiB, split among the threads like the kernels split the state vector
+    static void first_touch(char* data, std::size_t bytes)
+    {
+        const std::intptr_t chunk = 4096;
+        const std::intptr_t nchunks = static_cast<std::intptr_t>((bytes + chunk - 1) / chunk);
+#pragma omp parallel for schedule(static) proc_bind(spread)
+        for (std::intptr_t c = 0; c < nchunks; ++c)
+        {
+            const std::size_t offset = static_cast<std::size_t>(c) * chunk;
+            std::memset(data + offset, 0, std::min<std::size_t>(chunk, bytes - offset));
+        }
+    }
+};
+
+/// Out-of-core hooks for state vectors with any allocator, only StateAlloc maps blocks from files.
+template <class A>
+bool maps_files(A const&)
+{
+    return false;
+}
+
+template <typename T, unsigned Align>
+bool maps_files(StateAlloc<T, Align> const&)
+{
+    return !StateAlloc<T, Align>::state_dir().empty();
+}
+
+template <class A, class T>
+void prefetch(A const&, T const*, std::size_t)
+{
+}
+
+template <typename T, unsigned Align>
+void prefetch(StateAlloc<T, Align> const&, T const* data, std::size_t n)
+{
+    StateAlloc<T, Align>::prefetch(data, n);
+}
+
 } // namespace SIMULATOR
 } // namespace Quantum
 } // namespace Microsoft
\ No newline at end of file
@@ -0,0 +1,56 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace Microsoft
+{
+namespace Quantum
+{
+
+/// Number of pages of the block [data, data + bytes) that reside on each NUMA node, entry i for node i, counted on at
+/// most `max_samples` evenly spaced pages. Pages that haven't been touched yet are not counted. Empty if the platform
+/// doesn't report page placement (only Linux does).
+inline std::vector<std::size_t> pages_per_node(void const* data, std::size_t bytes, std::size_t max_samples = 4096)
+{
+    std::vector<std::size_t> counts;
+#if defined(__linux__) && defined(SYS_move_pages)
+    if (bytes == 0 || max_samples == 0) return counts;
+    const std::size_t page = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+    const std::uintptr_t first = reinterpret_cast<std::uintptr_t>(data) / page;
+    const std::uintptr_t last = (reinterpret_cast<std::uintptr_t>(data) + bytes + page - 1) / page;
+    const std::size_t npages = static_cast<std::size_t>(last - first);
+
+    const std::size_t nsamples = npages < max_samples ? npages : max_samples;
+    std::vector<void*> pages(nsamples);
+    for (std::size_t i = 0; i < nsamples; ++i)
+        pages[i] = reinterpret_cast<void*>((first + i * npages / nsamples) * page);
+
+    // move_pages without target nodes only queries the node of each page
+    std::vector<int> status(nsamples, -1);
+    if (syscall(SYS_move_pages, 0, nsamples, pages.data(), nullptr, status.data(), 0) != 0) return counts;
+    for (int node : status)
+    {
+        if (node < 0) continue; // not present, or not accessible
+        if (counts.size() <= static_cast<std::size_t>(node)) counts.resize(node + 1, 0);
+        ++counts[node];
+    }
+#else
+    (void)data;
+    (void)bytes;
+    (void)max_samples;
+#endif
+    return counts;
+}
+
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,229 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+
+/// A vector of trivially copyable elements that keeps up to N of them inline and only goes to the heap when it grows
+/// beyond that. Used for the short lists of qubits attached to every gate, so that queuing a gate doesn't allocate.
+template <class T, std::size_t N>
+class SmallVector
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SmallVector only holds trivially copyable elements");
+
+  public:
+    using value_type = T;
+    using size_type = std::size_t;
+    using iterator = T*;
+    using const_iterator = T const*;
+    using reference = T&;
+    using const_reference = T const&;
+
+    SmallVector() {}
+
+    SmallVector(std::initializer_list<T> ini)
+    {
+        assign(ini.begin(), ini.end());
+    }
+
+    /// implicit on purpose: interfaces that take a SmallVector also accept the std::vector their callers have
+    template <class A>
+    SmallVector(std::vector<T, A> const& v)
+    {
+        assign(v.begin(), v.end());
+    }
+
+    template <class It>
+    SmallVector(It first, It last)
+    {
+        assign(first, last);
+    }
+
+    SmallVector(SmallVector const& rhs)
+    {
+        assign(rhs.begin(), rhs.end());
+    }
+
+    SmallVector(SmallVector&& rhs) noexcept
+    {
+        take(rhs);
+    }
+
+    SmallVector& operator=(SmallVector const& rhs)
+    {
+        if (this != &rhs) assign(rhs.begin(), rhs.end());
+        return *this;
+    }
+
+    SmallVector& operator=(SmallVector&& rhs) noexcept
+    {
+        if (this != &rhs)
+        {
+            heap_.reset();
+            take(rhs);
+        }
+        return *this;
+    }
+
+    template <class It>
+    void assign(It first, It last)
+    {
+        size_ = 0;
+        reserve(static_cast<size_type>(std::distance(first, last)));
+        for (; first != last; ++first)
+            data()[size_++] = *first;
+    }
+
+    /// grows the capacity to at least `n`, the heap is only used beyond N elements
+    void reserve(size_type n)
+    {
+        if (n <= capacity_) return;
+        size_type capacity = std::max(n, 2 * capacity_);
+        std::unique_ptr<T[]> heap(new T[capacity]);
+        std::copy(begin(), end(), heap.get());
+        heap_.swap(heap);
+        capacity_ = capacity;
+    }
+
+    void push_back(T const& x)
+    {
+        if (size_ == capacity_)
+        {
+            T copy = x; // `x` might live in this vector
+            reserve(size_ + 1);
+            data()[size_++] = copy;
+        }
+        else
+            data()[size_++] = x;
+    }
+
+    void pop_back()
+    {
+        assert(size_ > 0);
+        --size_;
+    }
+
+    void clear()
+    {
+        size_ = 0;
+    }
+
+    size_type size() const
+    {
+        return size_;
+    }
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+    size_type capacity() const
+    {
+        return capacity_;
+    }
+
+    T* data()
+    {
+        return heap_ ? heap_.get() : inline_;
+    }
+    T const* data() const
+    {
+        return heap_ ? heap_.get() : inline_;
+    }
+
+    iterator begin()
+    {
+        return data();
+    }
+    iterator end()
+    {
+        return data() + size_;
+    }
+    const_iterator begin() const
+    {
+        return data();
+    }
+    const_iterator end() const
+    {
+        return data() + size_;
+    }
+
+    reference operator[](size_type i)
+    {
+        assert(i < size_);
+        return data()[i];
+    }
+    const_reference operator[](size_type i) const
+    {
+        assert(i < size_);
+        return data()[i];
+    }
+    reference front()
+    {
+        return (*this)[0];
+    }
+    const_reference front() const
+    {
+        return (*this)[0];
+    }
+    reference back()
+    {
+        return (*this)[size_ - 1];
+    }
+    const_reference back() const
+    {
+        return (*this)[size_ - 1];
+    }
+
+    std::vector<T> to_vector() const
+    {
+        return std::vector<T>(begin(), end());
+    }
+
+    friend bool operator==(SmallVector const& lhs, SmallVector const& rhs)
+    {
+        return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
+    }
+    friend bool operator!=(SmallVector const& lhs, SmallVector const& rhs)
+    {
+        return !(lhs == rhs);
+    }
+
+  private:
+    /// moves the elements of `rhs` into this (empty) vector, stealing its heap buffer if it has one
+    void take(SmallVector& rhs)
+    {
+        size_ = rhs.size_;
+        if (rhs.heap_)
+        {
+            heap_.swap(rhs.heap_);
+            capacity_ = rhs.capacity_;
+        }
+        else
+        {
+            capacity_ = N;
+            std::copy(rhs.inline_, rhs.inline_ + rhs.size_, inline_);
+        }
+        rhs.size_ = 0;
+        rhs.capacity_ = N;
+    }
+
+    T inline_[N];
+    std::unique_ptr<T[]> heap_;
+    size_type size_ = 0;
+    size_type capacity_ = N;
+};
+
+} // namespace Quantum
+} // namespace Microsoft
@@ -0,0 +1,60 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <cstdio>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+#include "smallvector.hpp"
+
+// unlike assert, stays active in release builds
+#define CHECK(cond)                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (!(cond))                                                                                                   \
+        {                                                                                                              \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);                             \
+            std::abort();                                                                                              \
+        }                                                                                                              \
+    } while (false)
+
+int main()
+{
+    using namespace Microsoft::Quantum;
+    using Vec = SmallVector<unsigned, 4>;
+
+    // stays inline up to its static capacity
+    Vec v{1, 2, 3};
+    CHECK(v.size() == 3 && v.capacity() == 4);
+    v.push_back(4);
+    CHECK(v.capacity() == 4);
+    CHECK(v.to_vector() == std::vector<unsigned>({1, 2, 3, 4}));
+
+    // spills to the heap beyond it, keeping the elements
+    v.push_back(v[0]);
+    CHECK(v.size() == 5 && v.capacity() > 4);
+    CHECK(v.to_vector() == std::vector<unsigned>({1, 2, 3, 4, 1}));
+
+    // copies are deep, moves steal the heap buffer
+    Vec copy(v);
+    copy[0] = 7;
+    CHECK(v[0] == 1 && copy[0] == 7);
+    Vec moved(std::move(copy));
+    CHECK(moved.size() == 5 && moved[0] == 7 && copy.empty());
+
+    // a cleared vector keeps its capacity
+    const Vec::size_type capacity = moved.capacity();
+    moved.clear();
+    moved.assign(v.begin(), v.end());
+    CHECK(moved.capacity() == capacity && moved == v);
+
+    // inline moves copy the elements
+    Vec small(std::vector<unsigned>{5, 6});
+    Vec other;
+    other = std::move(small);
+    CHECK(other == Vec({5, 6}) && small.empty());
+    CHECK(other != v);
+
+    return 0;
+}
@@ -0,0 +1,119 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#pragma once
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace Microsoft
+{
+namespace Quantum
+{
+
+/// Fusion span and number of threads that ran fastest on this host, measured per state vector size. A profile file
+/// can hold the profiles of several simulators (e.g. double and single precision builds), one line per entry:
+///
+///     <tag> <number of qubits> <fusion span> <threads>
+///
+/// where the tag identifies the simulator and the host it was measured on. Lines starting with '#' are comments.
+class TuningProfile
+{
+  public:
+    struct Entry
+    {
+        unsigned qubits;
+        int span;
+        int threads; // 0 if the simulator runs without OpenMP
+    };
+
+    explicit TuningProfile(std::string tag = "")
+        : tag_(std::move(tag))
+    {
+    }
+
+    const std::string& tag() const
+    {
+        return tag_;
+    }
+    bool empty() const
+    {
+        return entries_.empty();
+    }
+    const std::vector<Entry>& entries() const
+    {
+        return entries_;
+    }
+
+    /// adds or replaces the entry for `qubits`
+    void set(unsigned qubits, int span, int threads)
+    {
+        auto it = std::lower_bound(
+            entries_.begin(), entries_.end(), qubits, [](Entry const& e, unsigned q) { return e.qubits < q; });
+        if (it != entries_.end() && it->qubits == qubits) *it = Entry{qubits, span, threads};
+        else entries_.insert(it, Entry{qubits, span, threads});
+    }
+
+    /// The entry of the largest measured size that doesn't exceed `qubits`, or of the smallest size if all measured
+    /// sizes are larger. Nullptr if the profile is empty.
+    const Entry* lookup(unsigned qubits) const
+    {
+        if (entries_.empty()) return nullptr;
+        auto it = std::upper_bound(
+            entries_.begin(), entries_.end(), qubits, [](unsigned q, Entry const& e) { return q < e.qubits; });
+        return it == entries_.begin() ? &entries_.front() : &*(it - 1);
+    }
+
+    /// Reads the entries with our tag from `path`. Returns false if the file can't be read or has no such entries.
+    bool load(std::string const& path)
+    {
+        entries_.clear();
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line))
+        {
+            Entry e;
+            if (parse(line, e)) set(e.qubits, e.span, e.threads);
+        }
+        return !entries_.empty();
+    }
+
+    /// Writes the entries to `path`, keeping the lines of other tags that are already in the file.
+    bool save(std::string const& path) const
+    {
+        std::vector<std::string> kept;
+        {
+            std::ifstream in(path);
+            std::string line;
+            Entry e;
+            while (std::getline(in, line))
+                if (!line.empty() && !parse(line, e)) kept.push_back(line);
+        }
+        if (kept.empty()) kept.push_back("# QDK simulator tuning profile: <tag> <qubits> <fusion span> <threads>");
+
+        std::ofstream out(path, std::ios::trunc);
+        for (std::string const& line : kept)
+            out << line << '\n';
+        for (Entry const& e : entries_)
+            out << tag_ << ' ' << e.qubits << ' ' << e.span << ' ' << e.threads << '\n';
+        return static_cast<bool>(out);
+    }
+
+  private:
+    /// true if `line` is an entry with our tag
+    bool parse(std::string const& line, Entry& e) const
+    {
+        std::istringstream in(line);
+        std::string tag;
+        return (in >> tag) && tag == tag_ && (in >> e.qubits >> e.span >> e.threads);
+    }
+
+    std::string tag_;
+    std::vector<Entry> entries_; // sorted by number of qubits
+};
+
+} // namespace Quantum
+} // namespace Microsoft
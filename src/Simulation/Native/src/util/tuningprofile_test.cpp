@@ -0,0 +1,46 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// Licensed under the MIT License.
+
+#include <cassert>
+#include <cstdio>
+
+#include "tuningprofile.hpp"
+
+int main()
+{
+    using namespace Microsoft::Quantum;
+
+    // lookup picks the largest measured size that doesn't exceed the request
+    TuningProfile p("avx2-8");
+    assert(p.lookup(20) == nullptr);
+    p.set(16, 4, 8);
+    p.set(10, 2, 1);
+    p.set(13, 3, 2);
+    assert(p.lookup(9)->qubits == 10);
+    assert(p.lookup(12)->span == 2);
+    assert(p.lookup(13)->threads == 2);
+    assert(p.lookup(30)->span == 4);
+    p.set(13, 1, 4);
+    assert(p.entries().size() == 3 && p.lookup(14)->span == 1);
+
+    // profiles of different tags share a file
+    const char* path = "tuningprofile_test.txt";
+    std::remove(path);
+    TuningProfile other("avx2single-8");
+    other.set(20, 5, 8);
+    assert(other.save(path));
+    assert(p.save(path));
+    assert(p.save(path)); // saving again replaces our lines
+
+    TuningProfile loaded("avx2-8");
+    assert(loaded.load(path));
+    assert(loaded.entries().size() == 3 && loaded.lookup(16)->span == 4 && loaded.lookup(16)->threads == 8);
+    TuningProfile loaded_other("avx2single-8");
+    assert(loaded_other.load(path) && loaded_other.entries().size() == 1);
+    TuningProfile missing("avx512-8");
+    assert(!missing.load(path) && missing.empty());
+
+    std::remove(path);
+    assert(!loaded.load(path));
+    return 0;
+}